@@ -9,11 +9,31 @@
 #include <sys/mman.h>
 #include <expat.h>
 #include <math.h>
+#include <zlib.h>
 #include "mapgenerator.h"
 #include <proj_api.h>
+#define REAL double
+#define VOID void
 #include <triangle.h>
 
 #define BUFF_SIZE 1048576
+#define TILE_SIZE 5000.0
+#define PYRAMID_TILE_PIXELS 512 // Screen pixels a tile is expected to cover at its level
+#define PYRAMID_MIN_FEATURE_PIXELS 2.0 // Features smaller than this are dropped
+#define LINE_FILE_MAGIC 0x4c4d4c47 // Starts .line files with a layout header
+#define LINE_LAYOUT_EXTRUDED 1
+#define LINE_LAYOUT_QUANTIZED 2
+#define POLY_FILE_MAGIC 0x4c4d5047 // Starts .poly files with a layout header
+#define POLY_LAYOUT_QUANTIZED 1
+#define VARINT_MAX_BYTES 5
+#define TILE_ARCHIVE_MAGIC 0x4c4d4147 // Starts and ends tile archives
+#define TILE_ARCHIVE_VERSION 2
+#define TILE_COMPRESSED_MAGIC 0x4c4d435a // Starts zlib compressed tile data
+#define ROUTING_MAX_TAGSETS 256 // Tagset numbers are stored in a byte
+#define STATE_FILE_MAGIC 0x4c4d5354 // Starts the node and way state of a build
+#define STATE_FILE_VERSION 2
+#define WAY_ARENA_BLOCK_SIZE (64*1024)
+#define MAP_ARENA_BLOCK_SIZE (16*1024*1024)
 
 typedef struct _WayNode WayNode;
 typedef struct _Tile Tile;
@@ -22,10 +42,16 @@ typedef struct _Way Way;
 typedef struct _TempRoutingWay TempRoutingWay;
 typedef struct _MapWay MapWay;
 typedef struct _MapPolygon MapPolygon;
+typedef struct _LineVertex LineVertex;
+typedef struct _TileArchiveEntry TileArchiveEntry;
+typedef struct _StoredWay StoredWay;
+typedef struct _ChangedNode ChangedNode;
+typedef struct _ChangedWay ChangedWay;
+typedef struct _DirtyTile DirtyTile;
 
 struct _Tile {
-    List *polygons;
-    List *ways;
+    Vector polygons;
+    Vector ways;
     int x;
     int y;
 };
@@ -42,6 +68,7 @@ struct _WayNode {
 };
 
 struct _Way {
+    unsigned int id;
     WayNode *start;
     WayNode *end;
     int oneway;
@@ -65,12 +92,68 @@ struct _MapPolygon {
     int size;
     unsigned char rgba[4];
     float *vertices;
+    int nrof_triangles;
+    int *triangles; // Vertex indices, three per triangle
     RoutingTagSet *tagset;
 };
 
+// Vertex layout uploaded by the renderer, must match LineVertex in
+// project/jni/glmaploader.h
+struct _LineVertex {
+    float x;
+    float y;
+    float z;
+    float tx;
+    float ty;
+    unsigned char outline_color[4];
+    unsigned char fill_color[4];
+};
+
+// Index entry of a tile in an archive, must match TileArchiveEntry in
+// project/jni/glmaploader.h
+struct _TileArchiveEntry {
+    int level;
+    int x;
+    int y;
+    unsigned int line_offset;
+    unsigned int line_size;
+    unsigned int polygon_offset;
+    unsigned int polygon_size;
+};
+
+// A way with recognized tags, as kept in the state file for updates
+struct _StoredWay {
+    unsigned int id;
+    int nrof_tags;
+    int nrof_refs;
+    TAG *tags;
+    unsigned int *refs;
+};
+
+// Node or way of a change file, with the action of the section it was in
+struct _ChangedNode {
+    int action;
+    unsigned int id;
+    double lat;
+    double lon;
+};
+
+struct _ChangedWay {
+    int action;
+    StoredWay way;
+};
+
+// Tile that has to be rewritten when updating
+struct _DirtyTile {
+    int level;
+    int x;
+    int y;
+};
+
+// A way of the routing graph, with the index of the node it leads from
 struct _TempRoutingWay {
-    int node_id;
-    RoutingWay *way;
+    unsigned int from;
+    RoutingWay way;
 };
 
 char *tag_keys[] = TAG_KEYS;
@@ -209,17 +292,65 @@ unsigned char polygon_colors[] = {
 
 /* Global variables */
 int depth;
+int two_pass;
+int extrude_lines;
+int use_expat;
+double quantize_resolution;
+int compress_tiles;
+double compress_raw_bytes;
+double compress_packed_bytes;
+double compress_inflate_time;
+double compress_read_time;
+unsigned int compress_read_sum;
+z_stream *compress_inflate_stream;
+FILE *archive;
+TileArchiveEntry *archive_index;
+int archive_tiles;
+int archive_index_size;
+int benchmark;
+int nrof_levels;
+int nrof_threads;
+int nodes_indexed;
 int node_count;
-List *node_list;
-RoutingNode **nodes;
+int nodes_allocated;
+RoutingNode *nodes;
+NodeIndex *node_index;
+TagMatcher *tag_matcher;
+Arena *way_arena;   // Nodes and tags of the way being parsed
+Arena *map_arena;   // Lines and polygons, for the whole run
+Arena *level_arena; // Simplified copies, clipped pieces and triangles of a pyramid level
 List *way_list;
-List *mapways;
-List *polygons;
+Vector mapways;
+Vector polygons;
+char *state_filename; // Node and way state written after a build, or updated with -u
+int update_state;
+int record_ways;
+Vector stored_ways;   // Ways kept for the state file, sorted by id when written
+Vector changed_nodes;
+Vector changed_ways;
+ChangedWay *changed_way;
+int change_action;
+unsigned int *change_refs;
+int change_refs_allocated;
+DirtyTile *dirty_tiles; // Sorted tiles to rewrite, all tiles are written if NULL
+int nrof_dirty_tiles;
+int dirty_tiles_allocated;
+double dirty_margin;
+char *routing_filename;
+char *ch_filename;      // Contraction hierarchy of the routing index
+RoutingProfile profile; // Profile of the contraction hierarchy and the routing benchmark
+TempRoutingWay *temp_ways; // Ways of the routing graph in the order they were parsed
+int nrof_temp_ways;
+int temp_ways_allocated;
 Way way;
 int *tagsetindex;
 RoutingTagSet *tagsets;
 int tagsetsize;
 int nrof_tagsets;
+int tagsets_allocated;
+int tagsetindex_allocated;
+int *tagset_table; // Open addressed hash table of tagset numbers, -1 if free
+int tagset_table_size;
 projPJ pj_merc, pj_latlong;
 
 double center_x = 1991418.0;
@@ -245,76 +376,233 @@ node_sort_cb(const void *n1, const void *n2)
     return 0;
 }
 
-int
-way_sort_cb(const void *n1, const void *n2)
-{
-    const TempRoutingWay *m1 = NULL;
-    const TempRoutingWay *m2 = NULL;
+RoutingNode *get_node(int id) {
+    int i;
 
-    if (!n1) return(1);
-    if (!n2) return(-1);
+    i = node_index_lookup(node_index, id);
+    if (i < 0)
+        return NULL;
+    return &nodes[i];
+}
 
-    m1 = n1;
-    m2 = n2;
+// Sort the parsed nodes by id so get_node() can search them
+void index_nodes() {
+    printf("Sorting list of nodes...\n");
+    routing_nodes_sort(nodes, node_count);
+    node_index = node_index_new(nodes, node_count);
+    printf("Indexed %d nodes in a %s table\n", node_count, 
+            node_index->dense ? "dense" : "paged");
+    nodes_indexed = 1;
+}
 
-    if (m1->node_id > m2->node_id)
-        return 1;
-    if (m1->node_id < m2->node_id)
-        return -1;
-    return 0;
+// Compare node lookups through the id index against binary search
+void benchmark_node_lookups() {
+    unsigned int *ids;
+    unsigned int seed;
+    double t, t_bsearch, t_index;
+    long found;
+    int i, n;
+
+    if (node_count == 0)
+        return;
+
+    // Look up ids in a scattered order, like the nd refs of ways
+    n = node_count < 10000000 ? 10000000 : node_count;
+    ids = malloc(n * sizeof(unsigned int));
+    seed = 12345;
+    for (i = 0; i < n; i++) {
+        seed = seed * 1103515245 + 12345;
+        ids[i] = nodes[(seed >> 4) % node_count].id;
+    }
+
+    found = 0;
+    t = current_time();
+    for (i = 0; i < n; i++)
+        found += routing_index_bsearch(nodes, ids[i], 0, node_count-1) >= 0;
+    t_bsearch = current_time() - t;
+
+    t = current_time();
+    for (i = 0; i < n; i++)
+        found += node_index_lookup(node_index, ids[i]) >= 0;
+    t_index = current_time() - t;
+
+    printf("Node lookups: binary search %.1f M/s, id index %.1f M/s (%ld found)\n",
+            n / t_bsearch * 1e-6, n / t_index * 1e-6, found);
+
+    free(ids);
 }
 
-RoutingNode *
-node_find(RoutingNode** nodes, int id, int low, int high) {
-    int mid;
+// Match the way tags by comparing against every recognized pair, as done
+// before the tag matcher, for comparison
+int tag_match_linear(const char *key, const char *value) {
+    int i;
 
-    if (high < low)
-        return NULL; // not found
+    for (i = 0; i < NROF_TAGS; i++) {
+        if (!strcmp(key, tag_keys[i]) && !strcmp(value, tag_values[i]))
+            return i;
+    }
+    return -1;
+}
 
-    mid = low + ((high - low) / 2);
-    if (nodes[mid]->id > id) {
-        return node_find(nodes, id, low, mid-1);
-    } else if (nodes[mid]->id < id) {
-        return node_find(nodes, id, mid+1, high);
-    } else {
-        return nodes[mid];
+void benchmark_tag_matching() {
+    // All recognized pairs, and common tags that are not recognized
+    char *other_keys[] = { "name", "oneway", "maxspeed", "surface", "highway", "building" };
+    char *other_values[] = { "Storgatan", "yes", "50", "asphalt", "unknown", "house" };
+    int nrof_other = sizeof(other_keys)/sizeof(char *);
+    int nrof_pairs = NROF_TAGS + nrof_other;
+    double t, t_linear, t_hash;
+    long found;
+    int i, n;
+
+    // Check that both ways agree before timing them
+    for (i = 0; i < nrof_pairs; i++) {
+        char *key = i < NROF_TAGS ? tag_keys[i] : other_keys[i - NROF_TAGS];
+        char *value = i < NROF_TAGS ? tag_values[i] : other_values[i - NROF_TAGS];
+        if (tag_match_linear(key, value) != tag_matcher_lookup(tag_matcher, key, value)) {
+            fprintf(stderr, "Tag matcher disagrees on %s=%s\n", key, value);
+            exit(-1);
+        }
+    }
+
+    n = 1000000;
+    found = 0;
+    t = current_time();
+    for (i = 0; i < n; i++) {
+        int k = i % nrof_pairs;
+        if (k < NROF_TAGS)
+            found += tag_match_linear(tag_keys[k], tag_values[k]) >= 0;
+        else
+            found += tag_match_linear(other_keys[k - NROF_TAGS], other_values[k - NROF_TAGS]) >= 0;
+    }
+    t_linear = current_time() - t;
+
+    t = current_time();
+    for (i = 0; i < n; i++) {
+        int k = i % nrof_pairs;
+        if (k < NROF_TAGS)
+            found += tag_matcher_lookup(tag_matcher, tag_keys[k], tag_values[k]) >= 0;
+        else
+            found += tag_matcher_lookup(tag_matcher, other_keys[k - NROF_TAGS], 
+                    other_values[k - NROF_TAGS]) >= 0;
     }
+    t_hash = current_time() - t;
+
+    printf("Tag matching: linear %.1f M/s, perfect hash %.1f M/s (%ld found)\n",
+            n / t_linear * 1e-6, n / t_hash * 1e-6, found);
 }
 
-RoutingNode *get_node(int id) {
-    return node_find(nodes, id, 0, node_count-1);
+void set_node_position(RoutingNode *node, double lat, double lon) {
+    node->lat = lat;
+    node->lon = lon;
+
+    // Convert to Spherical Mercator projection
+    node->x = node->lon * DEG_TO_RAD;
+    node->y = node->lat * DEG_TO_RAD;
+    pj_transform(pj_latlong, pj_merc, 1, 1, &(node->x), &(node->y), NULL );
+}
+
+// Add a parsed node to the node array
+void
+node_handler(void *data, unsigned int id, double lat, double lon) {
+    RoutingNode *node;
+
+    if (nodes_indexed) {
+        fprintf(stderr, "Found a node after the ways, input is not ordered.\n"
+                "Rerun with -t to parse nodes and ways in two passes.\n");
+        exit(-1);
+    }
+
+    // Grow the node array geometrically
+    if (node_count == nodes_allocated) {
+        nodes_allocated = nodes_allocated ? 2*nodes_allocated : 65536;
+        nodes = realloc(nodes, nodes_allocated * sizeof(RoutingNode));
+        if (!nodes) {
+            fprintf(stderr, "Couldn't allocate memory for nodes\n");
+            exit(-1);
+        }
+    }
+
+    node = &nodes[node_count++];
+    node->id = id;
+    node->way.start = 0;
+    node->way.end = 0;
+    set_node_position(node, lat, lon);
+}
+
+void
+way_start_handler(void *data, unsigned int id) {
+    // The first way ends the node section, index the nodes before resolving it
+    if (!nodes_indexed)
+        index_nodes();
+
+    way.id = id;
+    way.size = 0;
+    way.start = NULL;
+    way.end = NULL;
+    way.oneway = 0;
+    way.tagset = arena_alloc(way_arena, sizeof(RoutingTagSet) + NROF_TAGS*sizeof(TAG));
+    way.tagset->size = 0;
+}
+
+void
+way_tag_handler(void *data, const char *key, const char *value) {
+    int i;
+
+    if (way.size == -1)
+        return;
+
+    if (!strcmp(key, "oneway") && 
+            (!strcmp(value, "yes") || !strcmp(value, "true")) ) {
+        // Current way is oneway
+        way.oneway = 1;
+    }
+    // Add recognized tags
+    i = tag_matcher_lookup(tag_matcher, key, value);
+    if (i >= 0 && way.tagset->size < NROF_TAGS) {
+        way.tagset->tags[way.tagset->size++] = i;
+    }
 }
 
+void
+way_node_handler(void *data, unsigned int ref) {
+    if (way.size == -1)
+        return;
+
+    // Add a node to the current way
+    way.size++;
+    if (!way.start) {
+        way.start = arena_alloc(way_arena, sizeof(WayNode));
+        way.end = way.start;
+        way.start->prev = NULL;
+        way.start->next = NULL;
+    } else {
+        way.end->next = arena_alloc(way_arena, sizeof(WayNode));
+        way.end->next->next = NULL;
+        way.end->next->prev = way.end;
+        way.end = way.end->next;
+    }
+    way.end->id = ref;
+}
 
 void
 nodeparser_start(void *data, const char *el, const char **attr) {
   int i;
 
   if (!strcmp(el, "node")) {
-      RoutingNode *node;
-
-      node_count++;
-
-      node = malloc(sizeof(RoutingNode));
-      node->way.start = 0;
-      node->way.end = 0;
+      unsigned int id = 0;
+      double lat = 0.0, lon = 0.0;
 
       /* Check all the attributes for this node */
       for (i = 0; attr[i]; i += 2) {
           if (!strcmp(attr[i], "id")) 
-              sscanf(attr[i+1], "%d", &(node->id));
+              sscanf(attr[i+1], "%u", &id);
           if (!strcmp(attr[i], "lat")) 
-              sscanf(attr[i+1], "%lf", &(node->lat));
+              sscanf(attr[i+1], "%lf", &lat);
           if (!strcmp(attr[i], "lon")) 
-              sscanf(attr[i+1], "%lf", &(node->lon));
+              sscanf(attr[i+1], "%lf", &lon);
       }
 
-      // Convert to Spherical Mercator projection
-      node->x = node->lon * DEG_TO_RAD;
-      node->y = node->lat * DEG_TO_RAD;
-      pj_transform(pj_latlong, pj_merc, 1, 1, &(node->x), &(node->y), NULL );
-
-      node_list = list_prepend(node_list, node);
+      node_handler(data, id, lat, lon);
   }
 
   depth++;
@@ -331,50 +619,38 @@ wayparser_start(void *data, const char *el, const char **attr) {
   int i;
 
   if (!strcmp(el, "way")) {
-      way.size = 0;
-      way.start = NULL;
-      way.end = NULL;
-      way.oneway = 0;
-      way.tagset = malloc(sizeof(RoutingTagSet));
-      way.tagset->size = 0;
+      unsigned int id = 0;
+
+      for (i = 0; attr[i]; i += 2) {
+          if (!strcmp(attr[i], "id")) 
+              sscanf(attr[i+1], "%u", &id);
+      }
+
+      way_start_handler(data, id);
   }
   else if (!strcmp(el, "tag") && way.size != -1) {
-      if (!strcmp(attr[0], "k") && !strcmp(attr[1], "oneway") &&
-              !strcmp(attr[2], "v") && 
-              (!strcmp(attr[3], "yes") || !strcmp(attr[3], "true")) ) {
-          // Current way is oneway
-          way.oneway = 1;
-      }
-      // Add recognized tags
-      for (i = 0; i < NROF_TAGS; i++) {
-          if (!strcmp(attr[0], "k") && !strcmp(attr[1], tag_keys[i]) &&
-                  !strcmp(attr[2], "v") && !strcmp(attr[3], tag_values[i])) {
-              way.tagset->size++;
-              way.tagset = realloc(way.tagset, sizeof(RoutingNode) + way.tagset->size*sizeof(TAG));
-              way.tagset->tags[way.tagset->size-1] = i;
-          }
+      const char *key = NULL, *value = NULL;
+
+      for (i = 0; attr[i]; i += 2) {
+          if (!strcmp(attr[i], "k")) 
+              key = attr[i+1];
+          else if (!strcmp(attr[i], "v")) 
+              value = attr[i+1];
       }
+
+      if (key && value)
+          way_tag_handler(data, key, value);
   }
   else if (!strcmp(el, "nd") && way.size != -1) {
-      // Add a node to the current way
-      way.size++;
-      if (!way.start) {
-          way.start = malloc(sizeof(WayNode));
-          way.end = way.start;
-          way.start->prev = NULL;
-          way.start->next = NULL;
-      } else {
-          way.end->next = malloc(sizeof(WayNode));
-          way.end->next->next = NULL;
-          way.end->next->prev = way.end;
-          way.end = way.end->next;
-      }
+      unsigned int ref = 0;
 
       /* Check all the attributes for this node */
       for (i = 0; attr[i]; i += 2) {
           if (!strcmp(attr[i], "ref")) 
-              sscanf(attr[i+1], "%d", &(way.end->id));
+              sscanf(attr[i+1], "%u", &ref);
       }
+
+      way_node_handler(data, ref);
   }
 
   depth++;
@@ -406,435 +682,2435 @@ int polygon_type_is_used(Way way) {
     return 0;
 }
 
+// Hash a tagset with sorted tags, FNV-1a over the size and the tags
+unsigned int tagset_hash(RoutingTagSet *ts) {
+    unsigned int hash = 2166136261u;
+    int i;
+
+    hash = (hash ^ ts->size) * 16777619u;
+    for (i = 0; i < ts->size; i++)
+        hash = (hash ^ ts->tags[i]) * 16777619u;
+    return hash;
+}
+
+// Insert a tagset number into the hash table, which must have a free slot
+void tagset_table_insert(int index) {
+    RoutingTagSet *ts = (void *)tagsets + tagsetindex[index];
+    unsigned int mask = tagset_table_size - 1;
+    unsigned int slot = tagset_hash(ts) & mask;
+
+    while (tagset_table[slot] >= 0)
+        slot = (slot + 1) & mask;
+    tagset_table[slot] = index;
+}
+
+// Return the number of the tagset of a way, adding it if it is new
 int add_tagset_to_index(Way way) {
-    int i, j, k;
-    
+    int i, j;
+    unsigned int mask, slot;
+    int size = sizeof(RoutingTagSet) + way.tagset->size*sizeof(TAG);
+
+    // Sort the tags so that equal tagsets are stored the same way
+    for (i = 1; i < way.tagset->size; i++) {
+        TAG tag = way.tagset->tags[i];
+        for (j = i; j > 0 && way.tagset->tags[j-1] > tag; j--)
+            way.tagset->tags[j] = way.tagset->tags[j-1];
+        way.tagset->tags[j] = tag;
+    }
+
     // Check if such a tagset exists in the index
-    for (i = 0; i < nrof_tagsets; i++) {
-        RoutingTagSet *ts = (void *)tagsets + tagsetindex[i];
-        if (ts->size == way.tagset->size) {
-            int is_same = 1;
-            for (j = 0; j < way.tagset->size; j++) {
-                int has_tag = 0;
-                for (k = 0; k < ts->size; k++) {
-                    if (ts->tags[k] == way.tagset->tags[j])
-                        has_tag = 1;
-                }
-                if (has_tag == 0)
-                    is_same = 0;
-            }
-            if (is_same) 
-                return tagsetindex[i];
+    if (tagset_table_size > 0) {
+        mask = tagset_table_size - 1;
+        slot = tagset_hash(way.tagset) & mask;
+        while (tagset_table[slot] >= 0) {
+            RoutingTagSet *ts = (void *)tagsets + tagsetindex[tagset_table[slot]];
+            if (ts->size == way.tagset->size && !memcmp(ts->tags, way.tagset->tags, 
+                        way.tagset->size*sizeof(TAG)))
+                return tagset_table[slot];
+            slot = (slot + 1) & mask;
         }
     }
 
     // Not found, add a new tagset to the end of the index
-    int newtagsetsize = tagsetsize + sizeof(RoutingTagSet) + way.tagset->size*sizeof(TAG);
-    tagsets = realloc(tagsets, newtagsetsize);
+    if (tagsetsize + size > tagsets_allocated) {
+        tagsets_allocated = 2*(tagsetsize + size);
+        tagsets = realloc(tagsets, tagsets_allocated);
+    }
+    if (nrof_tagsets == tagsetindex_allocated) {
+        tagsetindex_allocated = tagsetindex_allocated ? 2*tagsetindex_allocated : 256;
+        tagsetindex = realloc(tagsetindex, tagsetindex_allocated*sizeof(int));
+    }
 
     nrof_tagsets++;
-    tagsetindex = realloc(tagsetindex, nrof_tagsets*sizeof(int));
     tagsetindex[nrof_tagsets-1] = tagsetsize;
     RoutingTagSet *ts = (void *)tagsets + tagsetindex[nrof_tagsets-1];
 
-    memcpy(ts, way.tagset, sizeof(RoutingTagSet) + way.tagset->size*sizeof(TAG));
-    tagsetsize = newtagsetsize;
+    memcpy(ts, way.tagset, size);
+    tagsetsize += size;
+
+    // Keep the hash table at most half full
+    if (2*nrof_tagsets > tagset_table_size) {
+        free(tagset_table);
+        tagset_table_size = tagset_table_size ? 2*tagset_table_size : 512;
+        tagset_table = malloc(tagset_table_size*sizeof(int));
+        for (i = 0; i < tagset_table_size; i++)
+            tagset_table[i] = -1;
+        for (i = 0; i < nrof_tagsets; i++)
+            tagset_table_insert(i);
+    } else {
+        tagset_table_insert(nrof_tagsets-1);
+    }
 
-    return tagsetindex[nrof_tagsets-1];
+    return nrof_tagsets-1;
 }
 
-void
-wayparser_end(void *data, const char *el) {
-    int i, j, index;
-    WayNode *cn;
-    RoutingNode *nd, *nn, *pn;
-    Vec v, u, w, e;
-    double a;
-
-    if (!strcmp(el, "way")) {
-        if (way_type_is_used(way)) {
-            int error = 0;
-
-            // Add the tagset to the index
-            int tagset = add_tagset_to_index(way);
-
-            float width = 10.0;
-            MapWay* mapway = malloc(sizeof(MapWay));
-            mapway->length = 0;
-            mapway->width = 5.0;
-            mapway->tunnel = 0;
-            mapway->bridge = 0;
-            mapway->height = 0;
-            mapway->outline_color[0] = 0;
-            mapway->outline_color[1] = 0;
-            mapway->outline_color[2] = 0;
-            mapway->outline_color[3] = 0;
-            mapway->fill_color[0] = 0;
-            mapway->fill_color[1] = 0;
-            mapway->fill_color[2] = 0;
-            mapway->fill_color[3] = 0;
-            for (i = 0; i < nrof_used_highways; i++) {
-                for (j = 0; j < way.tagset->size; j++) {
-                    if (used_highways[i] == way.tagset->tags[j]) {
-                        mapway->width = highway_widths[i];
-                        mapway->height += highway_height_offsets[i];
-                        mapway->outline_color[0] = highway_outline_colors[4*i+0];
-                        mapway->outline_color[1] = highway_outline_colors[4*i+1];
-                        mapway->outline_color[2] = highway_outline_colors[4*i+2];
-                        mapway->outline_color[3] = highway_outline_colors[4*i+3];
-                        mapway->fill_color[0] = highway_fill_colors[4*i+0];
-                        mapway->fill_color[1] = highway_fill_colors[4*i+1];
-                        mapway->fill_color[2] = highway_fill_colors[4*i+2];
-                        mapway->fill_color[3] = highway_fill_colors[4*i+3];
-                    }
-                }
-            }
-            // Tunnel, bridge and layer
-            for (j = 0; j < way.tagset->size; j++) {
-                if (bridge_yes == way.tagset->tags[j]) {
-                    mapway->bridge = 1;
-                }
-                else if (tunnel_yes == way.tagset->tags[j]) {
-                    mapway->tunnel = 1;
-                }
-            }
-            if (mapway->tunnel || mapway->bridge) {
-                int no_layer = 1;
-                for (j = 0; j < way.tagset->size; j++) {
-                    if (layer_m5 == way.tagset->tags[j]) {
-                        mapway->height += -5.0;
-                        no_layer = 0;
-                    }
-                    else if (layer_m4 == way.tagset->tags[j]) {
-                        mapway->height += -4.0;
-                        no_layer = 0;
-                    }
-                    else if (layer_m3 == way.tagset->tags[j]) {
-                        mapway->height += -3.0;
-                        no_layer = 0;
-                    }
-                    else if (layer_m2 == way.tagset->tags[j]) {
-                        mapway->height += -2.0;
-                        no_layer = 0;
-                    }
-                    else if (layer_m1 == way.tagset->tags[j]) {
-                        mapway->height += -1.0;
-                        no_layer = 0;
-                    }
-                    else if (layer_0 == way.tagset->tags[j]) {
-                        mapway->height += 0.0;
-                        no_layer = 0;
-                    }
-                    else if (layer_1 == way.tagset->tags[j]) {
-                        mapway->height += 1.0;
-                        no_layer = 0;
-                    }
-                    else if (layer_2 == way.tagset->tags[j]) {
-                        mapway->height += 2.0;
-                        no_layer = 0;
-                    }
-                    else if (layer_3 == way.tagset->tags[j]) {
-                        mapway->height += 3.0;
-                        no_layer = 0;
-                    }
-                    else if (layer_4 == way.tagset->tags[j]) {
-                        mapway->height += 4.0;
-                        no_layer = 0;
-                    }
-                    else if (layer_5 == way.tagset->tags[j]) {
-                        mapway->height += 5.0;
-                        no_layer = 0;
-                    }
-                }
-                if (no_layer) {
-                    if (mapway->bridge) mapway->height += 1.0;
-                    if (mapway->tunnel) mapway->height -= 1.0;
-                }
-            }
+// Point in polygon test for a set of rings, using the even-odd rule
+int rings_contain_point(float *vertices, int *ring_sizes, int nrof_rings, double x, double y) {
+    int r, i, j, start, inside;
 
-            mapway->length = 0;
-            for (cn = way.start; cn; cn = cn->next)
-                mapway->length += 1;
-            mapway->vertices = malloc(mapway->length * 2 * sizeof(float));
-            i = 0;
-            for (cn = way.start; cn; cn = cn->next) {
-                // Get the node
-                nd = get_node(cn->id);
-                if (!nd) {
-                    // Node not found in index, abort
-                    error = 1;
-                    break;
-                }
-                //mapway->vertices[i++] = scale*(nd->x - center_x);
-                //mapway->vertices[i++] = scale*(nd->y - center_y);
-                mapway->vertices[i++] = nd->x;
-                mapway->vertices[i++] = nd->y;
-            }
+    inside = 0;
+    start = 0;
+    for (r = 0; r < nrof_rings; r++) {
+        float *v = vertices + 2*start;
+        int n = ring_sizes[r];
 
-            if (!error) {
-                mapways = list_append(mapways, mapway);
-            }
-            else {
-                free(mapway->vertices);
-                free(mapway);
-            }
+        for (i = 0, j = n-1; i < n; j = i++) {
+            if (((v[2*i+1] > y) != (v[2*j+1] > y)) &&
+                    (x < (v[2*j] - v[2*i]) * (y - v[2*i+1]) / (v[2*j+1] - v[2*i+1]) + v[2*i]))
+                inside = !inside;
         }
-        else if (polygon_type_is_used(way) && way.size > 2) {
-            int error = 0;
-
-            int size = way.size - 1; // Last point is repeat of first
-            MapPolygon *polygon = malloc(sizeof(MapPolygon));
-            polygon->size = size;
-            polygon->vertices = malloc(2 * size * sizeof(float));
-            for (cn = way.start, i = 0; i < size; cn = cn->next, i++) {
-                nd = get_node(cn->id);
-                if (!nd) {
-                    // Node not found in index, abort
-                    error = 1;
-                    break;
-                }
-                polygon->vertices[i*2] = nd->x;
-                polygon->vertices[i*2 + 1] = nd->y;
-            }
-            polygon->rgba[0] = 0;
-            polygon->rgba[1] = 0;
-            polygon->rgba[2] = 0;
-            polygon->rgba[3] = 0;
-            for (i = 0; i < nrof_used_polygons; i++) {
-                for (j = 0; j < way.tagset->size; j++) {
-                    if (used_polygons[i] == way.tagset->tags[j]) {
-                        polygon->rgba[0] = polygon_colors[4*i+0];
-                        polygon->rgba[1] = polygon_colors[4*i+1];
-                        polygon->rgba[2] = polygon_colors[4*i+2];
-                        polygon->rgba[3] = polygon_colors[4*i+3];
-                    }
-                }
-            }
+        start += n;
+    }
 
-            if (error) {
-                free(polygon->vertices);
-                free(polygon);
-            } else {
-                polygons = list_append(polygons, polygon);
-            }
+    return inside;
+}
 
-        }
+// Triangulate an area bounded by one or more rings, the first being the
+// outer ring and the rest holes. The rings are given as a constrained
+// outline to Triangle, and triangles that end up in holes are removed by
+// checking their centroids. Returns the number of triangles, with three
+// vertex indices per triangle in *triangles.
+int triangulate_rings(float *vertices, int *ring_sizes, int nrof_rings, int **triangles) {
+    struct triangulateio in, out;
+    int i, r, n, start, nrof_triangles;
+
+    *triangles = NULL;
+
+    n = 0;
+    for (r = 0; r < nrof_rings; r++)
+        n += ring_sizes[r];
+    if (n < 3)
+        return 0;
 
-        // Free the nodes
-        free(way.tagset);
-        cn = way.start;
-        while (cn) {
-            WayNode *next;
-            next = cn->next;
-            free(cn);
-            cn = next;
+    memset(&in, 0, sizeof(in));
+    memset(&out, 0, sizeof(out));
+
+    in.numberofpoints = n;
+    in.pointlist = malloc(2 * n * sizeof(REAL));
+    for (i = 0; i < 2*n; i++)
+        in.pointlist[i] = vertices[i];
+
+    in.numberofsegments = n;
+    in.segmentlist = malloc(2 * n * sizeof(int));
+    start = 0;
+    for (r = 0; r < nrof_rings; r++) {
+        for (i = 0; i < ring_sizes[r]; i++) {
+            in.segmentlist[2*(start+i)] = start + i;
+            in.segmentlist[2*(start+i) + 1] = start + (i+1) % ring_sizes[r];
         }
-        way.size = -1;
+        start += ring_sizes[r];
     }
 
-    depth--;
-}
-
+    // p: triangulate the outline, z: zero based indices, Q: quiet,
+    // N, P, B: skip output we don't use
+    triangulate("pzQNPB", &in, &out, NULL);
 
-int
-main(int argc, char **argv)
-{
-    File osmfile;
-    FILE *osmfilepointer;
-    struct stat st;
-    char *filename;
-    int i, j, ti, tj;
-    int done;
-    int len;
-    List *cn, *l;
-    RoutingWay *w;
-    RoutingNode *nd;
-    mapways = NULL;
-    polygons = NULL;
+    *triangles = arena_alloc(level_arena, 3 * out.numberoftriangles * sizeof(int));
+    nrof_triangles = 0;
+    for (i = 0; i < out.numberoftriangles; i++) {
+        int *t = &out.trianglelist[3*i];
 
-    
-    printf("Mapgenerator\n");
+        // Skip triangles using vertices added where the outline crosses itself
+        if (t[0] >= n || t[1] >= n || t[2] >= n)
+            continue;
 
-    if (argc > 1) {
-        filename = argv[1];
-    } else {
-        printf("Input file must be specified.\n");
-        return 0;
-    }
+        if (nrof_rings > 1) {
+            double cx = (vertices[2*t[0]] + vertices[2*t[1]] + vertices[2*t[2]]) / 3.0;
+            double cy = (vertices[2*t[0]+1] + vertices[2*t[1]+1] + vertices[2*t[2]+1]) / 3.0;
+            if (!rings_contain_point(vertices, ring_sizes, nrof_rings, cx, cy))
+                continue;
+        }
 
-    // Initialize projections
-    if (!(pj_merc = pj_init_plus("+proj=merc +a=6378137 +b=6378137 +lat_ts=0.0 +lon_0=0.0 +x_0=0.0 +y_0=0 +k=1.0 +units=m +nadgrids=@null +no_defs")) ) {
-        printf("Can't init Spherical Mercator projection.");
-        exit(1);
-    }
-    if (!(pj_latlong = pj_init_plus("+proj=latlong +datum=WGS84")) ) {
-        printf("Can't init latlong projection");
-        exit(1);
+        (*triangles)[3*nrof_triangles] = t[0];
+        (*triangles)[3*nrof_triangles + 1] = t[1];
+        (*triangles)[3*nrof_triangles + 2] = t[2];
+        nrof_triangles++;
     }
 
+    free(in.pointlist);
+    free(in.segmentlist);
+    trifree(out.trianglelist);
 
-    osmfile.file = strdup(filename);
-    osmfile.fd = -1;
-    osmfile.size = 0;
+    return nrof_triangles;
+}
 
-    /* Open file descriptor and stat the file to get size */
-    osmfile.fd = open(osmfile.file, O_RDONLY);
-    if (osmfile.fd < 0)
-        return 0;
-    if (fstat(osmfile.fd, &st) < 0) {
-        close(osmfile.fd);
-        return 0;
-    }
-    osmfile.size = st.st_size;
+void triangulate_polygon(MapPolygon *polygon) {
+    polygon->nrof_triangles = triangulate_rings(polygon->vertices, &polygon->size, 1,
+            &polygon->triangles);
+}
 
-    osmfilepointer = fopen(osmfile.file, "r");
-    if (!osmfilepointer) {
-        fprintf(stderr, "Can't open file\n");
-        exit(-1);
+// Liang-Barsky clipping of the segment from (x0, y0) to (x1, y1) against a
+// rectangle. Returns 0 if the segment is outside, otherwise the segment
+// parameters of the part inside are returned in *t0 and *t1.
+int clip_segment(double x0, double y0, double x1, double y1,
+        double min_x, double min_y, double max_x, double max_y, double *t0, double *t1) {
+    double p[4], q[4];
+    int i;
+
+    p[0] = -(x1 - x0); q[0] = x0 - min_x;
+    p[1] = x1 - x0;    q[1] = max_x - x0;
+    p[2] = -(y1 - y0); q[2] = y0 - min_y;
+    p[3] = y1 - y0;    q[3] = max_y - y0;
+
+    *t0 = 0.0;
+    *t1 = 1.0;
+    for (i = 0; i < 4; i++) {
+        if (p[i] == 0.0) {
+            // Parallel to this edge
+            if (q[i] < 0.0)
+                return 0;
+        } else {
+            double t = q[i] / p[i];
+            if (p[i] < 0.0) {
+                if (t > *t1) return 0;
+                if (t > *t0) *t0 = t;
+            } else {
+                if (t < *t0) return 0;
+                if (t < *t1) *t1 = t;
+            }
+        }
     }
 
-    printf("filesize: %d\n", osmfile.size);
+    return 1;
+}
 
+MapWay * map_way_piece(MapWay *mapway, float *vertices, int length) {
+    MapWay *piece = arena_alloc(level_arena, sizeof(MapWay));
 
-    // Set up an XML parser for the nodes
-    XML_Parser nodeparser = XML_ParserCreate(NULL);
-    if (!nodeparser) {
-        fprintf(stderr, "Couldn't allocate memory for parser\n");
-        exit(-1);
-    }
+    *piece = *mapway;
+    piece->length = length;
+    piece->vertices = arena_alloc(level_arena, 2 * length * sizeof(float));
+    memcpy(piece->vertices, vertices, 2 * length * sizeof(float));
 
-    XML_SetElementHandler(nodeparser, nodeparser_start, nodeparser_end);
+    return piece;
+}
 
-    depth = 0;
-    node_count = 0;
-    node_list = NULL;
+// Clip a way to a rectangle, appending the pieces inside it to the vector.
+// Returns the number of pieces added.
+int clip_way(MapWay *mapway, double min_x, double min_y, double max_x, double max_y,
+        Vector *ways, float *buffer) {
+    int i, length, nrof_pieces;
+    double t0, t1;
+    float x, y;
+
+    length = 0;
+    nrof_pieces = 0;
+    for (i = 0; i < mapway->length - 1; i++) {
+        double x0 = mapway->vertices[2*i];
+        double y0 = mapway->vertices[2*i + 1];
+        double x1 = mapway->vertices[2*i + 2];
+        double y1 = mapway->vertices[2*i + 3];
+
+        if (!clip_segment(x0, y0, x1, y1, min_x, min_y, max_x, max_y, &t0, &t1)) {
+            if (length > 1) {
+                vector_append(ways, map_way_piece(mapway, buffer, length));
+                nrof_pieces++;
+            }
+            length = 0;
+            continue;
+        }
 
-    /* Parse the XML document */
-    printf("Parsing nodes from XML file...\n");
-    for (;;) {
-        int bytes_read;
-        void *buff = XML_GetBuffer(nodeparser, BUFF_SIZE);
-        if (!buff) {
-            fprintf(stderr, "Couldn't allocate memory for buffer\n");
-            exit(-1);
+        if (length == 0) {
+            buffer[0] = x0 + t0*(x1 - x0);
+            buffer[1] = y0 + t0*(y1 - y0);
+            length = 1;
         }
-        bytes_read = fread(buff, 1, BUFF_SIZE, osmfilepointer);
-        if (bytes_read < 0) {
-            fprintf(stderr, "Can't read from file\n");
-            exit(-1);
+        x = x0 + t1*(x1 - x0);
+        y = y0 + t1*(y1 - y0);
+        // Segments only touching the edge give repeated points
+        if (buffer[2*length - 2] != x || buffer[2*length - 1] != y) {
+            buffer[2*length] = x;
+            buffer[2*length + 1] = y;
+            length++;
         }
 
-        if (! XML_ParseBuffer(nodeparser, bytes_read, bytes_read == 0)) {
-            fprintf(stderr, "Parse error at line %d:\n%s\n",
-                    (int)XML_GetCurrentLineNumber(nodeparser),
-                    XML_ErrorString(XML_GetErrorCode(nodeparser)));
-            exit(-1);
+        // The way leaves the rectangle, end the piece here
+        if (t1 < 1.0) {
+            if (length > 1) {
+                vector_append(ways, map_way_piece(mapway, buffer, length));
+                nrof_pieces++;
+            }
+            length = 0;
         }
-
-        if (bytes_read == 0)
-            break;
+    }
+    if (length > 1) {
+        vector_append(ways, map_way_piece(mapway, buffer, length));
+        nrof_pieces++;
     }
 
+    return nrof_pieces;
+}
 
-    // Create an indexed sorted list of nodes
-    printf("Sorting list of nodes...\n");
-    node_list = list_sort(node_list, node_sort_cb);
-    
-    nodes = malloc(node_count * sizeof(RoutingNode *));
-    i = 0;
-    cn = node_list;
-    while (cn) {
-        nodes[i++] = (RoutingNode *)(cn->data);
-        cn = cn->next;
+// Clip a polygon against one edge with Sutherland-Hodgman, keeping the
+// side where sign*(coordinate - limit) <= 0. Returns the new vertex count.
+int clip_polygon_edge(float *in, int n, float *out, int axis, double limit, double sign) {
+    int i, size;
+
+    size = 0;
+    for (i = 0; i < n; i++) {
+        float *a = &in[2*i];
+        float *b = &in[2*((i+1) % n)];
+        double da = sign*(a[axis] - limit);
+        double db = sign*(b[axis] - limit);
+
+        if (da <= 0.0) {
+            out[2*size] = a[0];
+            out[2*size + 1] = a[1];
+            size++;
+        }
+        if ((da < 0.0 && db > 0.0) || (da > 0.0 && db < 0.0)) {
+            double t = da / (da - db);
+            out[2*size] = a[0] + t*(b[0] - a[0]);
+            out[2*size + 1] = a[1] + t*(b[1] - a[1]);
+            size++;
+        }
     }
 
-    // Set up an XML parser for the ways
-    XML_Parser wayparser = XML_ParserCreate(NULL);
-    if (!wayparser) {
-        fprintf(stderr, "Couldn't allocate memory for parser\n");
-        exit(-1);
-    }
+    return size;
+}
 
-    XML_SetElementHandler(wayparser, wayparser_start, wayparser_end);
+// Clip a polygon to a rectangle, returns the part inside or NULL if none
+MapPolygon * clip_polygon(MapPolygon *polygon, double min_x, double min_y, double max_x, double max_y,
+        float *buffer1, float *buffer2) {
+    MapPolygon *piece;
+    int size;
 
-    depth = 0;
-    way.size = -1;
-    way_list = NULL;
-    tagsets = NULL;
-    tagsetindex = NULL;
-    tagsetsize = 0;
-    nrof_tagsets = 0;
+    // Each edge can add at most one vertex
+    size = clip_polygon_edge(polygon->vertices, polygon->size, buffer1, 0, min_x, -1.0);
+    size = clip_polygon_edge(buffer1, size, buffer2, 0, max_x, 1.0);
+    size = clip_polygon_edge(buffer2, size, buffer1, 1, min_y, -1.0);
+    size = clip_polygon_edge(buffer1, size, buffer2, 1, max_y, 1.0);
+    if (size < 3)
+        return NULL;
+
+    piece = arena_alloc(level_arena, sizeof(MapPolygon));
+    *piece = *polygon;
+    piece->size = size;
+    piece->vertices = arena_alloc(level_arena, 2 * size * sizeof(float));
+    memcpy(piece->vertices, buffer2, 2 * size * sizeof(float));
+
+    return piece;
+}
 
-    /* Parse the XML document */
-    printf("Parsing ways from XML file...\n");
-    fseek(osmfilepointer, 0, SEEK_SET);
-    for (;;) {
-        int bytes_read;
-        void *buff = XML_GetBuffer(wayparser, BUFF_SIZE);
-        if (!buff) {
-            fprintf(stderr, "Couldn't allocate memory for buffer\n");
-            exit(-1);
-        }
-        bytes_read = fread(buff, 1, BUFF_SIZE, osmfilepointer);
-        if (bytes_read < 0) {
-            fprintf(stderr, "Can't read from file\n");
-            exit(-1);
-        }
+// Copy the recognized tags and the nodes of the current way for the state file
+StoredWay * store_way() {
+    StoredWay *sw = arena_alloc(map_arena, sizeof(StoredWay));
+    WayNode *cn;
+    int i;
+
+    sw->id = way.id;
+    sw->nrof_tags = way.tagset->size;
+    sw->nrof_refs = way.size;
+    sw->tags = arena_alloc(map_arena, sw->nrof_tags * sizeof(TAG));
+    sw->refs = arena_alloc(map_arena, sw->nrof_refs * sizeof(unsigned int));
+    memcpy(sw->tags, way.tagset->tags, sw->nrof_tags * sizeof(TAG));
+    for (cn = way.start, i = 0; cn; cn = cn->next, i++)
+        sw->refs[i] = cn->id;
+    return sw;
+}
 
-        if (! XML_ParseBuffer(wayparser, bytes_read, bytes_read == 0)) {
-            fprintf(stderr, "Parse error at line %d:\n%s\n",
-                    (int)XML_GetCurrentLineNumber(nodeparser),
-                    XML_ErrorString(XML_GetErrorCode(nodeparser)));
+void add_temp_routing_way(unsigned int from, unsigned int to, int tagset) {
+    if (nrof_temp_ways == temp_ways_allocated) {
+        temp_ways_allocated = temp_ways_allocated ? 2*temp_ways_allocated : 65536;
+        temp_ways = realloc(temp_ways, temp_ways_allocated * sizeof(TempRoutingWay));
+        if (!temp_ways) {
+            fprintf(stderr, "Couldn't allocate memory for routing ways\n");
             exit(-1);
         }
+    }
+    temp_ways[nrof_temp_ways].from = from;
+    temp_ways[nrof_temp_ways].way.next = to;
+    temp_ways[nrof_temp_ways].way.tagset = tagset;
+    nrof_temp_ways++;
+}
 
-        if (bytes_read == 0)
-            break;
+// Add the steps between consecutive nodes of the current way to the
+// routing graph, in both directions unless the way is oneway
+void add_routing_ways(int tagset) {
+    WayNode *cn;
+    int from, to;
+
+    if (tagset >= ROUTING_MAX_TAGSETS) {
+        fprintf(stderr, "More than %d different tagsets on routable ways, "
+                "can't write a routing index\n", ROUTING_MAX_TAGSETS);
+        exit(-1);
     }
 
-    // Calculate array sizes
-    l = mapways;
-    int nrof_lines = 0;
-    int nrof_nodes = 0;
-    while (l) {
-        MapWay *mapway = l->data;
-        l = l->next;
-        nrof_nodes += mapway->length;
-        nrof_lines++;
+    for (cn = way.start; cn && cn->next; cn = cn->next) {
+        from = node_index_lookup(node_index, cn->id);
+        to = node_index_lookup(node_index, cn->next->id);
+        if (from < 0 || to < 0 || from == to)
+            continue;
+        add_temp_routing_way(from, to, tagset);
+        if (!way.oneway)
+            add_temp_routing_way(to, from, tagset);
     }
+}
 
-    l = polygons;
-    int nrof_vertices = 0;
-    int nrof_polygons = 0;
-    while (l) {
-        MapPolygon *polygon = l->data;
+void
+way_end_handler(void *data) {
+    int i, j, index;
+    WayNode *cn;
+    RoutingNode *nd, *nn, *pn;
+    Vec v, u, w, e;
+    double a;
+
+    if (way.size == -1)
+        return;
+
+    if (record_ways && way.tagset->size > 0)
+        vector_append(&stored_ways, store_way());
+
+    if (way_type_is_used(way)) {
+        int error = 0;
+
+        // Add the tagset to the index
+        int tagset = add_tagset_to_index(way);
+        if (routing_filename)
+            add_routing_ways(tagset);
+
+        float width = 10.0;
+        MapWay* mapway = arena_alloc(map_arena, sizeof(MapWay));
+        mapway->length = 0;
+        mapway->width = 5.0;
+        mapway->tunnel = 0;
+        mapway->bridge = 0;
+        mapway->height = 0;
+        mapway->outline_color[0] = 0;
+        mapway->outline_color[1] = 0;
+        mapway->outline_color[2] = 0;
+        mapway->outline_color[3] = 0;
+        mapway->fill_color[0] = 0;
+        mapway->fill_color[1] = 0;
+        mapway->fill_color[2] = 0;
+        mapway->fill_color[3] = 0;
+        for (i = 0; i < nrof_used_highways; i++) {
+            for (j = 0; j < way.tagset->size; j++) {
+                if (used_highways[i] == way.tagset->tags[j]) {
+                    mapway->width = highway_widths[i];
+                    mapway->height += highway_height_offsets[i];
+                    mapway->outline_color[0] = highway_outline_colors[4*i+0];
+                    mapway->outline_color[1] = highway_outline_colors[4*i+1];
+                    mapway->outline_color[2] = highway_outline_colors[4*i+2];
+                    mapway->outline_color[3] = highway_outline_colors[4*i+3];
+                    mapway->fill_color[0] = highway_fill_colors[4*i+0];
+                    mapway->fill_color[1] = highway_fill_colors[4*i+1];
+                    mapway->fill_color[2] = highway_fill_colors[4*i+2];
+                    mapway->fill_color[3] = highway_fill_colors[4*i+3];
+                }
+            }
+        }
+        // Tunnel, bridge and layer
+        for (j = 0; j < way.tagset->size; j++) {
+            if (bridge_yes == way.tagset->tags[j]) {
+                mapway->bridge = 1;
+            }
+            else if (tunnel_yes == way.tagset->tags[j]) {
+                mapway->tunnel = 1;
+            }
+        }
+        if (mapway->tunnel || mapway->bridge) {
+            int no_layer = 1;
+            for (j = 0; j < way.tagset->size; j++) {
+                if (layer_m5 == way.tagset->tags[j]) {
+                    mapway->height += -5.0;
+                    no_layer = 0;
+                }
+                else if (layer_m4 == way.tagset->tags[j]) {
+                    mapway->height += -4.0;
+                    no_layer = 0;
+                }
+                else if (layer_m3 == way.tagset->tags[j]) {
+                    mapway->height += -3.0;
+                    no_layer = 0;
+                }
+                else if (layer_m2 == way.tagset->tags[j]) {
+                    mapway->height += -2.0;
+                    no_layer = 0;
+                }
+                else if (layer_m1 == way.tagset->tags[j]) {
+                    mapway->height += -1.0;
+                    no_layer = 0;
+                }
+                else if (layer_0 == way.tagset->tags[j]) {
+                    mapway->height += 0.0;
+                    no_layer = 0;
+                }
+                else if (layer_1 == way.tagset->tags[j]) {
+                    mapway->height += 1.0;
+                    no_layer = 0;
+                }
+                else if (layer_2 == way.tagset->tags[j]) {
+                    mapway->height += 2.0;
+                    no_layer = 0;
+                }
+                else if (layer_3 == way.tagset->tags[j]) {
+                    mapway->height += 3.0;
+                    no_layer = 0;
+                }
+                else if (layer_4 == way.tagset->tags[j]) {
+                    mapway->height += 4.0;
+                    no_layer = 0;
+                }
+                else if (layer_5 == way.tagset->tags[j]) {
+                    mapway->height += 5.0;
+                    no_layer = 0;
+                }
+            }
+            if (no_layer) {
+                if (mapway->bridge) mapway->height += 1.0;
+                if (mapway->tunnel) mapway->height -= 1.0;
+            }
+        }
+
+        mapway->length = 0;
+        for (cn = way.start; cn; cn = cn->next)
+            mapway->length += 1;
+        mapway->vertices = arena_alloc(map_arena, mapway->length * 2 * sizeof(float));
+        i = 0;
+        for (cn = way.start; cn; cn = cn->next) {
+            // Get the node
+            nd = get_node(cn->id);
+            if (!nd) {
+                // Node not found in index, abort
+                error = 1;
+                break;
+            }
+            //mapway->vertices[i++] = scale*(nd->x - center_x);
+            //mapway->vertices[i++] = scale*(nd->y - center_y);
+            // Skip repeated nodes, a zero length segment has no direction
+            if (i > 0 && mapway->vertices[i-2] == (float)nd->x && mapway->vertices[i-1] == (float)nd->y)
+                continue;
+            mapway->vertices[i++] = nd->x;
+            mapway->vertices[i++] = nd->y;
+        }
+        mapway->length = i/2;
+
+        // A line needs two distinct points to be drawn
+        if (!error && mapway->length >= 2) {
+            vector_append(&mapways, mapway);
+        }
+    }
+    else if (polygon_type_is_used(way) && way.size > 2) {
+        int error = 0;
+
+        int size = way.size - 1; // Last point is repeat of first
+        MapPolygon *polygon = arena_alloc(map_arena, sizeof(MapPolygon));
+        polygon->size = size;
+        polygon->vertices = arena_alloc(map_arena, 2 * size * sizeof(float));
+        for (cn = way.start, i = 0; i < size; cn = cn->next, i++) {
+            nd = get_node(cn->id);
+            if (!nd) {
+                // Node not found in index, abort
+                error = 1;
+                break;
+            }
+            polygon->vertices[i*2] = nd->x;
+            polygon->vertices[i*2 + 1] = nd->y;
+        }
+        polygon->rgba[0] = 0;
+        polygon->rgba[1] = 0;
+        polygon->rgba[2] = 0;
+        polygon->rgba[3] = 0;
+        for (i = 0; i < nrof_used_polygons; i++) {
+            for (j = 0; j < way.tagset->size; j++) {
+                if (used_polygons[i] == way.tagset->tags[j]) {
+                    polygon->rgba[0] = polygon_colors[4*i+0];
+                    polygon->rgba[1] = polygon_colors[4*i+1];
+                    polygon->rgba[2] = polygon_colors[4*i+2];
+                    polygon->rgba[3] = polygon_colors[4*i+3];
+                }
+            }
+        }
+
+        if (!error) {
+            vector_append(&polygons, polygon);
+        }
+
+    }
+
+    // Free the nodes and tags
+    arena_reset(way_arena);
+    way.size = -1;
+}
+
+void
+wayparser_end(void *data, const char *el) {
+    if (!strcmp(el, "way"))
+        way_end_handler(data);
+
+    depth--;
+}
+
+// Single pass parser, relies on all nodes being listed before the ways
+void
+osmparser_start(void *data, const char *el, const char **attr) {
+    if (!strcmp(el, "node"))
+        nodeparser_start(data, el, attr);
+    else
+        wayparser_start(data, el, attr);
+}
+
+void
+osmparser_end(void *data, const char *el) {
+    wayparser_end(data, el);
+}
+
+void parse_osm_file(FILE *fp, XML_StartElementHandler start, XML_EndElementHandler end) {
+    XML_Parser parser = XML_ParserCreate(NULL);
+    if (!parser) {
+        fprintf(stderr, "Couldn't allocate memory for parser\n");
+        exit(-1);
+    }
+
+    XML_SetElementHandler(parser, start, end);
+
+    depth = 0;
+    fseek(fp, 0, SEEK_SET);
+    for (;;) {
+        int bytes_read;
+        void *buff = XML_GetBuffer(parser, BUFF_SIZE);
+        if (!buff) {
+            fprintf(stderr, "Couldn't allocate memory for buffer\n");
+            exit(-1);
+        }
+        bytes_read = fread(buff, 1, BUFF_SIZE, fp);
+        if (bytes_read < 0) {
+            fprintf(stderr, "Can't read from file\n");
+            exit(-1);
+        }
+
+        if (! XML_ParseBuffer(parser, bytes_read, bytes_read == 0)) {
+            fprintf(stderr, "Parse error at line %d:\n%s\n",
+                    (int)XML_GetCurrentLineNumber(parser),
+                    XML_ErrorString(XML_GetErrorCode(parser)));
+            exit(-1);
+        }
+
+        if (bytes_read == 0)
+            break;
+    }
+
+    XML_ParserFree(parser);
+}
+
+// Squared distance from point p to the segment from a to b
+double segment_distance2(float *p, float *a, float *b) {
+    double dx = b[0] - a[0];
+    double dy = b[1] - a[1];
+    double t = 0.0;
+    double ex, ey;
+
+    if (dx != 0.0 || dy != 0.0) {
+        t = ((p[0] - a[0])*dx + (p[1] - a[1])*dy) / (dx*dx + dy*dy);
+        if (t < 0.0) t = 0.0;
+        if (t > 1.0) t = 1.0;
+    }
+    ex = a[0] + t*dx - p[0];
+    ey = a[1] + t*dy - p[1];
+
+    return ex*ex + ey*ey;
+}
+
+// Douglas-Peucker simplification of a line, the kept vertices are written
+// to out and their number returned. The end points are always kept.
+int simplify_line(float *in, int n, float *out, double tolerance) {
+    unsigned char *keep;
+    int *stack;
+    int sp, i, size;
+    double tolerance2 = tolerance*tolerance;
+
+    if (n < 3) {
+        memcpy(out, in, 2 * n * sizeof(float));
+        return n;
+    }
+
+    keep = calloc(n, 1);
+    stack = malloc(2 * n * sizeof(int));
+    keep[0] = 1;
+    keep[n-1] = 1;
+
+    sp = 0;
+    stack[sp++] = 0;
+    stack[sp++] = n-1;
+    while (sp > 0) {
+        int last = stack[--sp];
+        int first = stack[--sp];
+        int index = -1;
+        double max_d2 = tolerance2;
+
+        for (i = first + 1; i < last; i++) {
+            double d2 = segment_distance2(&in[2*i], &in[2*first], &in[2*last]);
+            if (d2 > max_d2) {
+                max_d2 = d2;
+                index = i;
+            }
+        }
+
+        if (index >= 0) {
+            keep[index] = 1;
+            stack[sp++] = first;
+            stack[sp++] = index;
+            stack[sp++] = index;
+            stack[sp++] = last;
+        }
+    }
+
+    size = 0;
+    for (i = 0; i < n; i++) {
+        if (keep[i]) {
+            out[2*size] = in[2*i];
+            out[2*size + 1] = in[2*i + 1];
+            size++;
+        }
+    }
+
+    free(keep);
+    free(stack);
+
+    return size;
+}
+
+// Largest side of the bounding box of a set of vertices
+double vertices_extent(float *vertices, int n) {
+    double min_x, max_x, min_y, max_y;
+    int i;
+
+    min_x = max_x = vertices[0];
+    min_y = max_y = vertices[1];
+    for (i = 1; i < n; i++) {
+        min_x = fmin(min_x, vertices[2*i]);
+        max_x = fmax(max_x, vertices[2*i]);
+        min_y = fmin(min_y, vertices[2*i + 1]);
+        max_y = fmax(max_y, vertices[2*i + 1]);
+    }
+
+    return fmax(max_x - min_x, max_y - min_y);
+}
+
+// Simplified copies of the ways for a pyramid level, dropping small ones
+void simplify_ways(Vector *mapways, Vector *result, double pixel_size, int *nrof_vertices) {
+    MapWay *mapway;
+    float *buffer = NULL;
+    int buffer_size = 0;
+    int i;
+
+    *nrof_vertices = 0;
+    vector_foreach(mapways, i, mapway) {
+        int length;
+
+        if (mapway->length < 2 ||
+                vertices_extent(mapway->vertices, mapway->length) < PYRAMID_MIN_FEATURE_PIXELS*pixel_size)
+            continue;
+
+        if (mapway->length > buffer_size) {
+            buffer_size = mapway->length;
+            buffer = realloc(buffer, 2 * buffer_size * sizeof(float));
+        }
+        length = simplify_line(mapway->vertices, mapway->length, buffer, pixel_size);
+        vector_append(result, map_way_piece(mapway, buffer, length));
+        *nrof_vertices += length;
+    }
+    free(buffer);
+}
+
+// Simplified copies of the polygons for a pyramid level, dropping small ones
+void simplify_polygons(Vector *polygons, Vector *result, double pixel_size, int *nrof_vertices) {
+    MapPolygon *polygon;
+    float *ring = NULL, *buffer = NULL;
+    int buffer_size = 0;
+    int i;
+
+    *nrof_vertices = 0;
+    vector_foreach(polygons, i, polygon) {
+        MapPolygon *simplified;
+        int size;
+
+        if (vertices_extent(polygon->vertices, polygon->size) < PYRAMID_MIN_FEATURE_PIXELS*pixel_size)
+            continue;
+
+        if (polygon->size + 1 > buffer_size) {
+            buffer_size = polygon->size + 1;
+            ring = realloc(ring, 2 * buffer_size * sizeof(float));
+            buffer = realloc(buffer, 2 * buffer_size * sizeof(float));
+        }
+
+        // Simplify as a line closed by repeating the first vertex
+        memcpy(ring, polygon->vertices, 2 * polygon->size * sizeof(float));
+        ring[2*polygon->size] = polygon->vertices[0];
+        ring[2*polygon->size + 1] = polygon->vertices[1];
+        size = simplify_line(ring, polygon->size + 1, buffer, pixel_size) - 1;
+        if (size < 3)
+            continue;
+
+        simplified = arena_alloc(level_arena, sizeof(MapPolygon));
+        *simplified = *polygon;
+        simplified->size = size;
+        simplified->vertices = arena_alloc(level_arena, 2 * size * sizeof(float));
+        simplified->nrof_triangles = 0;
+        simplified->triangles = NULL;
+        memcpy(simplified->vertices, buffer, 2 * size * sizeof(float));
+        vector_append(result, simplified);
+        *nrof_vertices += size;
+    }
+    free(ring);
+    free(buffer);
+}
+
+void set_line_vertex(LineVertex *vertex, float x, float y, float z, float tx, float ty,
+        unsigned char *outline_color, unsigned char *fill_color) {
+    int k;
+
+    vertex->x = x;
+    vertex->y = y;
+    vertex->z = z;
+    vertex->tx = tx;
+    vertex->ty = ty;
+    for (k = 0; k < 4; k++) {
+        vertex->outline_color[k] = outline_color[k];
+        vertex->fill_color[k] = fill_color[k];
+    }
+}
+// Most vertices extrude_line() makes for a way, fewer if it has repeated points
+// Number of vertices extrude_line() makes for a way
+int extruded_line_size(MapWay *mapway) {
+    if (!mapway->bridge && !mapway->tunnel)
+        return 2*mapway->length + 6;
+    return 2*mapway->length + 2;
+}
+
+// Extrude a line into a triangle strip with normals, miters and rounded
+// caps. This is the same computation the renderer does in
+// unpackLinesToPolygons(), so the output can be uploaded as is.
+// Returns the number of vertices written.
+int extrude_line(MapWay *mapway, LineVertex *vertices) {
+    float *p;
+    int length = 0;
+    float width = mapway->width;
+    float z = mapway->height;
+    float vx, vy, ux, uy, wx, wy, a;
+    unsigned char outline_color[4];
+    unsigned char fill_color[4];
+    int caps = !mapway->bridge && !mapway->tunnel;
+    int ind = 0;
+    int n = 0;
+    int j, k;
+
+    for (k = 0; k < 4; k++) {
+        outline_color[k] = mapway->outline_color[k];
+        fill_color[k] = mapway->fill_color[k];
+    }
+    if (mapway->bridge) {
+        // Add an outline to all bridges
+        outline_color[0] = 144;
+        outline_color[1] = 144;
+        outline_color[2] = 144;
+        outline_color[3] = 255;
+    }
+
+    // Leave out repeated points, a zero length segment has no direction
+    // to take the normals from
+    p = malloc(2 * mapway->length * sizeof(float));
+    for (j = 0; j < mapway->length; j++) {
+        float x = mapway->vertices[2*j];
+        float y = mapway->vertices[2*j + 1];
+
+        if (length > 0 && p[2*(length-1)] == x && p[2*(length-1) + 1] == y)
+            continue;
+        p[2*length] = x;
+        p[2*length + 1] = y;
+        length++;
+    }
+    if (length < 2) {
+        free(p);
+        return 0;
+    }
+
+    // Calculate triangle corners for the given width
+    vx = p[2] - p[0];
+    vy = p[3] - p[1];
+    a = sqrt(vx*vx + vy*vy);
+    vx = vx/a;
+    vy = vy/a;
+
+    ux = -vy; uy = vx;
+
+    if (caps) {
+        // Add the first point twice to be able to draw with GL_TRIANGLE_STRIP,
+        // then once more for the rounded line end
+        set_line_vertex(&vertices[ind++], p[0] + ux*width - vx*width, p[1] + uy*width - vy*width,
+                z, -1.0, 1.0, outline_color, fill_color);
+        set_line_vertex(&vertices[ind++], p[0] + ux*width - vx*width, p[1] + uy*width - vy*width,
+                z, -1.0, 1.0, outline_color, fill_color);
+        set_line_vertex(&vertices[ind++], p[0] - ux*width - vx*width, p[1] - uy*width - vy*width,
+                z, 1.0, 1.0, outline_color, fill_color);
+    } else {
+        // Add the first point twice to be able to draw with GL_TRIANGLE_STRIP
+        set_line_vertex(&vertices[ind++], p[0] + ux*width, p[1] + uy*width,
+                z, -1.0, 0.0, outline_color, fill_color);
+    }
+    // Start of line
+    set_line_vertex(&vertices[ind++], p[0] + ux*width, p[1] + uy*width,
+            z, -1.0, 0.0, outline_color, fill_color);
+    set_line_vertex(&vertices[ind++], p[0] - ux*width, p[1] - uy*width,
+            z, 1.0, 0.0, outline_color, fill_color);
+    n++;
+
+    for (j = 1; j < length-1; j++) {
+        // Unit vector pointing back to previous node
+        vx = p[2*(n-1)] - p[2*n];
+        vy = p[2*(n-1) + 1] - p[2*n + 1];
+        a = sqrt(vx*vx + vy*vy);
+        vx = vx/a;
+        vy = vy/a;
+
+        // Unit vector pointing forward to next node
+        wx = p[2*(n+1)] - p[2*n];
+        wy = p[2*(n+1) + 1] - p[2*n + 1];
+        a = sqrt(wx*wx + wy*wy);
+        wx = wx/a;
+        wy = wy/a;
+
+        // Sum of these two vectors points along the miter
+        ux = vx + wx;
+        uy = vy + wy;
+        a = -wy*ux + wx*uy;
+        if (fabs(a) < 0.01) {
+            // Almost straight, use normal vector
+            ux = -wy; uy = wx;
+        } else {
+            // Normalize u, and project normal vector onto this
+            ux = ux/a;
+            uy = uy/a;
+        }
+
+        set_line_vertex(&vertices[ind++], p[2*n] + ux*width, p[2*n + 1] + uy*width,
+                z, -1.0, 0.0, outline_color, fill_color);
+        set_line_vertex(&vertices[ind++], p[2*n] - ux*width, p[2*n + 1] - uy*width,
+                z, 1.0, 0.0, outline_color, fill_color);
+        n++;
+    }
+    vx = p[2*(n-1)] - p[2*n];
+    vy = p[2*(n-1) + 1] - p[2*n + 1];
+    a = sqrt(vx*vx + vy*vy);
+    vx = vx/a;
+    vy = vy/a;
+
+    ux = vy; uy = -vx;
+    set_line_vertex(&vertices[ind++], p[2*n] + ux*width, p[2*n + 1] + uy*width,
+            z, -1.0, 0.0, outline_color, fill_color);
+    set_line_vertex(&vertices[ind++], p[2*n] - ux*width, p[2*n + 1] - uy*width,
+            z, 1.0, 0.0, outline_color, fill_color);
+
+    if (caps) {
+        // For rounded line edges, and the last vertex twice to be able to
+        // draw with GL_TRIANGLE_STRIP
+        set_line_vertex(&vertices[ind++], p[2*n] + ux*width - vx*width, p[2*n + 1] + uy*width - vy*width,
+                z, -1.0, -1.0, outline_color, fill_color);
+        set_line_vertex(&vertices[ind++], p[2*n] - ux*width - vx*width, p[2*n + 1] - uy*width - vy*width,
+                z, 1.0, -1.0, outline_color, fill_color);
+        set_line_vertex(&vertices[ind++], p[2*n] - ux*width - vx*width, p[2*n + 1] - uy*width - vy*width,
+                z, 1.0, -1.0, outline_color, fill_color);
+    } else {
+        // Add the last vertex twice to be able to draw with GL_TRIANGLE_STRIP
+        set_line_vertex(&vertices[ind++], p[2*n] - ux*width, p[2*n + 1] - uy*width,
+                z, 1.0, 0.0, outline_color, fill_color);
+    }
+
+    free(p);
+    return ind;
+}
+
+// Write lines with their attributes and untransformed vertices
+void write_lines(FILE *fp, Vector *ways) {
+    int nrof_lines = 0;
+    int nrof_nodes = 0;
+    MapWay *mapway;
+    int j;
+
+    vector_foreach(ways, j, mapway) {
+        nrof_nodes += mapway->length;
+        nrof_lines++;
+    }
+
+    fwrite(&nrof_lines, sizeof(int), 1, fp);
+    fwrite(&nrof_nodes, sizeof(int), 1, fp);
+    vector_foreach(ways, j, mapway) {
+        fwrite(&(mapway->length), sizeof(int), 1, fp);
+        fwrite(&(mapway->width), sizeof(float), 1, fp);
+        fwrite(&(mapway->height), sizeof(float), 1, fp);
+        fwrite(&(mapway->outline_color), sizeof(unsigned char), 4, fp);
+        fwrite(&(mapway->fill_color), sizeof(unsigned char), 4, fp);
+        fwrite(&(mapway->bridge), sizeof(int), 1, fp);
+        fwrite(&(mapway->tunnel), sizeof(int), 1, fp);
+    }
+    vector_foreach(ways, j, mapway) {
+        fwrite(mapway->vertices, sizeof(float), 2*mapway->length, fp);
+    }
+}
+
+// Write lines extruded to vertices ready for upload, after a layout header
+void write_extruded_lines(FILE *fp, Vector *ways) {
+    int magic = LINE_FILE_MAGIC;
+    int layout = LINE_LAYOUT_EXTRUDED;
+    int nrof_line_vertices = 0;
+    LineVertex *line_vertices;
+    MapWay *mapway;
+    int j;
+
+    vector_foreach(ways, j, mapway)
+        nrof_line_vertices += extruded_line_size(mapway);
+    line_vertices = malloc(nrof_line_vertices * sizeof(LineVertex));
+    nrof_line_vertices = 0;
+    vector_foreach(ways, j, mapway)
+        nrof_line_vertices += extrude_line(mapway, &line_vertices[nrof_line_vertices]);
+
+    fwrite(&magic, sizeof(int), 1, fp);
+    fwrite(&layout, sizeof(int), 1, fp);
+    fwrite(&nrof_line_vertices, sizeof(int), 1, fp);
+    fwrite(line_vertices, sizeof(LineVertex), nrof_line_vertices, fp);
+
+    free(line_vertices);
+}
+
+// Write an unsigned value to a buffer as a varint, 7 bits per byte
+int varint_put(unsigned char *buffer, unsigned int value) {
+    int n = 0;
+
+    while (value >= 0x80) {
+        buffer[n++] = (value & 0x7f) | 0x80;
+        value >>= 7;
+    }
+    buffer[n++] = value;
+    return n;
+}
+
+// Write vertices as offsets from the origin in units of the resolution,
+// each stored as the zig-zag encoded delta from the previous vertex
+int quantize_vertices(float *vertices, int n, double origin_x, double origin_y,
+        double resolution, unsigned char *buffer) {
+    int i, dx, dy;
+    int x = 0;
+    int y = 0;
+    int size = 0;
+
+    for (i = 0; i < n; i++) {
+        dx = lround((vertices[2*i] - origin_x)/resolution) - x;
+        dy = lround((vertices[2*i + 1] - origin_y)/resolution) - y;
+        size += varint_put(&buffer[size], ((unsigned int)dx << 1) ^ (dx >> 31));
+        size += varint_put(&buffer[size], ((unsigned int)dy << 1) ^ (dy >> 31));
+        x += dx;
+        y += dy;
+    }
+    return size;
+}
+
+// Return 1 if two ways are drawn the same way
+int map_way_style_equal(MapWay *a, MapWay *b) {
+    return a->width == b->width && a->height == b->height
+        && !memcmp(a->outline_color, b->outline_color, 4)
+        && !memcmp(a->fill_color, b->fill_color, 4)
+        && a->bridge == b->bridge && a->tunnel == b->tunnel;
+}
+
+// Write lines with quantized, delta encoded vertices after a layout header.
+// Attributes are written once per distinct style, each line then stores its
+// style index and length followed by its vertices.
+void write_quantized_lines(FILE *fp, Vector *ways, double origin_x, double origin_y, 
+        double resolution) {
+    int magic = LINE_FILE_MAGIC;
+    int layout = LINE_LAYOUT_QUANTIZED;
+    int nrof_lines = 0;
+    int nrof_nodes = 0;
+    int nrof_styles = 0;
+    int stream_size = 0;
+    int zero = 0;
+    int i;
+    float res = resolution;
+    MapWay **styles;
+    unsigned char *stream;
+    MapWay *mapway;
+    int j;
+
+    vector_foreach(ways, j, mapway) {
+        nrof_nodes += mapway->length;
+        nrof_lines++;
+    }
+    styles = malloc(nrof_lines * sizeof(MapWay *));
+    stream = malloc(2 * VARINT_MAX_BYTES * (nrof_nodes + nrof_lines));
+    vector_foreach(ways, j, mapway) {
+        for (i = 0; i < nrof_styles; i++)
+            if (map_way_style_equal(styles[i], mapway))
+                break;
+        if (i == nrof_styles)
+            styles[nrof_styles++] = mapway;
+        stream_size += varint_put(&stream[stream_size], i);
+        stream_size += varint_put(&stream[stream_size], mapway->length);
+        stream_size += quantize_vertices(mapway->vertices, mapway->length, 
+                origin_x, origin_y, resolution, &stream[stream_size]);
+    }
+
+    fwrite(&magic, sizeof(int), 1, fp);
+    fwrite(&layout, sizeof(int), 1, fp);
+    fwrite(&nrof_lines, sizeof(int), 1, fp);
+    fwrite(&nrof_nodes, sizeof(int), 1, fp);
+    fwrite(&origin_x, sizeof(double), 1, fp);
+    fwrite(&origin_y, sizeof(double), 1, fp);
+    fwrite(&res, sizeof(float), 1, fp);
+    fwrite(&nrof_styles, sizeof(int), 1, fp);
+    for (i = 0; i < nrof_styles; i++) {
+        // Same layout as the attributes of write_lines, the length is unused
+        fwrite(&zero, sizeof(int), 1, fp);
+        fwrite(&(styles[i]->width), sizeof(float), 1, fp);
+        fwrite(&(styles[i]->height), sizeof(float), 1, fp);
+        fwrite(&(styles[i]->outline_color), sizeof(unsigned char), 4, fp);
+        fwrite(&(styles[i]->fill_color), sizeof(unsigned char), 4, fp);
+        fwrite(&(styles[i]->bridge), sizeof(int), 1, fp);
+        fwrite(&(styles[i]->tunnel), sizeof(int), 1, fp);
+    }
+    fwrite(stream, 1, stream_size, fp);
+
+    free(styles);
+    free(stream);
+}
+
+// Write polygons with their colors, untransformed vertices and triangles
+void write_polygons(FILE *fp, Vector *polygons) {
+    int nrof_polygons = 0;
+    int nrof_vertices = 0;
+    int nrof_triangles = 0;
+    MapPolygon *polygon;
+    int j;
+
+    vector_foreach(polygons, j, polygon) {
+        nrof_vertices += polygon->size;
+        nrof_triangles += polygon->nrof_triangles;
+        nrof_polygons++;
+    }
+
+    fwrite(&nrof_polygons, sizeof(int), 1, fp);
+    fwrite(&nrof_vertices, sizeof(int), 1, fp);
+    vector_foreach(polygons, j, polygon) {
+        fwrite(&(polygon->size), sizeof(int), 1, fp);
+        fwrite(&(polygon->rgba), sizeof(unsigned char), 4, fp);
+    }
+    vector_foreach(polygons, j, polygon) {
+        fwrite(polygon->vertices, sizeof(float), 2*polygon->size, fp);
+    }
+    // Triangle section, indices are relative to the first vertex of each polygon
+    fwrite(&nrof_triangles, sizeof(int), 1, fp);
+    vector_foreach(polygons, j, polygon) {
+        fwrite(&(polygon->nrof_triangles), sizeof(int), 1, fp);
+    }
+    vector_foreach(polygons, j, polygon) {
+        fwrite(polygon->triangles, sizeof(int), 3*polygon->nrof_triangles, fp);
+    }
+}
+
+// Write polygons with quantized, delta encoded vertices after a layout header.
+// Colors are written once, each polygon then stores its color index, size
+// and number of triangles followed by its vertices and triangle indices.
+void write_quantized_polygons(FILE *fp, Vector *polygons, double origin_x, double origin_y, 
+        double resolution) {
+    int magic = POLY_FILE_MAGIC;
+    int layout = POLY_LAYOUT_QUANTIZED;
+    int nrof_polygons = 0;
+    int nrof_vertices = 0;
+    int nrof_triangles = 0;
+    int nrof_colors = 0;
+    int stream_size = 0;
+    int i;
+    float res = resolution;
+    unsigned char *colors;
+    unsigned char *stream;
+    MapPolygon *polygon;
+    int j;
+
+    vector_foreach(polygons, j, polygon) {
         nrof_vertices += polygon->size;
+        nrof_triangles += polygon->nrof_triangles;
         nrof_polygons++;
-        l = l->next;
     }
+    colors = malloc(4 * nrof_polygons);
+    stream = malloc(VARINT_MAX_BYTES * (3*nrof_polygons + 2*nrof_vertices + 3*nrof_triangles));
+    vector_foreach(polygons, j, polygon) {
+        for (i = 0; i < nrof_colors; i++)
+            if (!memcmp(&colors[4*i], polygon->rgba, 4))
+                break;
+        if (i == nrof_colors)
+            memcpy(&colors[4*nrof_colors++], polygon->rgba, 4);
+        stream_size += varint_put(&stream[stream_size], i);
+        stream_size += varint_put(&stream[stream_size], polygon->size);
+        stream_size += varint_put(&stream[stream_size], polygon->nrof_triangles);
+        stream_size += quantize_vertices(polygon->vertices, polygon->size, 
+                origin_x, origin_y, resolution, &stream[stream_size]);
+        for (i = 0; i < 3*polygon->nrof_triangles; i++)
+            stream_size += varint_put(&stream[stream_size], polygon->triangles[i]);
+    }
+
+    fwrite(&magic, sizeof(int), 1, fp);
+    fwrite(&layout, sizeof(int), 1, fp);
+    fwrite(&nrof_polygons, sizeof(int), 1, fp);
+    fwrite(&nrof_vertices, sizeof(int), 1, fp);
+    fwrite(&origin_x, sizeof(double), 1, fp);
+    fwrite(&origin_y, sizeof(double), 1, fp);
+    fwrite(&res, sizeof(float), 1, fp);
+    fwrite(&nrof_triangles, sizeof(int), 1, fp);
+    fwrite(&nrof_colors, sizeof(int), 1, fp);
+    fwrite(colors, sizeof(unsigned char), 4*nrof_colors, fp);
+    fwrite(stream, 1, stream_size, fp);
+
+    free(colors);
+    free(stream);
+}
+
+// Interleave the bits of the tile position, so that tiles close to each
+// other get codes close to each other
+unsigned long long morton_code(int x, int y) {
+    unsigned long long code = 0;
+    unsigned int ux = (unsigned int)x ^ 0x80000000;
+    unsigned int uy = (unsigned int)y ^ 0x80000000;
+    int i;
+
+    for (i = 0; i < 32; i++) {
+        code |= (unsigned long long)((ux >> i) & 1) << (2*i);
+        code |= (unsigned long long)((uy >> i) & 1) << (2*i + 1);
+    }
+    return code;
+}
+
+int
+tile_morton_cb(const void *t1, const void *t2)
+{
+    const Tile *tile1 = *(const Tile **)t1;
+    const Tile *tile2 = *(const Tile **)t2;
+    unsigned long long code1 = morton_code(tile1->x, tile1->y);
+    unsigned long long code2 = morton_code(tile2->x, tile2->y);
+
+    if (code1 < code2)
+        return -1;
+    else if (code1 > code2)
+        return 1;
+    return 0;
+}
+
+// Write tile data compressed with zlib, after a header with the sizes. When
+// benchmarking, also time decompressing it against reading it uncompressed,
+// as from a mapped file in the page cache.
+void write_compressed(FILE *fp, char *data, size_t size) {
+    int magic = TILE_COMPRESSED_MAGIC;
+    int raw_size = size;
+    int packed_size;
+    uLongf packed_length = compressBound(size);
+    Bytef *packed = malloc(packed_length);
+
+    if (compress2(packed, &packed_length, (Bytef *)data, size, Z_BEST_COMPRESSION) != Z_OK) {
+        fprintf(stderr, "Failed to compress tile data.\n");
+        exit(-1);
+    }
+    packed_size = packed_length;
+    fwrite(&magic, sizeof(int), 1, fp);
+    fwrite(&raw_size, sizeof(int), 1, fp);
+    fwrite(&packed_size, sizeof(int), 1, fp);
+    fwrite(packed, 1, packed_size, fp);
+
+    compress_raw_bytes += size;
+    compress_packed_bytes += 3*sizeof(int) + packed_size;
+    if (benchmark && size > 0) {
+        // Inflate the way the loader does, reusing one stream and buffer
+        Bytef *inflated = malloc(size);
+        size_t i;
+        double t;
+
+        if (!compress_inflate_stream) {
+            compress_inflate_stream = calloc(1, sizeof(z_stream));
+            inflateInit(compress_inflate_stream);
+        }
+        t = current_time();
+        inflateReset(compress_inflate_stream);
+        compress_inflate_stream->next_in = packed;
+        compress_inflate_stream->avail_in = packed_size;
+        compress_inflate_stream->next_out = inflated;
+        compress_inflate_stream->avail_out = size;
+        if (inflate(compress_inflate_stream, Z_FINISH) != Z_STREAM_END) {
+            fprintf(stderr, "Failed to decompress tile data.\n");
+            exit(-1);
+        }
+        compress_inflate_time += current_time() - t;
+
+        t = current_time();
+        for (i = 0; i + sizeof(int) <= size; i += sizeof(int))
+            compress_read_sum += *(unsigned int *)(data + i);
+        compress_read_time += current_time() - t;
+        free(inflated);
+    }
+    free(packed);
+}
+
+// Return the stream to write tile data to, in memory when compressing
+FILE * tile_stream_open(FILE *fp, char **data, size_t *size) {
+    if (!compress_tiles)
+        return fp;
+    return open_memstream(data, size);
+}
+
+// Finish writing tile data, compressing it to the file if needed
+void tile_stream_close(FILE *fp, FILE *stream, char **data, size_t *size) {
+    if (!compress_tiles)
+        return;
+    fclose(stream);
+    write_compressed(fp, *data, *size);
+    free(*data);
+}
+
+// Write the lines of a tile in the format selected by the options
+void write_tile_lines(FILE *fp, Tile *tile, double tile_size, double resolution) {
+    char *data;
+    size_t size;
+    FILE *stream = tile_stream_open(fp, &data, &size);
+
+    if (extrude_lines)
+        write_extruded_lines(stream, &tile->ways);
+    else if (quantize_resolution > 0.0)
+        write_quantized_lines(stream, &tile->ways, 
+                tile->x * tile_size, tile->y * tile_size, resolution);
+    else
+        write_lines(stream, &tile->ways);
+    tile_stream_close(fp, stream, &data, &size);
+}
+
+// Write the polygons of a tile in the format selected by the options
+void write_tile_polygons(FILE *fp, Tile *tile, double tile_size, double resolution) {
+    char *data;
+    size_t size;
+    FILE *stream = tile_stream_open(fp, &data, &size);
+
+    if (quantize_resolution > 0.0)
+        write_quantized_polygons(stream, &tile->polygons, 
+                tile->x * tile_size, tile->y * tile_size, resolution);
+    else
+        write_polygons(stream, &tile->polygons);
+    tile_stream_close(fp, stream, &data, &size);
+}
+
+// Return the current position in the archive, which must fit an index entry
+unsigned int archive_offset() {
+    long offset = ftell(archive);
+
+    if (offset < 0 || offset > 0xffffffffL) {
+        fprintf(stderr, "Tile archive too large.\n");
+        exit(-1);
+    }
+    return offset;
+}
+
+// Pad the archive with zeros to a multiple of 8 bytes, so that the doubles
+// in the headers of the layers and the index are aligned when it is mapped
+void align_archive() {
+    static const char zeros[8];
+    unsigned int offset = archive_offset();
+
+    fwrite(zeros, 1, (8 - offset % 8) % 8, archive);
+}
+
+// Append both layers of a tile to the archive and add it to the index
+void write_archive_tile(Tile *tile, int level, double tile_size, double resolution) {
+    TileArchiveEntry *entry;
+
+    if (archive_tiles == archive_index_size) {
+        archive_index_size = archive_index_size ? 2*archive_index_size : 1024;
+        archive_index = realloc(archive_index, archive_index_size * sizeof(TileArchiveEntry));
+    }
+    entry = &archive_index[archive_tiles++];
+    entry->level = level;
+    entry->x = tile->x;
+    entry->y = tile->y;
+
+    align_archive();
+    entry->line_offset = archive_offset();
+    write_tile_lines(archive, tile, tile_size, resolution);
+    entry->line_size = archive_offset() - entry->line_offset;
+
+    align_archive();
+    entry->polygon_offset = archive_offset();
+    write_tile_polygons(archive, tile, tile_size, resolution);
+    entry->polygon_size = archive_offset() - entry->polygon_offset;
+}
+
+void write_archive_header() {
+    int magic = TILE_ARCHIVE_MAGIC;
+    int version = TILE_ARCHIVE_VERSION;
+
+    fwrite(&magic, sizeof(int), 1, archive);
+    fwrite(&version, sizeof(int), 1, archive);
+}
+
+// Write the index after the tiles, and a footer to find it by
+void write_archive_index() {
+    int magic = TILE_ARCHIVE_MAGIC;
+    unsigned int index_offset;
+
+    align_archive();
+    index_offset = archive_offset();
+
+    fwrite(archive_index, sizeof(TileArchiveEntry), archive_tiles, archive);
+    fwrite(&archive_tiles, sizeof(int), 1, archive);
+    fwrite(&index_offset, sizeof(unsigned int), 1, archive);
+    fwrite(&magic, sizeof(int), 1, archive);
+}
+
+// Return the file name of a tile, level 0 tiles are named by position only
+void tile_filename(char *filename, int size, int level, int x, int y, const char *type) {
+    if (level == 0)
+        snprintf(filename, size-1, "%d_%d.%s", x, y, type);
+    else
+        snprintf(filename, size-1, "z%d_%d_%d.%s", level, x, y, type);
+}
+
+int
+stored_way_id_cb(const void *w1, const void *w2)
+{
+    const StoredWay *m1 = w1;
+    const StoredWay *m2 = w2;
+
+    if (m1->id > m2->id)
+        return 1;
+    if (m1->id < m2->id)
+        return -1;
+    return 0;
+}
+
+int
+changed_way_id_cb(const void *w1, const void *w2)
+{
+    const ChangedWay *m1 = w1;
+    const ChangedWay *m2 = w2;
+
+    return stored_way_id_cb(&m1->way, &m2->way);
+}
+
+int
+dirty_tile_cb(const void *t1, const void *t2)
+{
+    const DirtyTile *m1 = t1;
+    const DirtyTile *m2 = t2;
+
+    if (m1->level != m2->level)
+        return m1->level - m2->level;
+    if (m1->x != m2->x)
+        return m1->x - m2->x;
+    return m1->y - m2->y;
+}
+
+// Write the tile options, the nodes and the recognized ways, for a later
+// update with -u
+void write_state(const char *filename) {
+    int magic = STATE_FILE_MAGIC;
+    int version = STATE_FILE_VERSION;
+    int options[4];
+    StoredWay *sw;
+    FILE *fp;
+    int i;
+
+    printf("Writing state of %d nodes and %d ways (%s)...\n", 
+            node_count, stored_ways.size, filename);
+    fp = fopen(filename, "w");
+    if (!fp) {
+        fprintf(stderr, "Can't open state file for writing.\n");
+        exit(-1);
+    }
+    fwrite(&magic, sizeof(int), 1, fp);
+    fwrite(&version, sizeof(int), 1, fp);
+    fwrite(&node_count, sizeof(int), 1, fp);
+    fwrite(&stored_ways.size, sizeof(int), 1, fp);
+    options[0] = nrof_levels;
+    options[1] = extrude_lines;
+    options[2] = compress_tiles;
+    options[3] = archive != NULL;
+    fwrite(options, sizeof(int), 4, fp);
+    fwrite(&quantize_resolution, sizeof(double), 1, fp);
+    fwrite(nodes, sizeof(RoutingNode), node_count, fp);
+    vector_foreach(&stored_ways, i, sw) {
+        fwrite(&sw->id, sizeof(unsigned int), 1, fp);
+        fwrite(&sw->nrof_tags, sizeof(int), 1, fp);
+        fwrite(&sw->nrof_refs, sizeof(int), 1, fp);
+        fwrite(sw->tags, sizeof(TAG), sw->nrof_tags, fp);
+        fwrite(sw->refs, sizeof(unsigned int), sw->nrof_refs, fp);
+    }
+    fclose(fp);
+}
+
+// Read the state of a previous build. The tiles are written with the
+// options of that build, options given for the update must match them.
+void read_state(const char *filename) {
+    int header[4];
+    int options[4];
+    double resolution;
+    FILE *fp;
+    int i;
+
+    fp = fopen(filename, "r");
+    if (!fp) {
+        fprintf(stderr, "Can't open state file.\n");
+        exit(-1);
+    }
+    if (fread(header, sizeof(int), 4, fp) != 4 || header[0] != STATE_FILE_MAGIC) {
+        fprintf(stderr, "Not a state file: %s\n", filename);
+        exit(-1);
+    }
+    if (header[1] != STATE_FILE_VERSION) {
+        fprintf(stderr, "Unsupported state file version %d\n", header[1]);
+        exit(-1);
+    }
+    if (fread(options, sizeof(int), 4, fp) != 4 || fread(&resolution, sizeof(double), 1, fp) != 1) {
+        fprintf(stderr, "State file is truncated\n");
+        exit(-1);
+    }
+    if (options[3]) {
+        fprintf(stderr, "The state is of a build into an archive, rebuild it without -u\n");
+        exit(-1);
+    }
+    if ((nrof_levels != 1 && nrof_levels != options[0]) || (extrude_lines && !options[1]) ||
+            (compress_tiles && !options[2]) ||
+            (quantize_resolution > 0.0 && quantize_resolution != resolution)) {
+        fprintf(stderr, "Tile options differ from those of the build, which used -z %d", options[0]);
+        if (resolution > 0.0)
+            fprintf(stderr, " -q %g", resolution);
+        if (options[1])
+            fprintf(stderr, " -e");
+        if (options[2])
+            fprintf(stderr, " -c");
+        fprintf(stderr, "\n");
+        exit(-1);
+    }
+    nrof_levels = options[0];
+    extrude_lines = options[1];
+    compress_tiles = options[2];
+    quantize_resolution = resolution;
+
+    node_count = nodes_allocated = header[2];
+    nodes = malloc(node_count * sizeof(RoutingNode));
+    if (!nodes) {
+        fprintf(stderr, "Couldn't allocate memory for nodes\n");
+        exit(-1);
+    }
+    if (fread(nodes, sizeof(RoutingNode), node_count, fp) != node_count) {
+        fprintf(stderr, "State file is truncated\n");
+        exit(-1);
+    }
+
+    for (i = 0; i < header[3]; i++) {
+        StoredWay *sw = arena_alloc(map_arena, sizeof(StoredWay));
+
+        if (fread(&sw->id, sizeof(unsigned int), 1, fp) != 1 ||
+                fread(&sw->nrof_tags, sizeof(int), 1, fp) != 1 ||
+                fread(&sw->nrof_refs, sizeof(int), 1, fp) != 1) {
+            fprintf(stderr, "State file is truncated\n");
+            exit(-1);
+        }
+        sw->tags = arena_alloc(map_arena, sw->nrof_tags * sizeof(TAG));
+        sw->refs = arena_alloc(map_arena, sw->nrof_refs * sizeof(unsigned int));
+        if (fread(sw->tags, sizeof(TAG), sw->nrof_tags, fp) != sw->nrof_tags ||
+                fread(sw->refs, sizeof(unsigned int), sw->nrof_refs, fp) != sw->nrof_refs) {
+            fprintf(stderr, "State file is truncated\n");
+            exit(-1);
+        }
+        vector_append(&stored_ways, sw);
+    }
+    fclose(fp);
+
+    printf("Read state of %d nodes and %d ways\n", node_count, stored_ways.size);
+}
+
+// Bounding box of the nodes of a way, returns 0 if none of them are known
+int stored_way_bbox(StoredWay *sw, double *min_x, double *min_y, 
+        double *max_x, double *max_y) {
+    RoutingNode *nd;
+    int i, found = 0;
+
+    for (i = 0; i < sw->nrof_refs; i++) {
+        nd = get_node(sw->refs[i]);
+        if (!nd)
+            continue;
+        if (!found || nd->x < *min_x)
+            *min_x = nd->x;
+        if (!found || nd->x > *max_x)
+            *max_x = nd->x;
+        if (!found || nd->y < *min_y)
+            *min_y = nd->y;
+        if (!found || nd->y > *max_y)
+            *max_y = nd->y;
+        found = 1;
+    }
+    return found;
+}
+
+// Mark the tiles on every level that the current geometry of a way touches,
+// widened by the widest line so that the line caps are included
+void mark_dirty_tiles(StoredWay *sw) {
+    double min_x, min_y, max_x, max_y;
+    int level, x, y;
+
+    if (!stored_way_bbox(sw, &min_x, &min_y, &max_x, &max_y))
+        return;
+
+    for (level = 0; level < nrof_levels; level++) {
+        double tile_size = TILE_SIZE * (1 << level);
+        int x0 = floor((min_x - dirty_margin)/tile_size);
+        int x1 = floor((max_x + dirty_margin)/tile_size);
+        int y0 = floor((min_y - dirty_margin)/tile_size);
+        int y1 = floor((max_y + dirty_margin)/tile_size);
+
+        for (x = x0; x <= x1; x++) {
+            for (y = y0; y <= y1; y++) {
+                if (nrof_dirty_tiles == dirty_tiles_allocated) {
+                    dirty_tiles_allocated = dirty_tiles_allocated ? 2*dirty_tiles_allocated : 256;
+                    dirty_tiles = realloc(dirty_tiles, dirty_tiles_allocated * sizeof(DirtyTile));
+                }
+                dirty_tiles[nrof_dirty_tiles].level = level;
+                dirty_tiles[nrof_dirty_tiles].x = x;
+                dirty_tiles[nrof_dirty_tiles].y = y;
+                nrof_dirty_tiles++;
+            }
+        }
+    }
+}
+
+int tile_is_dirty(int level, int x, int y) {
+    DirtyTile key;
+
+    if (!dirty_tiles)
+        return 1;
+    key.level = level;
+    key.x = x;
+    key.y = y;
+    return bsearch(&key, dirty_tiles, nrof_dirty_tiles, sizeof(DirtyTile), dirty_tile_cb) != NULL;
+}
+
+// Return 1 if a way, widened like in mark_dirty_tiles, touches a dirty tile
+int stored_way_is_dirty(StoredWay *sw) {
+    double min_x, min_y, max_x, max_y;
+    int level, x, y;
+
+    if (!stored_way_bbox(sw, &min_x, &min_y, &max_x, &max_y))
+        return 0;
+
+    for (level = 0; level < nrof_levels; level++) {
+        double tile_size = TILE_SIZE * (1 << level);
+        int x0 = floor((min_x - dirty_margin)/tile_size);
+        int x1 = floor((max_x + dirty_margin)/tile_size);
+        int y0 = floor((min_y - dirty_margin)/tile_size);
+        int y1 = floor((max_y + dirty_margin)/tile_size);
+
+        for (x = x0; x <= x1; x++)
+            for (y = y0; y <= y1; y++)
+                if (tile_is_dirty(level, x, y))
+                    return 1;
+    }
+    return 0;
+}
+
+// Index of the last change of a way in the sorted changes, or -1
+int find_changed_way(unsigned int id) {
+    int low = 0;
+    int high = changed_ways.size - 1;
+    int found = -1;
+
+    while (low <= high) {
+        int mid = (low + high) / 2;
+        ChangedWay *cw = changed_ways.data[mid];
+
+        if (cw->way.id <= id) {
+            if (cw->way.id == id)
+                found = mid;
+            low = mid + 1;
+        } else {
+            high = mid - 1;
+        }
+    }
+    return found;
+}
+
+// Pass a stored way through the handlers, as if it was parsed again
+void replay_way(StoredWay *sw) {
+    int i;
+
+    way_start_handler(NULL, sw->id);
+    for (i = 0; i < sw->nrof_tags; i++)
+        way_tag_handler(NULL, tag_keys[sw->tags[i]], tag_values[sw->tags[i]]);
+    for (i = 0; i < sw->nrof_refs; i++)
+        way_node_handler(NULL, sw->refs[i]);
+    way_end_handler(NULL);
+}
+
+void
+change_handler(void *data, int action) {
+    change_action = action;
+}
+
+void
+change_node_handler(void *data, unsigned int id, double lat, double lon) {
+    ChangedNode *cn = arena_alloc(map_arena, sizeof(ChangedNode));
+
+    cn->action = change_action;
+    cn->id = id;
+    cn->lat = lat;
+    cn->lon = lon;
+    vector_append(&changed_nodes, cn);
+}
+
+void
+change_way_start_handler(void *data, unsigned int id) {
+    changed_way = arena_alloc(map_arena, sizeof(ChangedWay));
+    changed_way->action = change_action;
+    changed_way->way.id = id;
+    changed_way->way.nrof_tags = 0;
+    changed_way->way.nrof_refs = 0;
+    changed_way->way.tags = arena_alloc(map_arena, NROF_TAGS*sizeof(TAG));
+}
+
+void
+change_way_tag_handler(void *data, const char *key, const char *value) {
+    int i = tag_matcher_lookup(tag_matcher, key, value);
+
+    if (i >= 0 && changed_way->way.nrof_tags < NROF_TAGS)
+        changed_way->way.tags[changed_way->way.nrof_tags++] = i;
+}
+
+void
+change_way_node_handler(void *data, unsigned int ref) {
+    if (changed_way->way.nrof_refs == change_refs_allocated) {
+        change_refs_allocated = change_refs_allocated ? 2*change_refs_allocated : 256;
+        change_refs = realloc(change_refs, change_refs_allocated * sizeof(unsigned int));
+    }
+    change_refs[changed_way->way.nrof_refs++] = ref;
+}
+
+void
+change_way_end_handler(void *data) {
+    StoredWay *sw = &changed_way->way;
+
+    sw->refs = arena_alloc(map_arena, sw->nrof_refs * sizeof(unsigned int));
+    memcpy(sw->refs, change_refs, sw->nrof_refs * sizeof(unsigned int));
+    vector_append(&changed_ways, changed_way);
+}
+
+// Apply a change file to the state of a previous build, and collect the
+// lines and polygons of the tiles the changes touch. Only those tiles are
+// written by build_tiles afterwards.
+void apply_changes(const char *filename) {
+    OsmHandler handler;
+    Vector ways;
+    StoredWay *sw;
+    ChangedNode *cn;
+    char *node_changed, *node_deleted, *way_affected;
+    int i, j, k, nrof_old_nodes, nrof_rebuilt;
+
+    read_state(state_filename);
+    node_index = node_index_new(nodes, node_count);
+    nodes_indexed = 1;
+
+    handler.node = change_node_handler;
+    handler.way_start = change_way_start_handler;
+    handler.way_tag = change_way_tag_handler;
+    handler.way_node = change_way_node_handler;
+    handler.way_end = change_way_end_handler;
+    handler.change = change_handler;
+    handler.data = NULL;
+    change_action = OSC_MODIFY;
+    if (osc_parse_file(filename, &handler) < 0) {
+        fprintf(stderr, "Can't open file\n");
+        exit(-1);
+    }
+    // Stable, so the last change of a way in the file comes last
+    vector_sort(&changed_ways, changed_way_id_cb);
+    printf("Read %d node changes and %d way changes\n", 
+            changed_nodes.size, changed_ways.size);
+
+    dirty_margin = 0.0;
+    for (i = 0; i < nrof_used_highways; i++)
+        dirty_margin = fmax(dirty_margin, highway_widths[i]);
+
+    // Ways using changed nodes or changed themselves need the tiles of
+    // their old geometry rewritten
+    nrof_old_nodes = node_count;
+    node_changed = calloc(nrof_old_nodes, 1);
+    node_deleted = calloc(nrof_old_nodes, 1);
+    way_affected = calloc(stored_ways.size, 1);
+    vector_foreach(&changed_nodes, i, cn) {
+        j = node_index_lookup(node_index, cn->id);
+        if (j >= 0)
+            node_changed[j] = 1;
+    }
+    vector_foreach(&stored_ways, i, sw) {
+        int affected = find_changed_way(sw->id) >= 0;
 
-    // Determine bounding box for all points
-    double max_x, max_y, min_x, min_y;
-    min_x = nodes[0]->x;
-    max_x = nodes[0]->x;
-    min_y = nodes[0]->y;
-    max_y = nodes[0]->y;
+        for (k = 0; k < sw->nrof_refs && !affected; k++) {
+            j = node_index_lookup(node_index, sw->refs[k]);
+            affected = j >= 0 && node_changed[j];
+        }
+        if (affected)
+            mark_dirty_tiles(sw);
+        way_affected[i] = affected;
+    }
+
+    // Apply the node changes, new nodes are appended and sorted in below
+    vector_foreach(&changed_nodes, i, cn) {
+        j = node_index_lookup(node_index, cn->id);
+        if (cn->action == OSC_DELETE) {
+            if (j >= 0)
+                node_deleted[j] = 1;
+            continue;
+        }
+        if (j >= 0) {
+            set_node_position(&nodes[j], cn->lat, cn->lon);
+            node_deleted[j] = 0;
+            continue;
+        }
+        if (node_count == nodes_allocated) {
+            nodes_allocated = nodes_allocated ? 2*nodes_allocated : 65536;
+            nodes = realloc(nodes, nodes_allocated * sizeof(RoutingNode));
+            if (!nodes) {
+                fprintf(stderr, "Couldn't allocate memory for nodes\n");
+                exit(-1);
+            }
+        }
+        nodes[node_count].id = cn->id;
+        nodes[node_count].way.start = 0;
+        nodes[node_count].way.end = 0;
+        set_node_position(&nodes[node_count], cn->lat, cn->lon);
+        node_count++;
+    }
+    for (i = 0, j = 0; i < node_count; i++) {
+        if (i < nrof_old_nodes && node_deleted[i])
+            continue;
+        nodes[j++] = nodes[i];
+    }
+    node_count = j;
+    // The sort is stable, of nodes created more than once the last one is kept
+    routing_nodes_sort(nodes, node_count);
+    for (i = 0, j = 0; i < node_count; i++) {
+        if (j > 0 && nodes[j-1].id == nodes[i].id)
+            nodes[j-1] = nodes[i];
+        else
+            nodes[j++] = nodes[i];
+    }
+    node_count = j;
+    node_index_free(node_index);
+    node_index = node_index_new(nodes, node_count);
+
+    // Merge the changed ways into the stored ways, both sorted by id, and
+    // mark the tiles of the new geometry of the affected ones
+    vector_init(&ways);
+    i = 0;
+    k = 0;
+    while (i < stored_ways.size || k < changed_ways.size) {
+        ChangedWay *cw = NULL;
+
+        sw = i < stored_ways.size ? stored_ways.data[i] : NULL;
+        if (k < changed_ways.size) {
+            k = find_changed_way(((ChangedWay *)changed_ways.data[k])->way.id);
+            cw = changed_ways.data[k];
+        }
+        if (cw && (!sw || cw->way.id <= sw->id)) {
+            if (sw && sw->id == cw->way.id)
+                i++;
+            if (cw->action != OSC_DELETE && cw->way.nrof_tags > 0) {
+                vector_append(&ways, &cw->way);
+                mark_dirty_tiles(&cw->way);
+            }
+            k++;
+        } else {
+            if (way_affected[i])
+                mark_dirty_tiles(sw);
+            vector_append(&ways, sw);
+            i++;
+        }
+    }
+    vector_free(&stored_ways);
+    stored_ways = ways;
+    free(node_changed);
+    free(node_deleted);
+    free(way_affected);
+
+    qsort(dirty_tiles, nrof_dirty_tiles, sizeof(DirtyTile), dirty_tile_cb);
+    for (i = 0, j = 0; i < nrof_dirty_tiles; i++) {
+        if (j == 0 || dirty_tile_cb(&dirty_tiles[j-1], &dirty_tiles[i]))
+            dirty_tiles[j++] = dirty_tiles[i];
+    }
+    nrof_dirty_tiles = j;
+    if (!dirty_tiles) {
+        // Nothing changed that is drawn, keep the filter but with no tiles
+        dirty_tiles = malloc(sizeof(DirtyTile));
+    }
+
+    // Everything drawn in the dirty tiles is needed to rewrite them, in
+    // the same order as when parsing a file sorted by id
+    nrof_rebuilt = 0;
+    vector_foreach(&stored_ways, i, sw) {
+        if (stored_way_is_dirty(sw)) {
+            replay_way(sw);
+            nrof_rebuilt++;
+        }
+    }
+    printf("Rebuilding %d of %d ways in %d tiles\n", nrof_rebuilt, 
+            stored_ways.size, nrof_dirty_tiles);
+}
+
+// Build the routing graph in compressed sparse row form. The ways leading
+// from each node are stored contiguously, from way.start to way.end of the
+// node, and are placed there with a counting sort on the node they lead
+// from. Only nodes with ways are kept, still sorted by id.
+RoutingIndex * build_routing_index() {
+    RoutingIndex *ri = malloc(sizeof(RoutingIndex));
+    int *new_index = malloc(node_count * sizeof(int));
+    unsigned int start;
+    int i, n;
+
+    // Number the nodes that ways lead from or to
+    for (i = 0; i < node_count; i++)
+        new_index[i] = -1;
+    for (i = 0; i < nrof_temp_ways; i++) {
+        new_index[temp_ways[i].from] = 0;
+        new_index[temp_ways[i].way.next] = 0;
+    }
+    n = 0;
     for (i = 0; i < node_count; i++) {
-        if (nodes[i]->x > max_x)
-            max_x = nodes[i]->x;
-        if (nodes[i]->x < min_x)
-            min_x = nodes[i]->x;
-        if (nodes[i]->y > max_y)
-            max_y = nodes[i]->y;
-        if (nodes[i]->y < min_y)
-            min_y = nodes[i]->y;
+        if (new_index[i] == 0)
+            new_index[i] = n++;
     }
-    printf("Bounding box: %lf, %lf, %lf, %lf\n", min_x, min_y, max_x, max_y);
+
+    ri->nrof_nodes = n;
+    ri->nrof_ways = nrof_temp_ways;
+    ri->nodes = malloc(n * sizeof(RoutingNode));
+    ri->ways = malloc(nrof_temp_ways * sizeof(RoutingWay));
+    if (!ri->nodes || !ri->ways) {
+        fprintf(stderr, "Couldn't allocate memory for the routing index\n");
+        exit(-1);
+    }
+    for (i = 0; i < node_count; i++) {
+        if (new_index[i] >= 0) {
+            ri->nodes[new_index[i]] = nodes[i];
+            ri->nodes[new_index[i]].way.start = 0;
+            ri->nodes[new_index[i]].way.end = 0;
+        }
+    }
+
+    // Count the ways from each node, and turn the counts into ranges that
+    // start out empty
+    for (i = 0; i < nrof_temp_ways; i++)
+        ri->nodes[new_index[temp_ways[i].from]].way.end++;
+    start = 0;
+    for (i = 0; i < n; i++) {
+        unsigned int count = ri->nodes[i].way.end;
+        ri->nodes[i].way.start = start;
+        ri->nodes[i].way.end = start;
+        start += count;
+    }
+
+    // Place each way after the ones already placed for its node
+    for (i = 0; i < nrof_temp_ways; i++) {
+        RoutingNode *nd = &ri->nodes[new_index[temp_ways[i].from]];
+        ri->ways[nd->way.end].next = new_index[temp_ways[i].way.next];
+        ri->ways[nd->way.end].tagset = temp_ways[i].way.tagset;
+        nd->way.end++;
+    }
+
+    ri->nrof_tagsets = nrof_tagsets;
+    ri->tagsets_size = tagsetsize;
+    ri->tagsets = tagsets;
+    ri->tagset_offsets = tagsetindex;
+    ri->map = NULL;
+    ri->map_size = 0;
+    ri->way_lengths = NULL;
+    routing_index_build_spatial(ri);
+
+    free(new_index);
+    return ri;
+}
+
+// Write the routing index in the layout of RoutingFileHeader, the header is
+// written last when the offsets and the checksum are known
+void write_routing_index(RoutingIndex *ri, const char *filename) {
+    RoutingFileHeader header;
+    unsigned int offset = sizeof(RoutingFileHeader);
+    uLong checksum = adler32(0L, Z_NULL, 0);
+    FILE *fp;
+
+    memset(&header, 0, sizeof(RoutingFileHeader));
+    header.magic = ROUTING_FILE_MAGIC;
+    header.version = ROUTING_FILE_VERSION;
+    header.nrof_nodes = ri->nrof_nodes;
+    header.nrof_ways = ri->nrof_ways;
+    header.nrof_tagsets = ri->nrof_tagsets;
+    header.tagsets_size = ri->tagsets_size;
+
+    printf("Writing routing index of %d nodes, %d ways and %d tagsets (%s)...\n",
+            ri->nrof_nodes, ri->nrof_ways, ri->nrof_tagsets, filename);
+    fp = fopen(filename, "w");
+    if (!fp) {
+        fprintf(stderr, "Can't open routing index for writing.\n");
+        exit(-1);
+    }
+    fwrite(&header, sizeof(RoutingFileHeader), 1, fp);
+    header.nodes_offset = offset;
+    write_routing_section(fp, ri->nodes, ri->nrof_nodes * sizeof(RoutingNode), 
+            &offset, &checksum);
+    header.ways_offset = offset;
+    write_routing_section(fp, ri->ways, ri->nrof_ways * sizeof(RoutingWay), 
+            &offset, &checksum);
+    header.tagset_offsets_offset = offset;
+    write_routing_section(fp, ri->tagset_offsets, ri->nrof_tagsets * sizeof(int), 
+            &offset, &checksum);
+    header.tagsets_offset = offset;
+    write_routing_section(fp, ri->tagsets, ri->tagsets_size, &offset, &checksum);
+    header.spatial_offset = offset;
+    write_routing_section(fp, ri->spatial, ri->nrof_nodes * sizeof(unsigned int), 
+            &offset, &checksum);
+    header.file_size = offset;
+    header.checksum = checksum;
+
+    fseek(fp, 0, SEEK_SET);
+    fwrite(&header, sizeof(RoutingFileHeader), 1, fp);
+    fclose(fp);
+}
+
+// Shortest routes, with no limit on the length
+void init_profile(RoutingProfile *profile) {
+    int i;
+
+    profile->name = "shortest";
+    for (i = 0; i < NROF_TAGS; i++)
+        profile->penalty[i] = 1.0;
+    profile->max_route_length = 0.0;
+}
+
+// Read a profile with one "key=value penalty" line per tag to penalize, and
+// optionally a "max_route_length meters" line. Lines starting with # are
+// comments. Tags not listed keep the penalty 1.
+void load_profile(const char *filename, RoutingProfile *profile) {
+    char line[1024], name[512];
+    double value;
+    FILE *fp;
+    int nr = 0;
+
+    fp = fopen(filename, "r");
+    if (!fp) {
+        fprintf(stderr, "Can't open profile %s\n", filename);
+        exit(-1);
+    }
+
+    init_profile(profile);
+    profile->name = strdup(filename);
+    while (fgets(line, sizeof(line), fp)) {
+        char *eq;
+        int tag;
+
+        nr++;
+        if (sscanf(line, "%511s", name) != 1 || name[0] == '#')
+            continue;
+        if (sscanf(line, "%511s %lf", name, &value) != 2) {
+            fprintf(stderr, "Profile %s, line %d: expected a name and a number\n", filename, nr);
+            exit(-1);
+        }
+
+        if (!strcmp(name, "max_route_length")) {
+            profile->max_route_length = value;
+            continue;
+        }
+        eq = strchr(name, '=');
+        tag = -1;
+        if (eq) {
+            *eq = '\0';
+            tag = tag_match_linear(name, eq + 1);
+        }
+        if (tag < 0) {
+            fprintf(stderr, "Profile %s, line %d: unknown tag\n", filename, nr);
+            exit(-1);
+        }
+        if (value < 0.0) {
+            fprintf(stderr, "Profile %s, line %d: penalties can't be negative\n", filename, nr);
+            exit(-1);
+        }
+        profile->penalty[tag] = value;
+    }
+
+    fclose(fp);
+}
+
+// Time nearest node and radius queries at random points around the nodes,
+// checking the first ones against a scan of all nodes
+void benchmark_spatial(RoutingIndex *ri) {
+    unsigned int nearest[8];
+    double *points;
+    double min_lat, max_lat, min_lon, max_lon;
+    double t, t_nearest, t_nearest8, t_radius, radius = 200.0;
+    unsigned int seed;
+    long found;
+    int i, j, n, checked, wrong;
+
+    if (ri->nrof_nodes == 0)
+        return;
+
+    min_lat = max_lat = ri->nodes[0].lat;
+    min_lon = max_lon = ri->nodes[0].lon;
+    for (i = 1; i < ri->nrof_nodes; i++) {
+        min_lat = fmin(min_lat, ri->nodes[i].lat);
+        max_lat = fmax(max_lat, ri->nodes[i].lat);
+        min_lon = fmin(min_lon, ri->nodes[i].lon);
+        max_lon = fmax(max_lon, ri->nodes[i].lon);
+    }
+
+    n = 100000;
+    points = malloc(2 * n * sizeof(double));
+    seed = 12345;
+    for (i = 0; i < n; i++) {
+        seed = seed * 1103515245 + 12345;
+        points[2*i] = min_lat + (max_lat - min_lat) * ((seed >> 8) / 16777216.0);
+        seed = seed * 1103515245 + 12345;
+        points[2*i+1] = min_lon + (max_lon - min_lon) * ((seed >> 8) / 16777216.0);
+    }
+
+    t = current_time();
+    for (i = 0; i < n; i++)
+        routing_index_nearest(ri, points[2*i], points[2*i+1], 1, nearest, NULL);
+    t_nearest = current_time() - t;
+
+    t = current_time();
+    for (i = 0; i < n; i++)
+        routing_index_nearest(ri, points[2*i], points[2*i+1], 8, nearest, NULL);
+    t_nearest8 = current_time() - t;
+
+    found = 0;
+    t = current_time();
+    for (i = 0; i < n; i++)
+        found += routing_index_radius(ri, points[2*i], points[2*i+1], radius, NULL, NULL);
+    t_radius = current_time() - t;
+
+    // Compare with scanning all nodes
+    checked = n < 100 ? n : 100;
+    wrong = 0;
+    for (i = 0; i < checked; i++) {
+        double d, best = -1.0;
+        int count = 0;
+
+        for (j = 0; j < ri->nrof_nodes; j++) {
+            d = distance(points[2*i], points[2*i+1], ri->nodes[j].lat, ri->nodes[j].lon);
+            if (best < 0.0 || d < best)
+                best = d;
+            count += d <= radius;
+        }
+        routing_index_nearest(ri, points[2*i], points[2*i+1], 1, nearest, &d);
+        if (d != best || count != routing_index_radius(ri, points[2*i], points[2*i+1], 
+                    radius, NULL, NULL))
+            wrong++;
+    }
+
+    printf("Spatial index: nearest node %.1f k/s, nearest 8 %.1f k/s, within %.0f m %.1f k/s "
+            "(%.1f nodes), %d of %d checked queries wrong\n",
+            n / t_nearest * 1e-3, n / t_nearest8 * 1e-3, radius, n / t_radius * 1e-3, 
+            (double)found / n, wrong, checked);
+
+    free(points);
+}
+
+// Random offset of up to about three times the given meters, roughly
+// normally distributed
+double benchmark_noise(unsigned int *seed, double meters) {
+    double sum = 0.0;
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        *seed = *seed * 1103515245 + 12345;
+        sum += (*seed >> 8) / 16777216.0 - 0.5;
+    }
+    return sum * sqrt(3.0) * meters;
+}
+
+// Match traces of random drives through the routing index, with noise
+// added to the positions of the nodes driven past. Compares the nodes
+// matched with those of the drive, and with taking the closest node.
+void benchmark_matching(RoutingIndex *ri) {
+    Trace *traces;
+    unsigned int *driven;
+    unsigned int seed;
+    double t, t_one, t_all, noise = 10.0;
+    long nrof_points, matched, nearest;
+    int i, j, n, threads, count = 1000, length = 100;
+
+    if (ri->nrof_nodes == 0)
+        return;
+
+    traces = malloc(count * sizeof(Trace));
+    driven = malloc(count * length * sizeof(unsigned int));
+    seed = 12345;
+    nrof_points = 0;
+    for (i = 0; i < count; i++) {
+        unsigned int node, previous, next;
+
+        seed = seed * 1103515245 + 12345;
+        node = previous = (seed >> 8) % ri->nrof_nodes;
+        traces[i].points = malloc(length * sizeof(TracePoint));
+        traces[i].path = NULL;
+        for (j = 0; j < length; j++) {
+            RoutingNode *nd = &ri->nodes[node];
+            double lat = nd->lat + benchmark_noise(&seed, noise) / 111320.0;
+            double lon = nd->lon + benchmark_noise(&seed, noise) / 
+                (111320.0 * cos(nd->lat * M_PI / 180.0));
+
+            traces[i].points[j].lat = lat;
+            traces[i].points[j].lon = lon;
+            driven[i * length + j] = node;
+
+            // Drive on, turning back only at dead ends
+            n = nd->way.end - nd->way.start;
+            if (n == 0) {
+                j++;
+                break;
+            }
+            seed = seed * 1103515245 + 12345;
+            next = ri->ways[nd->way.start + (seed >> 8) % n].next;
+            if (next == previous && n > 1)
+                next = ri->ways[nd->way.start + ((seed >> 8) + 1) % n].next;
+            previous = node;
+            node = next;
+        }
+        traces[i].nrof_points = j;
+        nrof_points += j;
+    }
+
+    t = current_time();
+    match_traces(ri, traces, count, 1);
+    t_one = current_time() - t;
+    for (i = 0; i < count; i++)
+        free(traces[i].path);
+
+    threads = nrof_threads > 1 ? nrof_threads : 2;
+    t = current_time();
+    match_traces(ri, traces, count, threads);
+    t_all = current_time() - t;
+
+    matched = nearest = 0;
+    for (i = 0; i < count; i++) {
+        for (j = 0; j < traces[i].nrof_points; j++) {
+            TracePoint *p = &traces[i].points[j];
+            unsigned int node;
+
+            matched += p->node == driven[i * length + j];
+            routing_index_nearest(ri, p->lat, p->lon, 1, &node, NULL);
+            nearest += node == driven[i * length + j];
+        }
+        free(traces[i].points);
+        free(traces[i].path);
+    }
+
+    printf("Map matching %ld points of %d traces with %.0f m noise: %.1f k points/s, "
+            "%.1f k points/s with %d threads, %.1f%% matched to the driven node "
+            "against %.1f%% for the closest node\n",
+            nrof_points, count, noise, nrof_points / t_one * 1e-3, nrof_points / t_all * 1e-3,
+            threads, 100.0 * matched / nrof_points, 100.0 * nearest / nrof_points);
+
+    free(traces);
+    free(driven);
+}
+
+// Time the cost of every way computed from the profile against taken from
+// the compiled profile, then random point to point queries with A* against
+// plain Dijkstra, the same search without the distance estimate, and
+// against the contraction hierarchy if one was written
+void benchmark_routing(CompiledProfile *cp) {
+    RoutingIndex *ri = cp->ri;
+    Router *router;
+    Route *route;
+    unsigned int *pairs;
+    unsigned int seed;
+    unsigned int k, w;
+    double *costs;
+    double t, t_astar, t_dijkstra, t_effective, t_compiled;
+    double sum_effective, sum_compiled;
+    long settled_astar, settled_dijkstra;
+    int i, n, found;
+
+    if (ri->nrof_nodes == 0)
+        return;
+
+    sum_effective = sum_compiled = 0.0;
+    t = current_time();
+    for (k = 0; k < ri->nrof_nodes; k++) {
+        RoutingNode *nd = &ri->nodes[k];
+        for (w = nd->way.start; w < nd->way.end; w++) {
+            RoutingNode *next = &ri->nodes[ri->ways[w].next];
+            sum_effective += effective_distance(&profile,
+                    (void *)ri->tagsets + ri->tagset_offsets[ri->ways[w].tagset],
+                    nd->lat, nd->lon, next->lat, next->lon);
+        }
+    }
+    t_effective = current_time() - t;
+    t = current_time();
+    for (w = 0; w < ri->nrof_ways; w++)
+        sum_compiled += way_cost(cp, w);
+    t_compiled = current_time() - t;
+    printf("Way costs: effective distance %.1f M/s, compiled profile %.1f M/s (totals %.0f and %.0f)\n",
+            ri->nrof_ways / t_effective * 1e-6, ri->nrof_ways / t_compiled * 1e-6,
+            sum_effective, sum_compiled);
+
+    n = 1000;
+    pairs = malloc(2 * n * sizeof(unsigned int));
+    costs = malloc(n * sizeof(double));
+    seed = 12345;
+    for (i = 0; i < 2*n; i++) {
+        seed = seed * 1103515245 + 12345;
+        pairs[i] = (seed >> 4) % ri->nrof_nodes;
+    }
+
+    router = router_new(cp);
+    found = 0;
+    settled_astar = 0;
+    t = current_time();
+    for (i = 0; i < n; i++) {
+        route = router_route(router, pairs[2*i], pairs[2*i+1]);
+        settled_astar += router->nrof_settled;
+        costs[i] = route ? route->cost : -1.0;
+        if (route) {
+            found++;
+            route_free(route);
+        }
+    }
+    t_astar = current_time() - t;
+
+    router->heuristic_factor = 0.0;
+    settled_dijkstra = 0;
+    t = current_time();
+    for (i = 0; i < n; i++) {
+        route = router_route(router, pairs[2*i], pairs[2*i+1]);
+        settled_dijkstra += router->nrof_settled;
+        if (route)
+            route_free(route);
+    }
+    t_dijkstra = current_time() - t;
+    router_free(router);
+
+    printf("Routing: A* %.1f queries/s (%ld nodes settled), Dijkstra %.1f queries/s (%ld nodes settled), %d of %d routes found\n",
+            n / t_astar, settled_astar / n, n / t_dijkstra, settled_dijkstra / n, found, n);
+
+    // The same queries over the structure of arrays layout
+    {
+        RoutingGraph *graph;
+        GraphRouter *graph_router;
+        double t_graph_astar, t_graph_dijkstra;
+        int same;
+
+        t = current_time();
+        graph = routing_graph_new(ri);
+        printf("Building the structure of arrays layout took %.2f ms\n", (current_time() - t)*1e3);
+
+        graph_router = graph_router_new(graph, cp);
+        same = 0;
+        t = current_time();
+        for (i = 0; i < n; i++) {
+            route = graph_router_route(graph_router, graph->position[pairs[2*i]], 
+                    graph->position[pairs[2*i+1]]);
+            if (route) {
+                same += fabs(route->cost - costs[i]) <= 1e-9 * fmax(1.0, costs[i]);
+                route_free(route);
+            } else {
+                same += costs[i] < 0.0;
+            }
+        }
+        t_graph_astar = current_time() - t;
+
+        graph_router->heuristic_factor = 0.0;
+        t = current_time();
+        for (i = 0; i < n; i++) {
+            route = graph_router_route(graph_router, graph->position[pairs[2*i]], 
+                    graph->position[pairs[2*i+1]]);
+            if (route)
+                route_free(route);
+        }
+        t_graph_dijkstra = current_time() - t;
+        graph_router_free(graph_router);
+        routing_graph_free(graph);
+
+        printf("Structure of arrays: A* %.1f queries/s, Dijkstra %.1f queries/s, %d of %d costs same as A* "
+                "(%.2fx and %.2fx the packed nodes)\n",
+                n / t_graph_astar, n / t_graph_dijkstra, same, n,
+                t_astar / t_graph_astar, t_dijkstra / t_graph_dijkstra);
+    }
+
+    if (ch_filename) {
+        ChGraph *ch;
+        ChRouter *ch_router;
+        double t_ch;
+        long settled_ch;
+        int same;
+
+        t = current_time();
+        ch = ch_open(ch_filename, ri);
+        if (!ch)
+            exit(-1);
+        printf("Opening the contraction hierarchy took %.2f ms\n", (current_time() - t)*1e3);
+
+        ch_router = ch_router_new(ch, ri);
+        same = 0;
+        settled_ch = 0;
+        t = current_time();
+        for (i = 0; i < n; i++) {
+            route = ch_route(ch_router, pairs[2*i], pairs[2*i+1]);
+            settled_ch += ch_router->nrof_settled;
+            if (route) {
+                same += fabs(route->cost - costs[i]) <= 1e-9 * fmax(1.0, costs[i]);
+                route_free(route);
+            } else {
+                same += costs[i] < 0.0;
+            }
+        }
+        t_ch = current_time() - t;
+        ch_router_free(ch_router);
+        ch_close(ch);
+
+        printf("Contraction hierarchy: %.1f queries/s (%ld nodes settled), %d of %d costs same as A*\n",
+                n / t_ch, settled_ch / n, same, n);
+    }
+
+    free(pairs);
+    free(costs);
+}
+
+// Split lines and polygons into tiles of the given size and write them out
+void build_tiles(Vector *mapways, Vector *polygons, int level, double tile_size, 
+        double min_x, double min_y, double max_x, double max_y) {
+    int i, j, ti, tj;
+    int nrof_lines = mapways->size;
+    int nrof_polygons = polygons->size;
+    MapWay *mapway;
+    MapPolygon *polygon;
+    // Keep the same precision relative to the tile size on every level
+    double resolution = quantize_resolution * tile_size / TILE_SIZE;
 
     // Set up the tiles
-    double tile_size = 5000.0;
-    int start_tile_x = min_x / tile_size;
-    int start_tile_y = min_y / tile_size;
+    // Round down so the tiles west of 0 and south of the equator are kept
+    int start_tile_x = floor(min_x / tile_size);
+    int start_tile_y = floor(min_y / tile_size);
     int nrof_tiles_x = ceil(max_x / tile_size) - start_tile_x;
     int nrof_tiles_y = ceil(max_y / tile_size) - start_tile_y;
     int nrof_tiles = nrof_tiles_x * nrof_tiles_y;
@@ -843,109 +3119,615 @@ main(int argc, char **argv)
     for (i = 0; i < nrof_tiles_x; i++) {
         tiles[i] = malloc(nrof_tiles_y * sizeof(Tile));
         for (j = 0; j < nrof_tiles_y; j++) {
-            tiles[i][j].polygons = NULL;
-            tiles[i][j].ways = NULL;
+            vector_init(&tiles[i][j].polygons);
+            vector_init(&tiles[i][j].ways);
             tiles[i][j].x = start_tile_x + i;
             tiles[i][j].y = start_tile_y + j;
         }
     }
 
-    printf("Splitting data into %dx%d tiles\n", nrof_tiles_x, nrof_tiles_y);
+    printf("Splitting data into %dx%d tiles at level %d\n", nrof_tiles_x, nrof_tiles_y, level);
+
+    // Clip lines to each tile they pass, with a margin so that the line
+    // caps at the tile edges overlap the continuation in the next tile
+    int nrof_pieces = 0;
+    vector_foreach(mapways, i, mapway) {
+        double margin = mapway->width;
+        double way_min_x, way_min_y, way_max_x, way_max_y;
+        int ti0, ti1, tj0, tj1;
+        float *buffer;
+
+        way_min_x = way_max_x = mapway->vertices[0];
+        way_min_y = way_max_y = mapway->vertices[1];
+        for (j = 1; j < mapway->length; j++) {
+            way_min_x = fmin(way_min_x, mapway->vertices[2*j]);
+            way_max_x = fmax(way_max_x, mapway->vertices[2*j]);
+            way_min_y = fmin(way_min_y, mapway->vertices[2*j + 1]);
+            way_max_y = fmax(way_max_y, mapway->vertices[2*j + 1]);
+        }
+        ti0 = fmax(floor((way_min_x - margin)/tile_size) - start_tile_x, 0);
+        ti1 = fmin(floor((way_max_x + margin)/tile_size) - start_tile_x, nrof_tiles_x - 1);
+        tj0 = fmax(floor((way_min_y - margin)/tile_size) - start_tile_y, 0);
+        tj1 = fmin(floor((way_max_y + margin)/tile_size) - start_tile_y, nrof_tiles_y - 1);
+
+        if (ti0 == ti1 && tj0 == tj1) {
+            // Fits in a single tile
+            if (!tile_is_dirty(level, tiles[ti0][tj0].x, tiles[ti0][tj0].y))
+                continue;
+            vector_append(&tiles[ti0][tj0].ways, mapway);
+            nrof_pieces++;
+            continue;
+        }
 
-    for (i = 0, l=mapways; i < nrof_lines; i++, l = l->next) {
-        MapWay *mapway = l->data;
-        // FIXME: Storing the whole way in the tile where the first node is located...
-        ti = (int)(mapway->vertices[0]/tile_size) - start_tile_x;
-        tj = (int)(mapway->vertices[1]/tile_size) - start_tile_y;
-        tiles[ti][tj].ways = list_append(tiles[ti][tj].ways, mapway);
-        // FIXME: convert with scale and center coordinates?
+        buffer = malloc(2 * mapway->length * sizeof(float));
+        for (ti = ti0; ti <= ti1; ti++) {
+            for (tj = tj0; tj <= tj1; tj++) {
+                double x0 = tiles[ti][tj].x * tile_size;
+                double y0 = tiles[ti][tj].y * tile_size;
+
+                if (!tile_is_dirty(level, tiles[ti][tj].x, tiles[ti][tj].y))
+                    continue;
+                nrof_pieces += clip_way(mapway, x0 - margin, y0 - margin,
+                        x0 + tile_size + margin, y0 + tile_size + margin, 
+                        &tiles[ti][tj].ways, buffer);
+            }
+        }
+        free(buffer);
     }
-    for (i = 0, l=polygons; i < nrof_polygons; i++, l = l->next) {
-        MapPolygon *polygon = l->data;
-        ti = (int)(polygon->vertices[0]/tile_size) - start_tile_x;
-        tj = (int)(polygon->vertices[1]/tile_size) - start_tile_y;
-        tiles[ti][tj].polygons = list_append(tiles[ti][tj].polygons, polygon);
+    printf("Clipped %d lines into %d pieces\n", nrof_lines, nrof_pieces);
+
+    // Clip polygons exactly to the tiles, and triangulate the pieces
+    nrof_pieces = 0;
+    vector_foreach(polygons, i, polygon) {
+        double poly_min_x, poly_min_y, poly_max_x, poly_max_y;
+        int ti0, ti1, tj0, tj1;
+        float *buffer1, *buffer2;
+
+        poly_min_x = poly_max_x = polygon->vertices[0];
+        poly_min_y = poly_max_y = polygon->vertices[1];
+        for (j = 1; j < polygon->size; j++) {
+            poly_min_x = fmin(poly_min_x, polygon->vertices[2*j]);
+            poly_max_x = fmax(poly_max_x, polygon->vertices[2*j]);
+            poly_min_y = fmin(poly_min_y, polygon->vertices[2*j + 1]);
+            poly_max_y = fmax(poly_max_y, polygon->vertices[2*j + 1]);
+        }
+        ti0 = fmax(floor(poly_min_x/tile_size) - start_tile_x, 0);
+        ti1 = fmin(floor(poly_max_x/tile_size) - start_tile_x, nrof_tiles_x - 1);
+        tj0 = fmax(floor(poly_min_y/tile_size) - start_tile_y, 0);
+        tj1 = fmin(floor(poly_max_y/tile_size) - start_tile_y, nrof_tiles_y - 1);
+
+        if (ti0 == ti1 && tj0 == tj1) {
+            // Fits in a single tile
+            if (!tile_is_dirty(level, tiles[ti0][tj0].x, tiles[ti0][tj0].y))
+                continue;
+            triangulate_polygon(polygon);
+            vector_append(&tiles[ti0][tj0].polygons, polygon);
+            nrof_pieces++;
+            continue;
+        }
+
+        buffer1 = malloc(2 * (polygon->size + 4) * sizeof(float));
+        buffer2 = malloc(2 * (polygon->size + 4) * sizeof(float));
+        for (ti = ti0; ti <= ti1; ti++) {
+            for (tj = tj0; tj <= tj1; tj++) {
+                double x0 = tiles[ti][tj].x * tile_size;
+                double y0 = tiles[ti][tj].y * tile_size;
+                MapPolygon *piece;
+
+                if (!tile_is_dirty(level, tiles[ti][tj].x, tiles[ti][tj].y))
+                    continue;
+                piece = clip_polygon(polygon, x0, y0, x0 + tile_size, y0 + tile_size,
+                        buffer1, buffer2);
+                if (piece) {
+                    triangulate_polygon(piece);
+                    vector_append(&tiles[ti][tj].polygons, piece);
+                    nrof_pieces++;
+                }
+            }
+        }
+        free(buffer1);
+        free(buffer2);
     }
+    printf("Clipped %d polygons into %d pieces\n", nrof_polygons, nrof_pieces);
 
-    // Write to output files
+    // Write to output files, in Morton order so that tiles close to each
+    // other end up close to each other in an archive
     FILE *fp;
+    Tile **order = malloc(nrof_tiles * sizeof(Tile *));
+
+    for (ti = 0; ti < nrof_tiles_x; ti++)
+        for (tj = 0; tj < nrof_tiles_y; tj++)
+            order[ti*nrof_tiles_y + tj] = &tiles[ti][tj];
+    qsort(order, nrof_tiles, sizeof(Tile *), tile_morton_cb);
+
+    for (i = 0; i < nrof_tiles; i++) {
+        Tile *tile = order[i];
+
+        // When updating, tiles without changes are left as they are
+        if (!tile_is_dirty(level, tile->x, tile->y))
+            continue;
+
+        // Calculate array sizes
+        int nrof_lines = tile->ways.size;
+        int nrof_nodes = 0;
+        vector_foreach(&tile->ways, j, mapway)
+            nrof_nodes += mapway->length;
+
+        int nrof_polygons = tile->polygons.size;
+        int nrof_vertices = 0;
+        int nrof_triangles = 0;
+        vector_foreach(&tile->polygons, j, polygon) {
+            nrof_vertices += polygon->size;
+            nrof_triangles += polygon->nrof_triangles;
+        }
 
-    for (ti = 0; ti < nrof_tiles_x; ti++) {
-        for (tj = 0; tj < nrof_tiles_y; tj++) {
-            // Calculate array sizes
-            l = tiles[ti][tj].ways;
-            int nrof_lines = 0;
-            int nrof_nodes = 0;
-            while (l) {
-                MapWay *mapway = l->data;
-                l = l->next;
-                nrof_nodes += mapway->length;
-                nrof_lines++;
-            }
+        if (archive) {
+            // Empty tiles are left out of the archive
+            if (nrof_lines == 0 && nrof_polygons == 0)
+                continue;
+            printf("Storing tile %d_%d_%d: %d lines, %d vertices, "
+                    "%d polygons, %d vertices, %d triangles\n", level, tile->x, tile->y,
+                    nrof_lines, nrof_nodes, nrof_polygons, nrof_vertices, nrof_triangles);
+            write_archive_tile(tile, level, tile_size, resolution);
+            continue;
+        }
 
-            l = tiles[ti][tj].polygons;
-            int nrof_vertices = 0;
-            int nrof_polygons = 0;
-            while (l) {
-                MapPolygon *polygon = l->data;
-                nrof_vertices += polygon->size;
-                nrof_polygons++;
-                l = l->next;
-            }
+        // Write lines
+        char filename[4096];
+        tile_filename(filename, sizeof(filename), level, tile->x, tile->y, "line");
+
+        printf("Storing %d lines, %d vertices\n", nrof_lines, nrof_nodes);
+        printf("Writing output (%s)...\n", filename);
+        fp = fopen(filename, "w");
+        if (!fp) {
+            fprintf(stderr, "Can't open output file for writing.\n");
+            exit(-1);
+        }
+        write_tile_lines(fp, tile, tile_size, resolution);
+        fclose(fp);
+
+
+        // Write polygons
+        tile_filename(filename, sizeof(filename), level, tile->x, tile->y, "poly");
+        printf("Storing %d polygons, %d vertices, %d triangles\n", 
+                nrof_polygons, nrof_vertices, nrof_triangles);
+        printf("Writing output (%s)...\n", filename);
+        fp = fopen(filename, "w");
+        if (!fp) {
+            fprintf(stderr, "Can't open output file for writing.\n");
+            exit(-1);
+        }
+        write_tile_polygons(fp, tile, tile_size, resolution);
+        fclose(fp);
+    }
+    free(order);
+
+    for (i = 0; i < nrof_tiles_x; i++) {
+        for (j = 0; j < nrof_tiles_y; j++) {
+            vector_free(&tiles[i][j].ways);
+            vector_free(&tiles[i][j].polygons);
+        }
+        free(tiles[i]);
+    }
+    free(tiles);
+}
+
+int
+main(int argc, char **argv)
+{
+    File osmfile;
+    FILE *osmfilepointer;
+    struct stat st;
+    char *filename;
+    int i;
+    int done;
+    int len;
+    int opt;
+    int level;
+    double t_ways;
+    RoutingWay *w;
+    RoutingNode *nd;
+    vector_init(&mapways);
+    vector_init(&polygons);
+
+    
+    printf("Mapgenerator\n");
+
+    two_pass = 0;
+    benchmark = 0;
+    nrof_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    nrof_levels = 1;
+    extrude_lines = 0;
+    quantize_resolution = 0.0;
+    archive = NULL;
+    archive_index = NULL;
+    archive_tiles = 0;
+    archive_index_size = 0;
+    compress_tiles = 0;
+    use_expat = 0;
+    compress_raw_bytes = compress_packed_bytes = 0.0;
+    compress_inflate_time = compress_read_time = 0.0;
+    compress_inflate_stream = NULL;
+    state_filename = NULL;
+    update_state = 0;
+    routing_filename = NULL;
+    ch_filename = NULL;
+    init_profile(&profile);
+    while ((opt = getopt(argc, argv, "tbcexa:j:k:p:q:r:s:u:z:")) != -1) {
+        switch (opt) {
+            case 'r':
+                // Write a routing index of the highways
+                routing_filename = optarg;
+                break;
+            case 'k':
+                // Contract the routing index and write the hierarchy
+                ch_filename = optarg;
+                break;
+            case 'p':
+                // Route with the penalties of a profile instead of shortest routes
+                load_profile(optarg, &profile);
+                break;
+            case 's':
+                // Save the nodes and ways, to update the tiles from change files later
+                state_filename = optarg;
+                break;
+            case 'u':
+                // Update the tiles of a previous build from a change file
+                state_filename = optarg;
+                update_state = 1;
+                break;
+            case 'x':
+                // Parse XML with expat instead of the OSM XML scanner
+                use_expat = 1;
+                break;
+            case 'c':
+                // Compress the data of each tile with zlib
+                compress_tiles = 1;
+                break;
+            case 'a':
+                // Write all tiles to a single archive instead of separate files
+                archive = fopen(optarg, "w");
+                if (!archive) {
+                    fprintf(stderr, "Can't open archive file for writing.\n");
+                    exit(-1);
+                }
+                write_archive_header();
+                break;
+            case 'q':
+                // Store vertices as integer offsets in units of this many meters
+                quantize_resolution = atof(optarg);
+                if (quantize_resolution <= 0.0) {
+                    printf("Quantization resolution must be positive\n");
+                    return 0;
+                }
+                break;
+            case 'e':
+                // Write lines extruded to the vertex layout of the renderer
+                extrude_lines = 1;
+                break;
+            case 'z':
+                // Number of levels in the tile pyramid
+                nrof_levels = atoi(optarg);
+                if (nrof_levels < 1 || nrof_levels > 16) {
+                    printf("Number of levels must be between 1 and 16\n");
+                    return 0;
+                }
+                break;
+            case 'j':
+                // Number of threads decoding PBF blocks and contracting the routing index
+                nrof_threads = atoi(optarg);
+                break;
+            case 'b':
+                // Print benchmarks of the generation steps
+                benchmark = 1;
+                break;
+            case 't':
+                // Input not ordered with nodes first, parse it twice
+                two_pass = 1;
+                break;
+            default:
+                printf("Usage: %s [-t] [-b] [-c] [-e] [-x] [-a archive] [-q meters] [-j threads] [-z levels] [-r routing] [-k hierarchy] [-p profile] [-s state] file.osm|file.osm.pbf\n"
+                        "       %s -u state [options] changes.osc\n", argv[0], argv[0]);
+                return 0;
+        }
+    }
+
+    if (optind < argc) {
+        filename = argv[optind];
+    } else {
+        printf("Input file must be specified.\n");
+        return 0;
+    }
+    if (update_state && archive) {
+        printf("Archives can't be updated, rebuild them without -u\n");
+        return 0;
+    }
+    if (update_state && routing_filename) {
+        printf("Routing indexes can't be updated, rebuild them without -u\n");
+        return 0;
+    }
+    if (ch_filename && !routing_filename) {
+        printf("A contraction hierarchy needs a routing index, use -r\n");
+        return 0;
+    }
+
+    // Initialize projections
+    if (!(pj_merc = pj_init_plus("+proj=merc +a=6378137 +b=6378137 +lat_ts=0.0 +lon_0=0.0 +x_0=0.0 +y_0=0 +k=1.0 +units=m +nadgrids=@null +no_defs")) ) {
+        printf("Can't init Spherical Mercator projection.");
+        exit(1);
+    }
+    if (!(pj_latlong = pj_init_plus("+proj=latlong +datum=WGS84")) ) {
+        printf("Can't init latlong projection");
+        exit(1);
+    }
+
+
+    osmfile.file = strdup(filename);
+    osmfile.fd = -1;
+    osmfile.size = 0;
+
+    /* Open file descriptor and stat the file to get size */
+    osmfile.fd = open(osmfile.file, O_RDONLY);
+    if (osmfile.fd < 0)
+        return 0;
+    if (fstat(osmfile.fd, &st) < 0) {
+        close(osmfile.fd);
+        return 0;
+    }
+    osmfile.size = st.st_size;
+
+    osmfilepointer = fopen(osmfile.file, "r");
+    if (!osmfilepointer) {
+        fprintf(stderr, "Can't open file\n");
+        exit(-1);
+    }
 
-            // Write lines
-            char filename[4096];
-            snprintf(filename, sizeof(filename)-1, "%d_%d.line", 
-                    tiles[ti][tj].x, tiles[ti][tj].y);
+    printf("filesize: %d\n", osmfile.size);
 
-            printf("Storing %d lines, %d vertices\n", nrof_lines, nrof_nodes);
-            printf("Writing output (%s)...\n", filename);
-            fp = fopen(filename, "w");
-            if (!fp) {
-                fprintf(stderr, "Can't open output file for writing.\n");
+    depth = 0;
+    node_count = 0;
+    nodes_allocated = 0;
+    nodes = NULL;
+    node_index = NULL;
+    tag_matcher = tag_matcher_new(tag_keys, tag_values, NROF_TAGS);
+    way_arena = arena_new("way", WAY_ARENA_BLOCK_SIZE);
+    map_arena = arena_new("map", MAP_ARENA_BLOCK_SIZE);
+    level_arena = arena_new("level", MAP_ARENA_BLOCK_SIZE);
+    nodes_indexed = 0;
+    way.size = -1;
+    way_list = NULL;
+    tagsets = NULL;
+    tagsetindex = NULL;
+    tagsetsize = 0;
+    nrof_tagsets = 0;
+    tagsets_allocated = 0;
+    tagsetindex_allocated = 0;
+    tagset_table = NULL;
+    tagset_table_size = 0;
+    vector_init(&stored_ways);
+    vector_init(&changed_nodes);
+    vector_init(&changed_ways);
+    change_refs = NULL;
+    change_refs_allocated = 0;
+    dirty_tiles = NULL;
+    nrof_dirty_tiles = 0;
+    dirty_tiles_allocated = 0;
+    record_ways = state_filename && !update_state;
+    temp_ways = NULL;
+    nrof_temp_ways = 0;
+    temp_ways_allocated = 0;
+
+    OsmHandler handler;
+    handler.node = node_handler;
+    handler.way_start = way_start_handler;
+    handler.way_tag = way_tag_handler;
+    handler.way_node = way_node_handler;
+    handler.way_end = way_end_handler;
+    handler.change = NULL;
+    handler.data = NULL;
+
+    len = strlen(filename);
+    t_ways = current_time();
+    if (update_state) {
+        printf("Applying changes to %s...\n", state_filename);
+        apply_changes(filename);
+    } else if (len > 4 && !strcmp(filename + len - 4, ".pbf")) {
+        printf("Parsing PBF file with %d threads...\n", nrof_threads);
+        if (two_pass) {
+            // Only decode the nodes in the first pass and the ways in the second
+            handler.way_start = NULL;
+            if (pbf_parse_file(filename, &handler, nrof_threads) < 0) {
+                fprintf(stderr, "Can't open file\n");
                 exit(-1);
             }
-            fwrite(&nrof_lines, sizeof(int), 1, fp);
-            fwrite(&nrof_nodes, sizeof(int), 1, fp);
-            for (i = 0, l=tiles[ti][tj].ways; i < nrof_lines; i++, l = l->next) {
-                MapWay *mapway = l->data;
-                fwrite(&(mapway->length), sizeof(int), 1, fp);
-                fwrite(&(mapway->width), sizeof(float), 1, fp);
-                fwrite(&(mapway->height), sizeof(float), 1, fp);
-                fwrite(&(mapway->outline_color), sizeof(unsigned char), 4, fp);
-                fwrite(&(mapway->fill_color), sizeof(unsigned char), 4, fp);
-                fwrite(&(mapway->bridge), sizeof(int), 1, fp);
-                fwrite(&(mapway->tunnel), sizeof(int), 1, fp);
+            index_nodes();
+
+            handler.node = NULL;
+            handler.way_start = way_start_handler;
+        }
+        if (pbf_parse_file(filename, &handler, nrof_threads) < 0) {
+            fprintf(stderr, "Can't open file\n");
+            exit(-1);
+        }
+        if (!nodes_indexed)
+            index_nodes();
+    } else {
+        int result = 1;
+
+        if (!use_expat) {
+            printf("Scanning XML file...\n");
+            if (two_pass) {
+                // Only pass on the nodes in the first pass and the ways in the second
+                handler.way_start = NULL;
+                result = xml_scan_file(filename, &handler);
+                if (result == 0) {
+                    index_nodes();
+                    handler.node = NULL;
+                    handler.way_start = way_start_handler;
+                    result = xml_scan_file(filename, &handler);
+                }
+            } else {
+                result = xml_scan_file(filename, &handler);
             }
-            for (i = 0, l=tiles[ti][tj].ways; i < nrof_lines; i++, l = l->next) {
-                MapWay *mapway = l->data;
-                fwrite(mapway->vertices, sizeof(float), 2*mapway->length, fp);
+            if (result < 0) {
+                fprintf(stderr, "Can't open file\n");
+                exit(-1);
             }
-            fclose(fp);
+            if (result > 0)
+                printf("The XML file needs a full parser, using expat\n");
+        }
+
+        if (result == 0) {
+            if (!nodes_indexed)
+                index_nodes();
+        } else if (two_pass) {
+            /* Parse the XML document */
+            printf("Parsing nodes from XML file...\n");
+            parse_osm_file(osmfilepointer, nodeparser_start, nodeparser_end);
+            index_nodes();
+
+            printf("Parsing ways from XML file...\n");
+            parse_osm_file(osmfilepointer, wayparser_start, wayparser_end);
+        } else {
+            printf("Parsing nodes and ways from XML file...\n");
+            parse_osm_file(osmfilepointer, osmparser_start, osmparser_end);
+            if (!nodes_indexed)
+                index_nodes();
+        }
+    }
+    t_ways = current_time() - t_ways;
+
+    if (benchmark) {
+        printf("Parsing took %.2f s\n", t_ways);
+        benchmark_node_lookups();
+        benchmark_tag_matching();
+    }
+
+    // Calculate array sizes
+    int nrof_lines = mapways.size;
+    int nrof_nodes = 0;
+    MapWay *mapway;
+    vector_foreach(&mapways, i, mapway)
+        nrof_nodes += mapway->length;
+
+    int nrof_polygons = polygons.size;
+    int nrof_vertices = 0;
+    MapPolygon *polygon;
+    vector_foreach(&polygons, i, polygon)
+        nrof_vertices += polygon->size;
 
+    // Determine bounding box for all points
+    double max_x, max_y, min_x, min_y;
+    min_x = nodes[0].x;
+    max_x = nodes[0].x;
+    min_y = nodes[0].y;
+    max_y = nodes[0].y;
+    for (i = 0; i < node_count; i++) {
+        if (nodes[i].x > max_x)
+            max_x = nodes[i].x;
+        if (nodes[i].x < min_x)
+            min_x = nodes[i].x;
+        if (nodes[i].y > max_y)
+            max_y = nodes[i].y;
+        if (nodes[i].y < min_y)
+            min_y = nodes[i].y;
+    }
+    printf("Bounding box: %lf, %lf, %lf, %lf\n", min_x, min_y, max_x, max_y);
+
+    // Everything allocated while tiling is dropped after each level
+    build_tiles(&mapways, &polygons, 0, TILE_SIZE, min_x, min_y, max_x, max_y);
+    arena_reset(level_arena);
+
+    // Build coarser levels with simplified geometry
+    for (level = 1; level < nrof_levels; level++) {
+        double tile_size = TILE_SIZE * (1 << level);
+        double pixel_size = tile_size / PYRAMID_TILE_PIXELS;
+        Vector level_mapways, level_polygons;
+        int level_nodes, level_vertices;
+
+        vector_init(&level_mapways);
+        vector_init(&level_polygons);
+        simplify_ways(&mapways, &level_mapways, pixel_size, &level_nodes);
+        simplify_polygons(&polygons, &level_polygons, pixel_size, &level_vertices);
+        printf("Level %d: %d of %d lines, %d of %d line vertices, "
+                "%d of %d polygons, %d of %d polygon vertices\n", level,
+                level_mapways.size, nrof_lines, level_nodes, nrof_nodes,
+                level_polygons.size, nrof_polygons, level_vertices, nrof_vertices);
+
+        build_tiles(&level_mapways, &level_polygons, level, tile_size, 
+                min_x, min_y, max_x, max_y);
+        vector_free(&level_mapways);
+        vector_free(&level_polygons);
+        arena_reset(level_arena);
+    }
+
+    if (benchmark && compress_tiles) {
+        printf("Compressed %.1f MB of tile data to %.1f MB (ratio %.2f)\n",
+                compress_raw_bytes/1e6, compress_packed_bytes/1e6, 
+                compress_raw_bytes/compress_packed_bytes);
+        printf("Decompression: %.1f MB/s, uncompressed read: %.1f MB/s\n",
+                compress_raw_bytes/1e6/compress_inflate_time, 
+                compress_raw_bytes/1e6/compress_read_time);
+    }
 
-            // Write polygons
-            snprintf(filename, sizeof(filename)-1, "%d_%d.poly", 
-                    tiles[ti][tj].x, tiles[ti][tj].y);
-            printf("Writing output (%s)...\n", filename);
-            fp = fopen(filename, "w");
-            if (!fp) {
-                fprintf(stderr, "Can't open output file for writing.\n");
+    if (routing_filename) {
+        double t = current_time();
+        RoutingIndex *ri = build_routing_index();
+        CompiledProfile *cp;
+        if (benchmark)
+            printf("Building the routing index took %.2f s\n", current_time() - t);
+        write_routing_index(ri, routing_filename);
+        routing_index_close(ri);
+
+        if (benchmark || ch_filename) {
+            // Time how long a routing service needs before its first query
+            t = current_time();
+            ri = routing_index_open(routing_filename);
+            if (!ri)
                 exit(-1);
+            if (benchmark)
+                printf("Opening the routing index took %.2f ms\n", (current_time() - t)*1e3);
+
+            t = current_time();
+            cp = profile_compile(ri, &profile);
+            if (benchmark)
+                printf("Compiling the profile took %.2f ms\n", (current_time() - t)*1e3);
+
+            if (ch_filename) {
+                ChGraph *ch;
+
+                t = current_time();
+                ch = ch_build(cp, nrof_threads);
+                if (benchmark)
+                    printf("Contracting the routing index with %d threads took %.2f s\n",
+                            nrof_threads, current_time() - t);
+                ch_write(ch, ri, ch_filename);
+                ch_close(ch);
             }
-            fwrite(&nrof_polygons, sizeof(int), 1, fp);
-            fwrite(&nrof_vertices, sizeof(int), 1, fp);
-            for (i = 0, l=tiles[ti][tj].polygons; i < nrof_polygons; i++, l = l->next) {
-                MapPolygon *polygon = l->data;
-                fwrite(&(polygon->size), sizeof(int), 1, fp);
-                fwrite(&(polygon->rgba), sizeof(unsigned char), 4, fp);
-            }
-            for (i = 0, l=tiles[ti][tj].polygons; i < nrof_polygons; i++, l = l->next) {
-                MapPolygon *polygon = l->data;
-                fwrite(polygon->vertices, sizeof(float), 2*polygon->size, fp);
+
+            if (benchmark) {
+                benchmark_spatial(ri);
+                benchmark_matching(ri);
+                benchmark_routing(cp);
             }
-            fclose(fp);
+            profile_free(cp);
+            routing_index_close(ri);
         }
     }
+
+    if (state_filename) {
+        vector_sort(&stored_ways, stored_way_id_cb);
+        write_state(state_filename);
+    }
+
+    arena_report(way_arena);
+    arena_report(map_arena);
+    arena_report(level_arena);
+
+    if (archive) {
+        printf("Writing archive index of %d tiles\n", archive_tiles);
+        write_archive_index();
+        fclose(archive);
+    }
 }
 
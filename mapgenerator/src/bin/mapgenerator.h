@@ -5,12 +5,44 @@
 typedef struct _RoutingNode RoutingNode;
 typedef struct _Route Route;
 typedef struct _RoutingIndex RoutingIndex;
+typedef struct _RoutingFileHeader RoutingFileHeader;
 typedef struct _RoutingWay RoutingWay;
 typedef struct _RoutingTagSet RoutingTagSet;
 typedef struct _RoutingProfile RoutingProfile;
+typedef struct _CompiledProfile CompiledProfile;
+typedef struct _Router Router;
+typedef struct _RoutingGraph RoutingGraph;
+typedef struct _GraphRouter GraphRouter;
+typedef struct _NodeHeap NodeHeap;
+typedef struct _NodeHeapEntry NodeHeapEntry;
+typedef struct _ChEdge ChEdge;
+typedef struct _ChGraph ChGraph;
+typedef struct _ChFileHeader ChFileHeader;
+typedef struct _ChSearch ChSearch;
+typedef struct _ChRouter ChRouter;
+typedef struct _TracePoint TracePoint;
+typedef struct _Trace Trace;
+typedef struct _MatchCandidate MatchCandidate;
+typedef struct _Matcher Matcher;
+typedef struct _NodeIndex NodeIndex;
+typedef struct _TagMatcher TagMatcher;
+typedef struct _Arena Arena;
+typedef struct _ArenaBlock ArenaBlock;
 typedef struct _File File;
 typedef struct _List List;
+typedef struct _Vector Vector;
+typedef struct _OsmHandler OsmHandler;
 typedef int (*List_Compare_Cb) (const void *a, const void *b);
+typedef void (*Osm_Node_Cb) (void *data, unsigned int id, double lat, double lon);
+typedef void (*Osm_Way_Start_Cb) (void *data, unsigned int id);
+typedef void (*Osm_Way_Tag_Cb) (void *data, const char *key, const char *value);
+typedef void (*Osm_Way_Node_Cb) (void *data, unsigned int ref);
+typedef void (*Osm_Way_End_Cb) (void *data);
+typedef void (*Osm_Change_Cb) (void *data, int action);
+typedef void (*Routing_Node_Cb) (void *data, unsigned int node, double distance);
+
+// Sections of an OSM change file
+enum { OSC_CREATE, OSC_MODIFY, OSC_DELETE };
 
 typedef enum { highway_motorway, highway_motorway_link, highway_trunk,
     highway_trunk_link, highway_primary, highway_primary_link,
@@ -64,20 +96,51 @@ struct _RoutingNode {
 struct _Route {
     int nrof_nodes;
     double length;
+    double cost;       // Length weighted by the penalties of the profile
     RoutingNode *nodes;
 };
 
 struct _RoutingIndex {
     unsigned int nrof_ways;
     unsigned int nrof_nodes;
+    unsigned int nrof_tagsets;
+    unsigned int tagsets_size;     // Size in bytes of all tagsets
     RoutingWay *ways;
     RoutingNode *nodes;
     RoutingTagSet *tagsets;
+    int *tagset_offsets;           // Offset in bytes of each tagset in tagsets
+    void *map;                     // Mapped file the arrays point into, if opened from a file
+    size_t map_size;
+    double *way_lengths;           // Length of each way in meters, once a profile is compiled
+    unsigned int *spatial;         // Node numbers as an implicit k-d tree, see routing_index_nearest
+};
+
+#define ROUTING_FILE_MAGIC 0x4c4d5249 // Starts routing index files
+#define ROUTING_FILE_VERSION 3
+
+// Start of a routing index file. The arrays of a RoutingIndex follow at
+// the given offsets, each aligned to 8 bytes, so that the file can be
+// mapped and used in place. The checksum covers the rest of the file.
+struct _RoutingFileHeader {
+    int magic;
+    int version;
+    unsigned int nrof_nodes;
+    unsigned int nrof_ways;
+    unsigned int nrof_tagsets;
+    unsigned int tagsets_size;
+    unsigned int nodes_offset;
+    unsigned int ways_offset;
+    unsigned int tagset_offsets_offset;
+    unsigned int tagsets_offset;
+    unsigned int spatial_offset;
+    unsigned int reserved; // Keeps the header a multiple of 8 bytes
+    unsigned int file_size;
+    unsigned int checksum; // Adler-32 of everything after the header
 };
 
 struct _RoutingWay {
     unsigned int next; // The index of the node this leads to
-    unsigned char tagset;
+    unsigned char tagset; // The number of the tagset of the way
 } __attribute__ ((__packed__));
 
 struct _RoutingTagSet {
@@ -88,7 +151,242 @@ struct _RoutingTagSet {
 struct _RoutingProfile {
     char *name;
     double penalty[NROF_TAGS]; // A penalty for each tag
-    double max_route_length; // Give up if no route shorter than this is found
+    double max_route_length; // Give up if the cheapest route is longer than this, in meters
+};
+
+// A profile turned into one multiplier per tagset of a routing index, so
+// that the cost of a way is its cached length times the multiplier of its
+// tagset. Any number of profiles can be compiled for the same index, they
+// share the lengths.
+struct _CompiledProfile {
+    RoutingProfile *profile;
+    RoutingIndex *ri;
+    double *tagset_factors;    // Product of the penalties of the tags of each tagset
+    double min_factor;         // Lowest factor, zero if there are no tagsets
+    double max_factor;         // Highest factor, zero if there are no tagsets
+};
+
+// Cost of a way of the index under a compiled profile
+#define way_cost(cp, w) \
+    ((cp)->ri->way_lengths[w] * (cp)->tagset_factors[(cp)->ri->ways[w].tagset])
+
+#define NODE_HEAP_NOT_SEEN -2 // Not reached by the current search
+#define NODE_HEAP_CLOSED -1   // Settled, the cost is final
+
+struct _NodeHeapEntry {
+    double key;
+    unsigned int node;
+};
+
+// Binary heap of nodes with the lowest key first, which knows the position
+// of each node so that its key can be lowered in place
+struct _NodeHeap {
+    NodeHeapEntry *entries;
+    int *position;     // Position of each node, or one of the states above
+    int size;
+};
+
+struct _Router {
+    RoutingIndex *ri;
+    CompiledProfile *profile;
+    double heuristic_factor;     // Lowest cost per meter, 0 searches as Dijkstra
+    double *cost;                // Cost of the best route found to each node
+    unsigned int *previous;      // Node before each node on that route
+    unsigned int *touched;       // Query that last reached each node
+    NodeHeap heap;               // Keyed by cost plus the estimated remaining cost
+    unsigned int query;
+    int nrof_settled;            // Nodes settled by the last query
+};
+
+#define GRAPH_COORD_SCALE 1e7  // Fixed point units per degree
+#define GRAPH_HILBERT_BITS 16  // Bits of each coordinate on the Hilbert curve
+
+// A routing index laid out as separate arrays, with the nodes renumbered
+// along a Hilbert curve so that nodes close to each other are close in
+// memory. The arrays a search reads for each node and way are kept apart
+// from the rest, and coordinates are stored in fixed point.
+struct _RoutingGraph {
+    RoutingIndex *ri;            // Built from, gives the ways of the nodes of a route
+    unsigned int nrof_nodes;
+    unsigned int nrof_ways;
+    unsigned int *way_offsets;   // Ways of each node, nrof_nodes + 1
+    int *lat;                    // Degrees times GRAPH_COORD_SCALE
+    int *lon;
+    unsigned int *way_next;
+    unsigned char *way_tagset;
+    double *way_lengths;
+    unsigned int *ids;           // OSM id of each node
+    double *x;
+    double *y;
+    unsigned int *order;         // Node of the index at each position
+    unsigned int *position;      // Position of each node of the index
+};
+
+// A* over a RoutingGraph, like the Router over a RoutingIndex
+struct _GraphRouter {
+    RoutingGraph *graph;
+    CompiledProfile *profile;
+    double heuristic_factor;
+    double *cost;
+    unsigned int *previous;
+    unsigned int *touched;
+    NodeHeap heap;
+    unsigned int query;
+    int nrof_settled;
+};
+
+#define CH_FILE_MAGIC 0x4c4d4348 // Starts contraction hierarchy files
+#define CH_FILE_VERSION 1
+#define CH_NO_MIDDLE 0xffffffff
+
+// An edge of a contraction hierarchy, always towards the node contracted
+// later. Shortcuts replace the two edges through a node contracted earlier.
+struct _ChEdge {
+    unsigned int node;     // The other end
+    unsigned int middle;   // The node a shortcut passes, or CH_NO_MIDDLE
+    double weight;
+};
+
+// A routing index contracted under a profile. The up edges of a node lead
+// from it, the down edges lead to it. Node numbers are those of the index.
+struct _ChGraph {
+    unsigned int nrof_nodes;
+    unsigned int nrof_up;
+    unsigned int nrof_down;
+    unsigned int *up_offsets;      // Up edges of each node, nrof_nodes + 1
+    unsigned int *down_offsets;
+    ChEdge *up;
+    ChEdge *down;
+    void *map;
+    size_t map_size;
+};
+
+struct _ChFileHeader {
+    unsigned int magic;
+    unsigned int version;
+    unsigned int nrof_nodes;
+    unsigned int nrof_up;
+    unsigned int nrof_down;
+    unsigned int routing_checksum;  // Checksum of the routing index it was built from
+    unsigned int up_offsets_offset;
+    unsigned int down_offsets_offset;
+    unsigned int up_offset;
+    unsigned int down_offset;
+    unsigned int file_size;
+    unsigned int checksum;
+};
+
+// State of a Dijkstra search, kept between searches like in the Router
+struct _ChSearch {
+    double *cost;
+    unsigned int *previous;
+    unsigned int *touched;
+    unsigned int query;
+    NodeHeap heap;
+};
+
+struct _ChRouter {
+    ChGraph *ch;
+    RoutingIndex *ri;
+    ChSearch forward;
+    ChSearch backward;
+    int nrof_settled;            // Nodes settled by the last query
+};
+
+#define MATCH_NO_NODE 0xffffffff
+#define MATCH_MAX_CANDIDATES 8   // Closest nodes considered for each point
+#define MATCH_RADIUS 50.0        // Farthest a point is matched to a node, meters
+#define MATCH_SIGMA 10.0         // Standard deviation of the GPS error, meters
+#define MATCH_BETA 20.0          // Scale of route detours compared to the straight line, meters
+#define MATCH_DETOUR_FACTOR 2.0  // Routes longer than this times the straight line are not searched
+
+// A point of a GPS trace, and the node it was matched to
+struct _TracePoint {
+    double lat;
+    double lon;
+    unsigned int node;      // MATCH_NO_NODE if the point couldn't be matched
+    double distance;        // From the point to the node
+};
+
+struct _Trace {
+    TracePoint *points;
+    int nrof_points;
+    unsigned int *path;     // Nodes driven along, MATCH_NO_NODE where the trace breaks
+    int path_length;
+};
+
+struct _MatchCandidate {
+    unsigned int node;
+    double distance;        // From the point
+    double score;           // Log probability of the best sequence ending here
+    int previous;           // Candidate of the previous point on it, -1 where it starts
+};
+
+// State for matching traces, one for each thread
+struct _Matcher {
+    RoutingIndex *ri;
+    ChSearch search;
+    MatchCandidate *candidates;  // MATCH_MAX_CANDIDATES for each point of the trace
+    int *nrof_candidates;
+    int *chosen;                 // Candidate each point was matched to
+    int allocated;               // Points the arrays have room for
+    double *route_distances;     // From each candidate to those of the next point
+    long nrof_settled;           // Nodes settled by the searches of the last trace
+};
+
+#define NODE_INDEX_PAGE_BITS 16
+#define NODE_INDEX_PAGE_SIZE (1 << NODE_INDEX_PAGE_BITS)
+#define NODE_INDEX_MAX_DENSE_RATIO 4 // Use a direct table if ids span at most this many per node
+
+struct _NodeIndex {
+    unsigned int min_id;
+    unsigned int max_id;
+    int dense;
+    int *table;               // Node index for each id from min_id, when dense
+    int **pages;              // Pages of node indices, allocated on demand when sparse
+    unsigned int nrof_pages;
+};
+
+// Perfect hash of the recognized key/value pairs, each slot holds the tag
+// whose pair hashes to it with the chosen seed, or -1
+struct _TagMatcher {
+    unsigned int seed;
+    unsigned int mask;
+    int *slots;
+    char **keys;
+    char **values;
+};
+
+// Callbacks for the elements of an OSM file, a NULL callback skips that element type
+struct _OsmHandler {
+    Osm_Node_Cb node;
+    Osm_Way_Start_Cb way_start;
+    Osm_Way_Tag_Cb way_tag;
+    Osm_Way_Node_Cb way_node;
+    Osm_Way_End_Cb way_end;
+    Osm_Change_Cb change; // Called with the action of each section of a change file
+    void *data;
+};
+
+#define ARENA_ALIGNMENT 8
+
+// Bump allocator, everything allocated from it is released at once when it
+// is reset. Blocks are kept for reuse after a reset.
+struct _Arena {
+    const char *name;
+    ArenaBlock *first;
+    ArenaBlock *current;
+    size_t block_size;
+    size_t used;     // Bytes handed out since the last reset
+    size_t peak;     // Most bytes handed out between resets
+    size_t reserved; // Bytes in all blocks
+    int nrof_blocks;
+};
+
+struct _ArenaBlock {
+    ArenaBlock *next;
+    size_t size;
+    size_t used;
 };
 
 struct _File {
@@ -104,10 +402,29 @@ struct _List {
     void *data;
 };
 
+// Contiguous array of pointers that doubles its capacity when full
+struct _Vector {
+    void **data;
+    int size;
+    int allocated;
+};
+
+// Loop over the items of a vector, with item set to each one in turn
+#define vector_foreach(vector, i, item) \
+    for ((i) = 0; (i) < (vector)->size && ((item) = (vector)->data[i], 1); (i)++)
 
+
+double current_time();
 double distance(double from_lat, double from_lon, double to_lat, double to_lon);
 double effective_distance(RoutingProfile *profile, RoutingTagSet *tagset, 
         double from_lat, double from_lon, double to_lat, double to_lon);
+Arena * arena_new(const char *name, size_t block_size);
+void * arena_alloc(Arena *arena, size_t size);
+void arena_reset(Arena *arena);
+void arena_free(Arena *arena);
+void arena_report(Arena *arena);
+Arena * list_set_arena(Arena *arena);
+void list_free(List *list);
 List * list_sorted_insert(List *list, void *data, List_Compare_Cb compare);
 List * list_sorted_merge(List *list1, List *list2, List_Compare_Cb compare);
 List * list_merge_sort(List *list, int size, List_Compare_Cb compare);
@@ -116,8 +433,66 @@ List * list_prepend(List *list, void *data);
 List * list_append(List *list, void *data);
 List * list_find(List *list, void *data, List_Compare_Cb compare);
 int list_count(List *list);
+void vector_init(Vector *vector);
+void vector_append(Vector *vector, void *data);
+void vector_sort(Vector *vector, List_Compare_Cb compare);
+void vector_free(Vector *vector);
 
+void routing_nodes_sort(RoutingNode *nodes, int count);
+NodeIndex * node_index_new(RoutingNode *nodes, int count);
+int node_index_lookup(NodeIndex *ni, unsigned int id);
+void node_index_free(NodeIndex *ni);
+TagMatcher * tag_matcher_new(char **keys, char **values, int count);
+int tag_matcher_lookup(TagMatcher *tm, const char *key, const char *value);
+void tag_matcher_free(TagMatcher *tm);
 int routing_index_bsearch(RoutingNode* nodes, int id, int low, int high);
 int routing_index_find_node(RoutingIndex* ri, int id);
+void write_routing_section(FILE *fp, const void *data, unsigned int size, 
+        unsigned int *offset, unsigned long *checksum);
+RoutingIndex * routing_index_open(const char *filename);
+void routing_index_close(RoutingIndex *ri);
+void routing_index_build_spatial(RoutingIndex *ri);
+int routing_index_nearest(RoutingIndex *ri, double lat, double lon, int k,
+        unsigned int *nodes, double *distances);
+int routing_index_radius(RoutingIndex *ri, double lat, double lon, double radius,
+        Routing_Node_Cb cb, void *data);
+int routing_index_radius_nodes(RoutingIndex *ri, double lat, double lon, double radius,
+        unsigned int *nodes, int size);
+void routing_index_way_lengths(RoutingIndex *ri);
+CompiledProfile * profile_compile(RoutingIndex *ri, RoutingProfile *profile);
+void profile_free(CompiledProfile *cp);
+Router * router_new(CompiledProfile *profile);
+Route * router_route(Router *router, unsigned int from, unsigned int to);
+void router_free(Router *router);
+Route * route_new(RoutingIndex *ri, unsigned int *path, int count, double cost);
+void route_free(Route *route);
+RoutingGraph * routing_graph_new(RoutingIndex *ri);
+void routing_graph_free(RoutingGraph *graph);
+GraphRouter * graph_router_new(RoutingGraph *graph, CompiledProfile *profile);
+Route * graph_router_route(GraphRouter *router, unsigned int from, unsigned int to);
+void graph_router_free(GraphRouter *router);
+void node_heap_init(NodeHeap *heap, unsigned int nrof_nodes);
+void node_heap_update(NodeHeap *heap, unsigned int node, double key);
+unsigned int node_heap_pop(NodeHeap *heap);
+void node_heap_free(NodeHeap *heap);
+ChGraph * ch_build(CompiledProfile *profile, int nrof_threads);
+void ch_write(ChGraph *ch, RoutingIndex *ri, const char *filename);
+ChGraph * ch_open(const char *filename, RoutingIndex *ri);
+void ch_close(ChGraph *ch);
+void ch_search_init(ChSearch *search, unsigned int nrof_nodes);
+void ch_search_start(ChSearch *search, unsigned int nrof_nodes);
+void ch_search_relax(ChSearch *search, unsigned int node, unsigned int previous, double cost);
+void ch_search_free(ChSearch *search);
+ChRouter * ch_router_new(ChGraph *ch, RoutingIndex *ri);
+Route * ch_route(ChRouter *router, unsigned int from, unsigned int to);
+void ch_router_free(ChRouter *router);
+Matcher * matcher_new(RoutingIndex *ri);
+void matcher_match(Matcher *matcher, Trace *trace);
+void matcher_free(Matcher *matcher);
+void match_traces(RoutingIndex *ri, Trace *traces, int count, int nrof_threads);
+
+int pbf_parse_file(const char *filename, OsmHandler *handler, int nrof_threads);
+int xml_scan_file(const char *filename, OsmHandler *handler);
+int osc_parse_file(const char *filename, OsmHandler *handler);
 
 #endif /* MAPGENERATOR_H_ */
@@ -0,0 +1,871 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <zlib.h>
+#include "mapgenerator.h"
+
+// Contraction hierarchies, see Geisberger et al., "Contraction Hierarchies:
+// Faster and Simpler Hierarchical Routing in Road Networks"
+//
+// Nodes are contracted from the least to the most important. Contracting a
+// node removes it from the graph, adding a shortcut between two of its
+// neighbours when the cheapest route between them went through it, unless
+// a witness search finds another route that is as cheap. The edges a node
+// has left when it is contracted all lead to nodes contracted later, and
+// are kept as its up and down edges. A query then searches upwards from
+// both ends and settles few nodes.
+//
+// Contraction is done in rounds. A round contracts the nodes whose priority
+// is lower than that of all their neighbours, so no two of them are
+// neighbours and their witness searches can run in parallel, as can the
+// updates of the priorities afterwards. The witness searches see the graph
+// as it was before the round, so the result doesn't depend on the number
+// of threads.
+
+#define CH_WITNESS_SETTLE_LIMIT 100 // Give up a witness search, keeping the shortcut
+#define CH_CORE_DEGREE 32 // Leave the rest uncontracted when the average degree is higher
+
+#define CH_REMAINING 0
+#define CH_SELECTED 1    // Contracted in the current round
+#define CH_CONTRACTED 2
+
+typedef struct _ChEdgeList ChEdgeList;
+typedef struct _ChShortcut ChShortcut;
+typedef struct _ChBuilder ChBuilder;
+typedef struct _ChWorker ChWorker;
+typedef struct _ChPath ChPath;
+
+struct _ChEdgeList {
+    ChEdge *edges;
+    int size;
+    int allocated;
+};
+
+struct _ChPath {
+    unsigned int *nodes;
+    int size;
+    int allocated;
+};
+
+struct _ChShortcut {
+    unsigned int from;
+    unsigned int to;
+    unsigned int middle;
+    double weight;
+};
+
+struct _ChBuilder {
+    unsigned int nrof_nodes;
+    ChEdgeList *out;              // Edges from each node, frozen once it is contracted
+    ChEdgeList *in;               // Edges to each node, with the node they come from
+    char *state;
+    int *priority;
+    int *contracted_neighbours;
+    int *depth;                   // Levels of contracted nodes below each node
+    char *queued;                 // In the updated list
+    unsigned int *remaining;      // Nodes not contracted yet
+    unsigned int nrof_remaining;
+    unsigned int *selected;       // Nodes contracted in this round
+    unsigned int nrof_selected;
+    unsigned int *updated;        // Nodes whose priority must be recomputed
+    unsigned int nrof_updated;
+    ChWorker *workers;
+    int nrof_threads;
+};
+
+struct _ChWorker {
+    ChBuilder *builder;
+    int id;
+    ChSearch search;
+    char *via_selected;           // Route found passes another node of the round
+    char *is_target;              // Neighbours the witness searches look for
+    void (*job)(ChWorker *worker, unsigned int i);
+    unsigned int count;
+    ChShortcut *shortcuts;        // Found for the nodes of this round, in order
+    int nrof_shortcuts;
+    int shortcuts_allocated;
+    int next_shortcut;
+};
+
+void ch_search_init(ChSearch *search, unsigned int nrof_nodes) {
+    search->cost = malloc(nrof_nodes * sizeof(double));
+    search->previous = malloc(nrof_nodes * sizeof(unsigned int));
+    search->touched = calloc(nrof_nodes, sizeof(unsigned int));
+    if (nrof_nodes > 0 && (!search->cost || !search->previous || !search->touched)) {
+        fprintf(stderr, "Couldn't allocate memory for a search\n");
+        exit(-1);
+    }
+    search->query = 0;
+    node_heap_init(&search->heap, nrof_nodes);
+}
+
+void ch_search_free(ChSearch *search) {
+    free(search->cost);
+    free(search->previous);
+    free(search->touched);
+    node_heap_free(&search->heap);
+}
+
+// Start a new search, clearing the touched marks when the number wraps
+void ch_search_start(ChSearch *search, unsigned int nrof_nodes) {
+    search->query++;
+    if (search->query == 0) {
+        memset(search->touched, 0, nrof_nodes * sizeof(unsigned int));
+        search->query = 1;
+    }
+    search->heap.size = 0;
+}
+
+// Reset the state of a node the first time the current search reaches it
+void ch_search_touch(ChSearch *search, unsigned int node) {
+    if (search->touched[node] != search->query) {
+        search->touched[node] = search->query;
+        search->cost[node] = INFINITY;
+        search->heap.position[node] = NODE_HEAP_NOT_SEEN;
+    }
+}
+
+// Lower the cost of a node if the given one is lower
+void ch_search_relax(ChSearch *search, unsigned int node, unsigned int previous, double cost) {
+    ch_search_touch(search, node);
+    if (search->heap.position[node] != NODE_HEAP_CLOSED && cost < search->cost[node]) {
+        search->cost[node] = cost;
+        search->previous[node] = previous;
+        node_heap_update(&search->heap, node, cost);
+    }
+}
+
+// Add an edge, or lower the weight of the edge already there to the same
+// node. Returns 0 if that edge was at least as cheap.
+int ch_edge_list_improve(ChEdgeList *list, unsigned int node, unsigned int middle, double weight) {
+    int i;
+
+    for (i = 0; i < list->size; i++) {
+        if (list->edges[i].node == node) {
+            if (list->edges[i].weight <= weight)
+                return 0;
+            list->edges[i].middle = middle;
+            list->edges[i].weight = weight;
+            return 1;
+        }
+    }
+
+    if (list->size == list->allocated) {
+        list->allocated = list->allocated ? 2*list->allocated : 4;
+        list->edges = realloc(list->edges, list->allocated * sizeof(ChEdge));
+        if (!list->edges) {
+            fprintf(stderr, "Couldn't allocate memory for edges\n");
+            exit(-1);
+        }
+    }
+    list->edges[list->size].node = node;
+    list->edges[list->size].middle = middle;
+    list->edges[list->size].weight = weight;
+    list->size++;
+    return 1;
+}
+
+void ch_edge_list_remove(ChEdgeList *list, unsigned int node) {
+    int i;
+
+    for (i = 0; i < list->size; i++) {
+        if (list->edges[i].node == node) {
+            list->edges[i] = list->edges[--list->size];
+            return;
+        }
+    }
+}
+
+// Search from a node among the nodes not contracted yet, except the one
+// being contracted, until every node closer than max_cost is settled or
+// the targets marked in the worker are. The
+// cheapest route found to each node is marked if it passes another node of
+// the round, preferring an equally cheap route that doesn't.
+void ch_witness_search(ChWorker *w, unsigned int from, unsigned int skip, double max_cost,
+        int nrof_targets) {
+    ChBuilder *b = w->builder;
+    ChSearch *search = &w->search;
+    int settled = 0;
+
+    ch_search_start(search, b->nrof_nodes);
+    ch_search_relax(search, from, from, 0.0);
+    w->via_selected[from] = 0;
+    if (nrof_targets == 0)
+        return;
+
+    while (search->heap.size > 0 && settled < CH_WITNESS_SETTLE_LIMIT) {
+        ChEdgeList *out;
+        unsigned int n;
+        int i;
+
+        if (search->heap.entries[0].key > max_cost)
+            break;
+        n = node_heap_pop(&search->heap);
+        settled++;
+        if (n != from && w->is_target[n] && --nrof_targets == 0)
+            break;
+
+        out = &b->out[n];
+        for (i = 0; i < out->size; i++) {
+            unsigned int next = out->edges[i].node;
+            double cost = search->cost[n] + out->edges[i].weight;
+            char via = w->via_selected[n] || b->state[next] == CH_SELECTED;
+
+            if (next == skip || b->state[next] == CH_CONTRACTED)
+                continue;
+            ch_search_touch(search, next);
+            if (search->heap.position[next] == NODE_HEAP_CLOSED)
+                continue;
+            if (cost < search->cost[next] ||
+                    (cost == search->cost[next] && w->via_selected[next] && !via)) {
+                search->cost[next] = cost;
+                search->previous[next] = n;
+                w->via_selected[next] = via;
+                node_heap_update(&search->heap, next, cost);
+            }
+        }
+    }
+}
+
+// Count the shortcuts needed to contract a node, and add them to the
+// shortcuts of the worker if record is set
+int ch_contract_node(ChWorker *w, unsigned int v, int record) {
+    ChBuilder *b = w->builder;
+    ChSearch *search = &w->search;
+    ChEdgeList *in = &b->in[v], *out = &b->out[v];
+    double max_out = 0.0;
+    int i, j, count = 0;
+
+    for (j = 0; j < out->size; j++) {
+        max_out = fmax(max_out, out->edges[j].weight);
+        w->is_target[out->edges[j].node] = 1;
+    }
+
+    for (i = 0; i < in->size; i++) {
+        unsigned int from = in->edges[i].node;
+
+        // The start is not one of the targets to find
+        ch_witness_search(w, from, v, in->edges[i].weight + max_out,
+                out->size - w->is_target[from]);
+        for (j = 0; j < out->size; j++) {
+            unsigned int to = out->edges[j].node;
+            double weight = in->edges[i].weight + out->edges[j].weight;
+
+            if (to == from)
+                continue;
+            // Two nodes of a round could each be the only witness of the
+            // other if ties were accepted, and both be contracted without
+            // a shortcut, so witnesses through them must be cheaper
+            if (search->touched[to] == search->query && (search->cost[to] < weight ||
+                        (search->cost[to] == weight && !w->via_selected[to])))
+                continue;
+
+            count++;
+            if (record) {
+                if (w->nrof_shortcuts == w->shortcuts_allocated) {
+                    w->shortcuts_allocated = w->shortcuts_allocated ? 2*w->shortcuts_allocated : 1024;
+                    w->shortcuts = realloc(w->shortcuts, w->shortcuts_allocated * sizeof(ChShortcut));
+                    if (!w->shortcuts) {
+                        fprintf(stderr, "Couldn't allocate memory for shortcuts\n");
+                        exit(-1);
+                    }
+                }
+                w->shortcuts[w->nrof_shortcuts].from = from;
+                w->shortcuts[w->nrof_shortcuts].to = to;
+                w->shortcuts[w->nrof_shortcuts].middle = v;
+                w->shortcuts[w->nrof_shortcuts].weight = weight;
+                w->nrof_shortcuts++;
+            }
+        }
+    }
+
+    for (j = 0; j < out->size; j++)
+        w->is_target[out->edges[j].node] = 0;
+
+    return count;
+}
+
+// Nodes that add few shortcuts compared to the edges they remove are
+// contracted first, and nodes with many contracted neighbours or above many
+// levels of contracted nodes later, which spreads the contraction evenly
+void ch_job_priority(ChWorker *w, unsigned int i) {
+    ChBuilder *b = w->builder;
+    unsigned int v = b->updated[i];
+    int edge_difference = ch_contract_node(w, v, 0) - b->in[v].size - b->out[v].size;
+
+    b->priority[v] = 2*edge_difference + b->contracted_neighbours[v] + b->depth[v];
+}
+
+// Order nodes by priority, and by number when they are equal
+int ch_before(ChBuilder *b, unsigned int v, unsigned int u) {
+    return b->priority[v] < b->priority[u] || (b->priority[v] == b->priority[u] && v < u);
+}
+
+void ch_job_select(ChWorker *w, unsigned int i) {
+    ChBuilder *b = w->builder;
+    unsigned int v = b->remaining[i];
+    int j;
+
+    for (j = 0; j < b->in[v].size; j++) {
+        if (!ch_before(b, v, b->in[v].edges[j].node))
+            return;
+    }
+    for (j = 0; j < b->out[v].size; j++) {
+        if (!ch_before(b, v, b->out[v].edges[j].node))
+            return;
+    }
+    b->state[v] = CH_SELECTED;
+}
+
+void ch_job_contract(ChWorker *w, unsigned int i) {
+    ch_contract_node(w, w->builder->selected[i], 1);
+}
+
+void * ch_worker_run(void *data) {
+    ChWorker *w = data;
+    unsigned int i;
+
+    for (i = w->id; i < w->count; i += w->builder->nrof_threads)
+        w->job(w, i);
+
+    return NULL;
+}
+
+// Run a job for the numbers below count, worker i taking every i:th
+void ch_run(ChBuilder *b, void (*job)(ChWorker *w, unsigned int i), unsigned int count) {
+    pthread_t *threads;
+    int i;
+
+    for (i = 0; i < b->nrof_threads; i++) {
+        b->workers[i].job = job;
+        b->workers[i].count = count;
+    }
+    if (b->nrof_threads == 1) {
+        ch_worker_run(&b->workers[0]);
+        return;
+    }
+
+    threads = malloc(b->nrof_threads * sizeof(pthread_t));
+    for (i = 0; i < b->nrof_threads; i++) {
+        if (pthread_create(&threads[i], NULL, ch_worker_run, &b->workers[i])) {
+            fprintf(stderr, "Couldn't start a contraction thread\n");
+            exit(-1);
+        }
+    }
+    for (i = 0; i < b->nrof_threads; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+}
+
+void ch_queue_update(ChBuilder *b, unsigned int v, unsigned int contracted) {
+    b->contracted_neighbours[v]++;
+    if (b->depth[v] < b->depth[contracted] + 1)
+        b->depth[v] = b->depth[contracted] + 1;
+    if (!b->queued[v]) {
+        b->queued[v] = 1;
+        b->updated[b->nrof_updated++] = v;
+    }
+}
+
+// Contract the selected nodes, in order, with the shortcuts found for them
+int ch_apply_round(ChBuilder *b) {
+    int nrof_shortcuts = 0;
+    unsigned int i;
+    int j;
+
+    for (i = 0; i < b->nrof_threads; i++)
+        b->workers[i].next_shortcut = 0;
+
+    for (i = 0; i < b->nrof_selected; i++) {
+        unsigned int v = b->selected[i];
+        ChWorker *w = &b->workers[i % b->nrof_threads];
+
+        for (j = 0; j < b->in[v].size; j++) {
+            ch_edge_list_remove(&b->out[b->in[v].edges[j].node], v);
+            ch_queue_update(b, b->in[v].edges[j].node, v);
+        }
+        for (j = 0; j < b->out[v].size; j++) {
+            ch_edge_list_remove(&b->in[b->out[v].edges[j].node], v);
+            ch_queue_update(b, b->out[v].edges[j].node, v);
+        }
+        b->state[v] = CH_CONTRACTED;
+
+        while (w->next_shortcut < w->nrof_shortcuts &&
+                w->shortcuts[w->next_shortcut].middle == v) {
+            ChShortcut *s = &w->shortcuts[w->next_shortcut++];
+            if (ch_edge_list_improve(&b->out[s->from], s->to, v, s->weight)) {
+                ch_edge_list_improve(&b->in[s->to], s->from, v, s->weight);
+                nrof_shortcuts++;
+            }
+        }
+    }
+
+    return nrof_shortcuts;
+}
+
+// Copy the frozen edge lists of all nodes into one array
+ChEdge * ch_flatten(ChEdgeList *lists, unsigned int nrof_nodes, unsigned int **offsets,
+        unsigned int *count) {
+    ChEdge *edges;
+    unsigned int i;
+
+    *offsets = malloc((nrof_nodes + 1) * sizeof(unsigned int));
+    *count = 0;
+    for (i = 0; i < nrof_nodes; i++) {
+        (*offsets)[i] = *count;
+        *count += lists[i].size;
+    }
+    (*offsets)[nrof_nodes] = *count;
+
+    edges = malloc((*count ? *count : 1) * sizeof(ChEdge));
+    if (!*offsets || !edges) {
+        fprintf(stderr, "Couldn't allocate memory for the contraction hierarchy\n");
+        exit(-1);
+    }
+    for (i = 0; i < nrof_nodes; i++) {
+        if (lists[i].size > 0)
+            memcpy(edges + (*offsets)[i], lists[i].edges, lists[i].size * sizeof(ChEdge));
+        free(lists[i].edges);
+    }
+    free(lists);
+
+    return edges;
+}
+
+// Contract a routing index under a profile, with the witness searches and
+// priority updates spread over nrof_threads threads
+ChGraph * ch_build(CompiledProfile *profile, int nrof_threads) {
+    RoutingIndex *ri = profile->ri;
+    ChBuilder b;
+    ChGraph *ch;
+    unsigned int i, n;
+    int j, rounds = 0, nrof_shortcuts = 0;
+
+    if (nrof_threads < 1)
+        nrof_threads = 1;
+
+    n = ri->nrof_nodes;
+    b.nrof_nodes = n;
+    b.nrof_threads = nrof_threads;
+    b.out = calloc(n, sizeof(ChEdgeList));
+    b.in = calloc(n, sizeof(ChEdgeList));
+    b.state = calloc(n, sizeof(char));
+    b.priority = malloc(n * sizeof(int));
+    b.contracted_neighbours = calloc(n, sizeof(int));
+    b.depth = calloc(n, sizeof(int));
+    b.queued = calloc(n, sizeof(char));
+    b.remaining = malloc(n * sizeof(unsigned int));
+    b.selected = malloc(n * sizeof(unsigned int));
+    b.updated = malloc(n * sizeof(unsigned int));
+    b.workers = calloc(nrof_threads, sizeof(ChWorker));
+    if (n > 0 && (!b.out || !b.in || !b.state || !b.priority || !b.contracted_neighbours
+                || !b.queued || !b.remaining || !b.selected || !b.updated)) {
+        fprintf(stderr, "Couldn't allocate memory for contraction\n");
+        exit(-1);
+    }
+    for (j = 0; j < nrof_threads; j++) {
+        b.workers[j].builder = &b;
+        b.workers[j].id = j;
+        ch_search_init(&b.workers[j].search, n);
+        b.workers[j].via_selected = malloc(n);
+        b.workers[j].is_target = calloc(n, sizeof(char));
+    }
+
+    // Start from the ways of the index, keeping the cheapest of parallel ones
+    for (i = 0; i < n; i++) {
+        RoutingNode *nd = &ri->nodes[i];
+        unsigned int w;
+
+        for (w = nd->way.start; w < nd->way.end; w++) {
+            RoutingWay *way = &ri->ways[w];
+            double weight;
+
+            if (way->next == i)
+                continue;
+            weight = way_cost(profile, w);
+            if (ch_edge_list_improve(&b.out[i], way->next, CH_NO_MIDDLE, weight))
+                ch_edge_list_improve(&b.in[way->next], i, CH_NO_MIDDLE, weight);
+        }
+        b.remaining[i] = i;
+        b.updated[i] = i;
+    }
+    b.nrof_remaining = n;
+    b.nrof_updated = n;
+    ch_run(&b, ch_job_priority, b.nrof_updated);
+
+    while (b.nrof_remaining > 0) {
+        unsigned int kept = 0;
+        long degrees = 0;
+
+        // Stop if the rest has become too dense to contract in reasonable
+        // time. The nodes left keep their edges both as up and down edges,
+        // so that queries search freely among them.
+        for (i = 0; i < b.nrof_remaining; i++)
+            degrees += b.out[b.remaining[i]].size;
+        if (degrees > (long)CH_CORE_DEGREE * b.nrof_remaining)
+            break;
+
+        // The remaining node first in order is always selected
+        ch_run(&b, ch_job_select, b.nrof_remaining);
+        b.nrof_selected = 0;
+        for (i = 0; i < b.nrof_remaining; i++) {
+            unsigned int v = b.remaining[i];
+            if (b.state[v] == CH_SELECTED)
+                b.selected[b.nrof_selected++] = v;
+            else
+                b.remaining[kept++] = v;
+        }
+        b.nrof_remaining = kept;
+
+        for (j = 0; j < nrof_threads; j++)
+            b.workers[j].nrof_shortcuts = 0;
+        ch_run(&b, ch_job_contract, b.nrof_selected);
+
+        b.nrof_updated = 0;
+        nrof_shortcuts += ch_apply_round(&b);
+        for (i = 0; i < b.nrof_updated; i++)
+            b.queued[b.updated[i]] = 0;
+        ch_run(&b, ch_job_priority, b.nrof_updated);
+        rounds++;
+    }
+
+    printf("Contracted %d nodes in %d rounds, adding %d shortcuts\n",
+            n - b.nrof_remaining, rounds, nrof_shortcuts);
+    if (b.nrof_remaining > 0)
+        printf("Left a core of %d nodes uncontracted\n", b.nrof_remaining);
+
+    ch = malloc(sizeof(ChGraph));
+    ch->nrof_nodes = n;
+    ch->up = ch_flatten(b.out, n, &ch->up_offsets, &ch->nrof_up);
+    ch->down = ch_flatten(b.in, n, &ch->down_offsets, &ch->nrof_down);
+    ch->map = NULL;
+    ch->map_size = 0;
+
+    for (j = 0; j < nrof_threads; j++) {
+        ch_search_free(&b.workers[j].search);
+        free(b.workers[j].via_selected);
+        free(b.workers[j].is_target);
+        free(b.workers[j].shortcuts);
+    }
+    free(b.workers);
+    free(b.state);
+    free(b.priority);
+    free(b.contracted_neighbours);
+    free(b.depth);
+    free(b.queued);
+    free(b.remaining);
+    free(b.selected);
+    free(b.updated);
+
+    return ch;
+}
+
+// Write a contraction hierarchy in the layout of ChFileHeader, tied to the
+// routing index it was built from by the checksum of that index
+void ch_write(ChGraph *ch, RoutingIndex *ri, const char *filename) {
+    ChFileHeader header;
+    unsigned int offset = sizeof(ChFileHeader);
+    unsigned long checksum = adler32(0L, Z_NULL, 0);
+    FILE *fp;
+
+    memset(&header, 0, sizeof(ChFileHeader));
+    header.magic = CH_FILE_MAGIC;
+    header.version = CH_FILE_VERSION;
+    header.nrof_nodes = ch->nrof_nodes;
+    header.nrof_up = ch->nrof_up;
+    header.nrof_down = ch->nrof_down;
+    if (ri->map)
+        header.routing_checksum = ((RoutingFileHeader *)ri->map)->checksum;
+
+    printf("Writing contraction hierarchy of %d nodes and %d edges (%s)...\n",
+            ch->nrof_nodes, ch->nrof_up + ch->nrof_down, filename);
+    fp = fopen(filename, "w");
+    if (!fp) {
+        fprintf(stderr, "Can't open contraction hierarchy for writing.\n");
+        exit(-1);
+    }
+    fwrite(&header, sizeof(ChFileHeader), 1, fp);
+    header.up_offsets_offset = offset;
+    write_routing_section(fp, ch->up_offsets, (ch->nrof_nodes + 1) * sizeof(unsigned int),
+            &offset, &checksum);
+    header.down_offsets_offset = offset;
+    write_routing_section(fp, ch->down_offsets, (ch->nrof_nodes + 1) * sizeof(unsigned int),
+            &offset, &checksum);
+    header.up_offset = offset;
+    write_routing_section(fp, ch->up, ch->nrof_up * sizeof(ChEdge), &offset, &checksum);
+    header.down_offset = offset;
+    write_routing_section(fp, ch->down, ch->nrof_down * sizeof(ChEdge), &offset, &checksum);
+    header.file_size = offset;
+    header.checksum = checksum;
+
+    fseek(fp, 0, SEEK_SET);
+    fwrite(&header, sizeof(ChFileHeader), 1, fp);
+    fclose(fp);
+}
+
+int ch_section_is_valid(ChFileHeader *header, unsigned int offset,
+        unsigned int count, unsigned int size) {
+    if (offset % 8 || offset < sizeof(ChFileHeader) || offset > header->file_size)
+        return 0;
+    if (size && count > (header->file_size - offset) / size)
+        return 0;
+    return 1;
+}
+
+// Return 1 if the offsets of each node lie within the edges and don't decrease
+int ch_offsets_are_valid(unsigned int *offsets, unsigned int nrof_nodes, unsigned int nrof_edges) {
+    unsigned int i;
+
+    if (offsets[0] != 0 || offsets[nrof_nodes] != nrof_edges)
+        return 0;
+    for (i = 0; i < nrof_nodes; i++) {
+        if (offsets[i] > offsets[i+1])
+            return 0;
+    }
+    return 1;
+}
+
+// Map a contraction hierarchy file, like routing_index_open. The routing
+// index must be the one it was built from. Returns NULL if the file can't
+// be opened or fails validation.
+ChGraph * ch_open(const char *filename, RoutingIndex *ri) {
+    ChGraph *ch;
+    ChFileHeader *header;
+    struct stat st;
+    void *map;
+    uLong checksum;
+    int fd;
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Can't open contraction hierarchy %s\n", filename);
+        return NULL;
+    }
+    if (fstat(fd, &st) < 0 || st.st_size < sizeof(ChFileHeader)) {
+        fprintf(stderr, "Not a contraction hierarchy: %s\n", filename);
+        close(fd);
+        return NULL;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Can't map contraction hierarchy %s\n", filename);
+        return NULL;
+    }
+
+    header = map;
+    if (header->magic != CH_FILE_MAGIC || header->version != CH_FILE_VERSION) {
+        fprintf(stderr, "Not a contraction hierarchy of version %d: %s\n",
+                CH_FILE_VERSION, filename);
+        munmap(map, st.st_size);
+        return NULL;
+    }
+    if (header->nrof_nodes != ri->nrof_nodes || (ri->map &&
+                header->routing_checksum != ((RoutingFileHeader *)ri->map)->checksum)) {
+        fprintf(stderr, "Contraction hierarchy is not of this routing index: %s\n", filename);
+        munmap(map, st.st_size);
+        return NULL;
+    }
+    if (header->file_size != st.st_size || header->nrof_nodes == 0xffffffff
+            || !ch_section_is_valid(header, header->up_offsets_offset,
+                header->nrof_nodes + 1, sizeof(unsigned int))
+            || !ch_section_is_valid(header, header->down_offsets_offset,
+                header->nrof_nodes + 1, sizeof(unsigned int))
+            || !ch_section_is_valid(header, header->up_offset,
+                header->nrof_up, sizeof(ChEdge))
+            || !ch_section_is_valid(header, header->down_offset,
+                header->nrof_down, sizeof(ChEdge))) {
+        fprintf(stderr, "Contraction hierarchy is truncated or corrupt: %s\n", filename);
+        munmap(map, st.st_size);
+        return NULL;
+    }
+    checksum = adler32(adler32(0L, Z_NULL, 0), (const Bytef *)map + sizeof(ChFileHeader),
+            header->file_size - sizeof(ChFileHeader));
+    if (checksum != header->checksum) {
+        fprintf(stderr, "Contraction hierarchy checksum mismatch: %s\n", filename);
+        munmap(map, st.st_size);
+        return NULL;
+    }
+
+    ch = malloc(sizeof(ChGraph));
+    ch->nrof_nodes = header->nrof_nodes;
+    ch->nrof_up = header->nrof_up;
+    ch->nrof_down = header->nrof_down;
+    ch->up_offsets = (void *)((char *)map + header->up_offsets_offset);
+    ch->down_offsets = (void *)((char *)map + header->down_offsets_offset);
+    ch->up = (void *)((char *)map + header->up_offset);
+    ch->down = (void *)((char *)map + header->down_offset);
+    ch->map = map;
+    ch->map_size = st.st_size;
+
+    if (!ch_offsets_are_valid(ch->up_offsets, ch->nrof_nodes, ch->nrof_up)
+            || !ch_offsets_are_valid(ch->down_offsets, ch->nrof_nodes, ch->nrof_down)) {
+        fprintf(stderr, "Contraction hierarchy is truncated or corrupt: %s\n", filename);
+        ch_close(ch);
+        return NULL;
+    }
+
+    return ch;
+}
+
+void ch_close(ChGraph *ch) {
+    if (ch->map) {
+        munmap(ch->map, ch->map_size);
+    } else {
+        free(ch->up_offsets);
+        free(ch->down_offsets);
+        free(ch->up);
+        free(ch->down);
+    }
+    free(ch);
+}
+
+ChRouter * ch_router_new(ChGraph *ch, RoutingIndex *ri) {
+    ChRouter *router = malloc(sizeof(ChRouter));
+
+    router->ch = ch;
+    router->ri = ri;
+    ch_search_init(&router->forward, ch->nrof_nodes);
+    ch_search_init(&router->backward, ch->nrof_nodes);
+    router->nrof_settled = 0;
+    return router;
+}
+
+void ch_router_free(ChRouter *router) {
+    ch_search_free(&router->forward);
+    ch_search_free(&router->backward);
+    free(router);
+}
+
+ChEdge * ch_find_edge(ChEdge *edges, unsigned int *offsets, unsigned int from, unsigned int node) {
+    unsigned int i;
+
+    for (i = offsets[from]; i < offsets[from+1]; i++) {
+        if (edges[i].node == node)
+            return &edges[i];
+    }
+    return NULL;
+}
+
+void ch_path_append(ChPath *path, unsigned int node) {
+    if (path->size == path->allocated) {
+        path->allocated = path->allocated ? 2*path->allocated : 64;
+        path->nodes = realloc(path->nodes, path->allocated * sizeof(unsigned int));
+        if (!path->nodes) {
+            fprintf(stderr, "Couldn't allocate memory for a route\n");
+            exit(-1);
+        }
+    }
+    path->nodes[path->size++] = node;
+}
+
+// Append the nodes after the start of an edge, replacing a shortcut by the
+// two edges to and from the node it passes, which was contracted before
+// both ends and so has them as its down and up edges
+void ch_unpack(ChGraph *ch, unsigned int from, unsigned int to, unsigned int middle, ChPath *path) {
+    ChEdge *first, *second;
+
+    if (middle == CH_NO_MIDDLE) {
+        ch_path_append(path, to);
+        return;
+    }
+    first = ch_find_edge(ch->down, ch->down_offsets, middle, from);
+    second = ch_find_edge(ch->up, ch->up_offsets, middle, to);
+    ch_unpack(ch, from, middle, first->middle, path);
+    ch_unpack(ch, middle, to, second->middle, path);
+}
+
+// Settle the next node of one direction of a query, unless a node higher
+// up reaches it more cheaply, in which case it can't be on the route
+void ch_route_step(ChSearch *search, ChSearch *other, ChEdge *edges, unsigned int *offsets,
+        ChEdge *stall_edges, unsigned int *stall_offsets, double *best, unsigned int *meeting) {
+    unsigned int n = node_heap_pop(&search->heap);
+    unsigned int i;
+
+    if (other->touched[n] == other->query && search->cost[n] + other->cost[n] < *best) {
+        *best = search->cost[n] + other->cost[n];
+        *meeting = n;
+    }
+
+    for (i = stall_offsets[n]; i < stall_offsets[n+1]; i++) {
+        unsigned int higher = stall_edges[i].node;
+        if (search->touched[higher] == search->query &&
+                search->cost[higher] + stall_edges[i].weight < search->cost[n])
+            return;
+    }
+
+    for (i = offsets[n]; i < offsets[n+1]; i++)
+        ch_search_relax(search, edges[i].node, n, search->cost[n] + edges[i].weight);
+}
+
+// Find the cheapest route between two node indices, searching up from the
+// start along up edges and up from the end along down edges, and unpack
+// the shortcuts on it. Returns NULL if there is no route.
+Route * ch_route(ChRouter *router, unsigned int from, unsigned int to) {
+    ChGraph *ch = router->ch;
+    ChSearch *forward = &router->forward, *backward = &router->backward;
+    ChPath chain = { NULL, 0, 0 }, path = { NULL, 0, 0 };
+    ChEdge *edge;
+    Route *route;
+    double best = INFINITY;
+    unsigned int meeting = 0, n;
+    int i;
+
+    router->nrof_settled = 0;
+    if (from >= ch->nrof_nodes || to >= ch->nrof_nodes)
+        return NULL;
+
+    ch_search_start(forward, ch->nrof_nodes);
+    ch_search_start(backward, ch->nrof_nodes);
+    ch_search_relax(forward, from, from, 0.0);
+    ch_search_relax(backward, to, to, 0.0);
+
+    // Step the direction with the cheapest open node, until no open node
+    // can lead to a cheaper route
+    for (;;) {
+        double forward_key = forward->heap.size > 0 ? forward->heap.entries[0].key : INFINITY;
+        double backward_key = backward->heap.size > 0 ? backward->heap.entries[0].key : INFINITY;
+
+        if (fmin(forward_key, backward_key) >= best ||
+                (forward->heap.size == 0 && backward->heap.size == 0))
+            break;
+        if (forward_key <= backward_key)
+            ch_route_step(forward, backward, ch->up, ch->up_offsets,
+                    ch->down, ch->down_offsets, &best, &meeting);
+        else
+            ch_route_step(backward, forward, ch->down, ch->down_offsets,
+                    ch->up, ch->up_offsets, &best, &meeting);
+        router->nrof_settled++;
+    }
+
+    if (best == INFINITY)
+        return NULL;
+
+    // The nodes from the start up to the meeting node, in reverse
+    for (n = meeting; n != from; n = forward->previous[n])
+        ch_path_append(&chain, n);
+    ch_path_append(&chain, from);
+
+    // Unpack the edges up to the meeting node, then those down to the end
+    ch_path_append(&path, from);
+    for (i = chain.size - 1; i > 0; i--) {
+        edge = ch_find_edge(ch->up, ch->up_offsets, chain.nodes[i], chain.nodes[i-1]);
+        ch_unpack(ch, chain.nodes[i], chain.nodes[i-1], edge->middle, &path);
+    }
+    for (n = meeting; n != to; n = backward->previous[n]) {
+        edge = ch_find_edge(ch->down, ch->down_offsets, backward->previous[n], n);
+        ch_unpack(ch, n, backward->previous[n], edge->middle, &path);
+    }
+
+    route = route_new(router->ri, path.nodes, path.size, best);
+    free(chain.nodes);
+    free(path.nodes);
+    return route;
+}
@@ -0,0 +1,302 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "mapgenerator.h"
+
+// Structure of arrays layout of a routing index
+//
+// A RoutingNode packs the OSM id, the range of ways and four doubles into
+// 44 bytes, so the doubles are misaligned and a search pulls a whole node
+// into the cache to read its ways and position. In a RoutingGraph a search
+// reads the way offsets, the fixed point coordinates and the way arrays,
+// 12 bytes for each node and 13 for each way, and the OSM ids and
+// projected coordinates are only read when a route is made.
+//
+// The nodes are numbered in the order they come along a Hilbert curve
+// over the bounding box, so the nodes a search settles one after another
+// are mostly close together in the arrays.
+
+typedef struct _GraphOrder GraphOrder;
+
+struct _GraphOrder {
+    unsigned int key;
+    unsigned int node;
+};
+
+// Distance along a Hilbert curve through the 2^GRAPH_HILBERT_BITS square
+unsigned int hilbert_index(unsigned int x, unsigned int y) {
+    unsigned int n = 1 << GRAPH_HILBERT_BITS;
+    unsigned int s, rx, ry, t, d = 0;
+
+    for (s = n / 2; s > 0; s /= 2) {
+        rx = (x & s) > 0;
+        ry = (y & s) > 0;
+        d += s * s * ((3 * rx) ^ ry);
+
+        // Rotate the quadrant so the curve inside it has the right direction
+        if (ry == 0) {
+            if (rx == 1) {
+                x = n - 1 - x;
+                y = n - 1 - y;
+            }
+            t = x;
+            x = y;
+            y = t;
+        }
+    }
+    return d;
+}
+
+int graph_order_cmp(const void *a, const void *b) {
+    const GraphOrder *oa = a;
+    const GraphOrder *ob = b;
+
+    if (oa->key != ob->key)
+        return oa->key < ob->key ? -1 : 1;
+    if (oa->node != ob->node)
+        return oa->node < ob->node ? -1 : 1;
+    return 0;
+}
+
+// Build the structure of arrays layout of a routing index. The lengths of
+// the ways are copied from the index, so compile a profile for it first.
+RoutingGraph * routing_graph_new(RoutingIndex *ri) {
+    RoutingGraph *graph = malloc(sizeof(RoutingGraph));
+    GraphOrder *order;
+    double min_lat, max_lat, min_lon, max_lon, scale;
+    unsigned int i, j, w;
+
+    routing_index_way_lengths(ri);
+
+    graph->ri = ri;
+    graph->nrof_nodes = ri->nrof_nodes;
+    graph->nrof_ways = ri->nrof_ways;
+    graph->way_offsets = malloc((ri->nrof_nodes + 1) * sizeof(unsigned int));
+    graph->lat = malloc(ri->nrof_nodes * sizeof(int));
+    graph->lon = malloc(ri->nrof_nodes * sizeof(int));
+    graph->way_next = malloc(ri->nrof_ways * sizeof(unsigned int));
+    graph->way_tagset = malloc(ri->nrof_ways * sizeof(unsigned char));
+    graph->way_lengths = malloc(ri->nrof_ways * sizeof(double));
+    graph->ids = malloc(ri->nrof_nodes * sizeof(unsigned int));
+    graph->x = malloc(ri->nrof_nodes * sizeof(double));
+    graph->y = malloc(ri->nrof_nodes * sizeof(double));
+    graph->order = malloc(ri->nrof_nodes * sizeof(unsigned int));
+    graph->position = malloc(ri->nrof_nodes * sizeof(unsigned int));
+    order = malloc(ri->nrof_nodes * sizeof(GraphOrder));
+    if (ri->nrof_nodes > 0 && (!graph->lat || !graph->lon || !graph->ids || !graph->x ||
+                !graph->y || !graph->order || !graph->position || !order)) {
+        fprintf(stderr, "Couldn't allocate memory for the routing graph\n");
+        exit(-1);
+    }
+    if (ri->nrof_ways > 0 && (!graph->way_next || !graph->way_tagset || !graph->way_lengths)) {
+        fprintf(stderr, "Couldn't allocate memory for the routing graph\n");
+        exit(-1);
+    }
+
+    // Sort the nodes along the curve
+    min_lat = max_lat = min_lon = max_lon = 0.0;
+    for (i = 0; i < ri->nrof_nodes; i++) {
+        RoutingNode *nd = &ri->nodes[i];
+        if (i == 0 || nd->lat < min_lat) min_lat = nd->lat;
+        if (i == 0 || nd->lat > max_lat) max_lat = nd->lat;
+        if (i == 0 || nd->lon < min_lon) min_lon = nd->lon;
+        if (i == 0 || nd->lon > max_lon) max_lon = nd->lon;
+    }
+    scale = ((1 << GRAPH_HILBERT_BITS) - 1) / fmax(fmax(max_lat - min_lat, max_lon - min_lon), 1e-9);
+    for (i = 0; i < ri->nrof_nodes; i++) {
+        RoutingNode *nd = &ri->nodes[i];
+        order[i].key = hilbert_index((nd->lon - min_lon) * scale, (nd->lat - min_lat) * scale);
+        order[i].node = i;
+    }
+    qsort(order, ri->nrof_nodes, sizeof(GraphOrder), graph_order_cmp);
+    for (i = 0; i < ri->nrof_nodes; i++) {
+        graph->order[i] = order[i].node;
+        graph->position[order[i].node] = i;
+    }
+    free(order);
+
+    // Copy the nodes and their ways in the new order
+    j = 0;
+    for (i = 0; i < ri->nrof_nodes; i++) {
+        RoutingNode *nd = &ri->nodes[graph->order[i]];
+
+        graph->way_offsets[i] = j;
+        graph->lat[i] = lround(nd->lat * GRAPH_COORD_SCALE);
+        graph->lon[i] = lround(nd->lon * GRAPH_COORD_SCALE);
+        graph->ids[i] = nd->id;
+        graph->x[i] = nd->x;
+        graph->y[i] = nd->y;
+        for (w = nd->way.start; w < nd->way.end; w++, j++) {
+            graph->way_next[j] = graph->position[ri->ways[w].next];
+            graph->way_tagset[j] = ri->ways[w].tagset;
+            graph->way_lengths[j] = ri->way_lengths[w];
+        }
+    }
+    graph->way_offsets[ri->nrof_nodes] = j;
+
+    return graph;
+}
+
+void routing_graph_free(RoutingGraph *graph) {
+    free(graph->way_offsets);
+    free(graph->lat);
+    free(graph->lon);
+    free(graph->way_next);
+    free(graph->way_tagset);
+    free(graph->way_lengths);
+    free(graph->ids);
+    free(graph->x);
+    free(graph->y);
+    free(graph->order);
+    free(graph->position);
+    free(graph);
+}
+
+// Distance between two nodes of the graph from their fixed point coordinates
+double graph_distance(RoutingGraph *graph, unsigned int a, unsigned int b) {
+    return distance(graph->lat[a] / GRAPH_COORD_SCALE, graph->lon[a] / GRAPH_COORD_SCALE,
+            graph->lat[b] / GRAPH_COORD_SCALE, graph->lon[b] / GRAPH_COORD_SCALE);
+}
+
+GraphRouter * graph_router_new(RoutingGraph *graph, CompiledProfile *profile) {
+    GraphRouter *router = malloc(sizeof(GraphRouter));
+
+    router->graph = graph;
+    router->profile = profile;
+    router->cost = malloc(graph->nrof_nodes * sizeof(double));
+    router->previous = malloc(graph->nrof_nodes * sizeof(unsigned int));
+    router->touched = calloc(graph->nrof_nodes, sizeof(unsigned int));
+    if (!router->cost || !router->previous || !router->touched) {
+        fprintf(stderr, "Couldn't allocate memory for the router\n");
+        exit(-1);
+    }
+    node_heap_init(&router->heap, graph->nrof_nodes);
+    router->query = 0;
+    router->nrof_settled = 0;
+    router->heuristic_factor = profile->min_factor;
+
+    return router;
+}
+
+void graph_router_free(GraphRouter *router) {
+    free(router->cost);
+    free(router->previous);
+    free(router->touched);
+    node_heap_free(&router->heap);
+    free(router);
+}
+
+void graph_router_touch(GraphRouter *router, unsigned int node) {
+    if (router->touched[node] != router->query) {
+        router->touched[node] = router->query;
+        router->cost[node] = INFINITY;
+        router->heap.position[node] = NODE_HEAP_NOT_SEEN;
+    }
+}
+
+// Follow the previous nodes back from the target, with the nodes of the
+// route made up from the arrays of the graph. The ranges of ways are those
+// of the routing index, like in the routes of a Router.
+Route * graph_router_make_route(GraphRouter *router, unsigned int from, unsigned int to) {
+    RoutingGraph *graph = router->graph;
+    Route *route = malloc(sizeof(Route));
+    unsigned int n;
+    int i, count;
+
+    count = 1;
+    for (n = to; n != from; n = router->previous[n])
+        count++;
+
+    route->nrof_nodes = count;
+    route->nodes = malloc(count * sizeof(RoutingNode));
+    route->length = 0.0;
+    route->cost = router->cost[to];
+    n = to;
+    for (i = count - 1; i >= 0; i--) {
+        RoutingNode *nd = &route->nodes[i];
+
+        nd->id = graph->ids[n];
+        nd->way.start = graph->ri->nodes[graph->order[n]].way.start;
+        nd->way.end = graph->ri->nodes[graph->order[n]].way.end;
+        nd->lat = graph->lat[n] / GRAPH_COORD_SCALE;
+        nd->lon = graph->lon[n] / GRAPH_COORD_SCALE;
+        nd->x = graph->x[n];
+        nd->y = graph->y[n];
+        if (i < count - 1)
+            route->length += distance(nd->lat, nd->lon, route->nodes[i+1].lat, route->nodes[i+1].lon);
+        n = router->previous[n];
+    }
+
+    return route;
+}
+
+// Find the cheapest route between two nodes of the graph, numbered by
+// their positions. Returns NULL if there is none, or if the cheapest is
+// longer than the max_route_length of the profile when that is positive.
+Route * graph_router_route(GraphRouter *router, unsigned int from, unsigned int to) {
+    RoutingGraph *graph = router->graph;
+    CompiledProfile *cp = router->profile;
+    double max_length = cp->profile->max_route_length;
+    double max_cost = max_length > 0.0 ? max_length * cp->max_factor : INFINITY;
+    Route *route;
+    // The heuristic comes from rounded coordinates, allow for the rounding
+    // so that it never overestimates. It can then be off by the slack
+    // between neighbours, so a closed node is opened again when a cheaper
+    // route to it turns up, and the route found is still the cheapest.
+    double slack = 2 * distance(0.0, 0.0, 1.0 / GRAPH_COORD_SCALE, 0.0);
+
+    if (from >= graph->nrof_nodes || to >= graph->nrof_nodes)
+        return NULL;
+
+    router->query++;
+    if (router->query == 0) {
+        memset(router->touched, 0, graph->nrof_nodes * sizeof(unsigned int));
+        router->query = 1;
+    }
+    router->heap.size = 0;
+    router->nrof_settled = 0;
+
+    graph_router_touch(router, from);
+    router->cost[from] = 0.0;
+    router->previous[from] = from;
+    node_heap_update(&router->heap, from, 0.0);
+
+    while (router->heap.size > 0) {
+        unsigned int n, w, end;
+
+        if (router->heap.entries[0].key > max_cost)
+            break;
+
+        n = node_heap_pop(&router->heap);
+        router->nrof_settled++;
+        if (n == to) {
+            route = graph_router_make_route(router, from, to);
+            if (max_length > 0.0 && route->length > max_length) {
+                route_free(route);
+                return NULL;
+            }
+            return route;
+        }
+
+        end = graph->way_offsets[n + 1];
+        for (w = graph->way_offsets[n]; w < end; w++) {
+            unsigned int next = graph->way_next[w];
+            double cost, remaining;
+
+            graph_router_touch(router, next);
+            cost = router->cost[n] + graph->way_lengths[w] * cp->tagset_factors[graph->way_tagset[w]];
+            if (cost < router->cost[next]) {
+                router->cost[next] = cost;
+                router->previous[next] = n;
+                remaining = 0.0;
+                if (router->heuristic_factor > 0.0)
+                    remaining = router->heuristic_factor *
+                        fmax(graph_distance(graph, next, to) - slack, 0.0);
+                node_heap_update(&router->heap, next, cost + remaining);
+            }
+        }
+    }
+
+    return NULL;
+}
@@ -0,0 +1,351 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include "mapgenerator.h"
+
+// Map matching of GPS traces with a hidden Markov model, see Newson and
+// Krumm, "Hidden Markov Map Matching Through Noise and Sparseness"
+//
+// The candidates of a point are the closest nodes of the routing index
+// within MATCH_RADIUS. The probability of a candidate falls with its
+// distance from the point as a normal distribution, and that of going from
+// a candidate of one point to one of the next falls exponentially with the
+// difference between the route distance and the straight line distance
+// between the points. The most probable sequence of candidates is found
+// with the Viterbi algorithm, working with the logarithms of the
+// probabilities.
+//
+// The route distances from a candidate are found with a Dijkstra search
+// that stops when it has settled all candidates of the next point. The
+// search state is kept in the matcher between points and traces, and each
+// thread matching traces has a matcher of its own.
+//
+// Where no candidate of a point can be reached from those of the point
+// before, the sequence is ended there and a new one started.
+
+typedef struct _MatchBatch MatchBatch;
+
+struct _MatchBatch {
+    RoutingIndex *ri;
+    Trace *traces;
+    int count;
+    int next;            // Next trace for a thread to take
+    pthread_mutex_t lock;
+};
+
+Matcher * matcher_new(RoutingIndex *ri) {
+    Matcher *matcher = malloc(sizeof(Matcher));
+
+    routing_index_way_lengths(ri);
+
+    matcher->ri = ri;
+    ch_search_init(&matcher->search, ri->nrof_nodes);
+    matcher->candidates = NULL;
+    matcher->nrof_candidates = NULL;
+    matcher->chosen = NULL;
+    matcher->allocated = 0;
+    matcher->route_distances = malloc(MATCH_MAX_CANDIDATES * MATCH_MAX_CANDIDATES * sizeof(double));
+    matcher->nrof_settled = 0;
+
+    return matcher;
+}
+
+void matcher_free(Matcher *matcher) {
+    ch_search_free(&matcher->search);
+    free(matcher->candidates);
+    free(matcher->nrof_candidates);
+    free(matcher->chosen);
+    free(matcher->route_distances);
+    free(matcher);
+}
+
+// Make room for the candidates of a trace with the given number of points
+void matcher_reserve(Matcher *matcher, int nrof_points) {
+    if (nrof_points <= matcher->allocated)
+        return;
+
+    free(matcher->candidates);
+    free(matcher->nrof_candidates);
+    free(matcher->chosen);
+    matcher->candidates = malloc(nrof_points * MATCH_MAX_CANDIDATES * sizeof(MatchCandidate));
+    matcher->nrof_candidates = malloc(nrof_points * sizeof(int));
+    matcher->chosen = malloc(nrof_points * sizeof(int));
+    if (!matcher->candidates || !matcher->nrof_candidates || !matcher->chosen) {
+        fprintf(stderr, "Couldn't allocate memory for matching a trace of %d points\n",
+                nrof_points);
+        exit(-1);
+    }
+    matcher->allocated = nrof_points;
+}
+
+// Route distance farther than which the next point isn't searched for
+double matcher_limit(Trace *trace, int i) {
+    TracePoint *p = &trace->points[i-1];
+    TracePoint *q = &trace->points[i];
+
+    return MATCH_DETOUR_FACTOR * distance(p->lat, p->lon, q->lat, q->lon) + 2*MATCH_RADIUS;
+}
+
+// Search from a node until the candidates have all been settled, setting
+// the route distance to each of them, or INFINITY if it is beyond limit
+void matcher_search(Matcher *matcher, unsigned int from, MatchCandidate *targets,
+        int nrof_targets, double limit, double *distances) {
+    RoutingIndex *ri = matcher->ri;
+    ChSearch *search = &matcher->search;
+    int i, found;
+
+    for (i = 0; i < nrof_targets; i++)
+        distances[i] = INFINITY;
+
+    ch_search_start(search, ri->nrof_nodes);
+    ch_search_relax(search, from, from, 0.0);
+    found = 0;
+    while (search->heap.size > 0 && found < nrof_targets) {
+        RoutingNode *nd;
+        unsigned int n, w;
+
+        if (search->heap.entries[0].key > limit)
+            break;
+
+        n = node_heap_pop(&search->heap);
+        matcher->nrof_settled++;
+        for (i = 0; i < nrof_targets; i++) {
+            if (targets[i].node == n) {
+                distances[i] = search->cost[n];
+                found++;
+            }
+        }
+
+        nd = &ri->nodes[n];
+        for (w = nd->way.start; w < nd->way.end; w++)
+            ch_search_relax(search, ri->ways[w].next, n, search->cost[n] + ri->way_lengths[w]);
+    }
+}
+
+// Score the candidates of a point by the most probable sequence from those
+// of the point before. Returns 0 if none of them can be reached.
+int matcher_transition(Matcher *matcher, Trace *trace, int i) {
+    MatchCandidate *from = &matcher->candidates[(i-1) * MATCH_MAX_CANDIDATES];
+    MatchCandidate *to = &matcher->candidates[i * MATCH_MAX_CANDIDATES];
+    int nrof_from = matcher->nrof_candidates[i-1];
+    int nrof_to = matcher->nrof_candidates[i];
+    TracePoint *p = &trace->points[i-1];
+    TracePoint *q = &trace->points[i];
+    double straight, limit;
+    int a, b, reached;
+
+    straight = distance(p->lat, p->lon, q->lat, q->lon);
+    limit = matcher_limit(trace, i);
+    for (a = 0; a < nrof_from; a++) {
+        double *distances = &matcher->route_distances[a * MATCH_MAX_CANDIDATES];
+
+        if (from[a].score == -INFINITY) {
+            for (b = 0; b < nrof_to; b++)
+                distances[b] = INFINITY;
+            continue;
+        }
+        matcher_search(matcher, from[a].node, to, nrof_to, limit, distances);
+    }
+
+    reached = 0;
+    for (b = 0; b < nrof_to; b++) {
+        double best = -INFINITY;
+
+        for (a = 0; a < nrof_from; a++) {
+            double d = matcher->route_distances[a * MATCH_MAX_CANDIDATES + b];
+            double score;
+
+            if (d == INFINITY)
+                continue;
+            score = from[a].score - fabs(d - straight) / MATCH_BETA;
+            if (score > best) {
+                best = score;
+                to[b].previous = a;
+            }
+        }
+        if (to[b].previous >= 0)
+            reached = 1;
+        to[b].score += best;
+    }
+
+    // Start a new sequence, keeping the scores of the distances alone
+    if (!reached) {
+        for (b = 0; b < nrof_to; b++)
+            to[b].score = -0.5 * (to[b].distance / MATCH_SIGMA) * (to[b].distance / MATCH_SIGMA);
+    }
+    return reached;
+}
+
+// Match the points of the sequence ending at a point, following the best
+// candidate back to where the sequence started
+void matcher_backtrack(Matcher *matcher, Trace *trace, int last) {
+    MatchCandidate *c = &matcher->candidates[last * MATCH_MAX_CANDIDATES];
+    int i, b, best;
+
+    best = 0;
+    for (b = 1; b < matcher->nrof_candidates[last]; b++) {
+        if (c[b].score > c[best].score)
+            best = b;
+    }
+
+    for (i = last; i >= 0; i--) {
+        c = &matcher->candidates[i * MATCH_MAX_CANDIDATES + best];
+        trace->points[i].node = c->node;
+        trace->points[i].distance = c->distance;
+        matcher->chosen[i] = best;
+        if (c->previous < 0)
+            break;
+        best = c->previous;
+    }
+}
+
+void trace_path_append(Trace *trace, int *allocated, unsigned int node) {
+    if (trace->path_length == *allocated) {
+        *allocated = *allocated ? 2 * *allocated : 64;
+        trace->path = realloc(trace->path, *allocated * sizeof(unsigned int));
+        if (!trace->path) {
+            fprintf(stderr, "Couldn't allocate memory for a matched path\n");
+            exit(-1);
+        }
+    }
+    trace->path[trace->path_length++] = node;
+}
+
+// Find the nodes along the routes between the matched points again
+void matcher_make_path(Matcher *matcher, Trace *trace) {
+    int i, allocated;
+
+    trace->path = NULL;
+    trace->path_length = 0;
+    allocated = 0;
+    for (i = 0; i < trace->nrof_points; i++) {
+        TracePoint *p = &trace->points[i];
+        MatchCandidate *c;
+        double route_distance;
+        unsigned int n;
+        int start;
+
+        c = &matcher->candidates[i * MATCH_MAX_CANDIDATES + matcher->chosen[i]];
+        if (p->node == MATCH_NO_NODE || c->previous < 0) {
+            if (trace->path_length > 0 && trace->path[trace->path_length - 1] != MATCH_NO_NODE)
+                trace_path_append(trace, &allocated, MATCH_NO_NODE);
+            if (p->node != MATCH_NO_NODE)
+                trace_path_append(trace, &allocated, p->node);
+            continue;
+        }
+        if (p->node == trace->points[i-1].node)
+            continue;
+
+        // Add the route backwards, then turn it around
+        matcher_search(matcher, trace->points[i-1].node, c, 1, matcher_limit(trace, i),
+                &route_distance);
+        start = trace->path_length;
+        for (n = p->node; n != trace->points[i-1].node; n = matcher->search.previous[n])
+            trace_path_append(trace, &allocated, n);
+        for (n = 0; n < (trace->path_length - start) / 2; n++) {
+            unsigned int tmp = trace->path[start + n];
+            trace->path[start + n] = trace->path[trace->path_length - 1 - n];
+            trace->path[trace->path_length - 1 - n] = tmp;
+        }
+    }
+}
+
+// Match the points of a trace to nodes of the routing index. The path of
+// the trace is allocated with malloc, the caller frees it.
+void matcher_match(Matcher *matcher, Trace *trace) {
+    RoutingIndex *ri = matcher->ri;
+    unsigned int nodes[MATCH_MAX_CANDIDATES];
+    double distances[MATCH_MAX_CANDIDATES];
+    int i, b, n, chain;
+
+    matcher_reserve(matcher, trace->nrof_points);
+    matcher->nrof_settled = 0;
+
+    // Whether the point before has candidates to continue from
+    chain = 0;
+    for (i = 0; i < trace->nrof_points; i++) {
+        TracePoint *p = &trace->points[i];
+        MatchCandidate *c = &matcher->candidates[i * MATCH_MAX_CANDIDATES];
+
+        p->node = MATCH_NO_NODE;
+        p->distance = 0.0;
+        matcher->chosen[i] = 0;
+
+        // The nodes come closest first
+        n = routing_index_nearest(ri, p->lat, p->lon, MATCH_MAX_CANDIDATES, nodes, distances);
+        for (b = 0; b < n && distances[b] <= MATCH_RADIUS; b++) {
+            c[b].node = nodes[b];
+            c[b].distance = distances[b];
+            c[b].score = -0.5 * (distances[b] / MATCH_SIGMA) * (distances[b] / MATCH_SIGMA);
+            c[b].previous = -1;
+        }
+        matcher->nrof_candidates[i] = b;
+
+        if (b == 0) {
+            if (chain)
+                matcher_backtrack(matcher, trace, i - 1);
+            chain = 0;
+            continue;
+        }
+        if (chain && !matcher_transition(matcher, trace, i))
+            matcher_backtrack(matcher, trace, i - 1);
+        chain = 1;
+    }
+    if (chain)
+        matcher_backtrack(matcher, trace, trace->nrof_points - 1);
+
+    matcher_make_path(matcher, trace);
+}
+
+void * match_worker_run(void *data) {
+    MatchBatch *batch = data;
+    Matcher *matcher = matcher_new(batch->ri);
+    int i;
+
+    for (;;) {
+        pthread_mutex_lock(&batch->lock);
+        i = batch->next++;
+        pthread_mutex_unlock(&batch->lock);
+        if (i >= batch->count)
+            break;
+        matcher_match(matcher, &batch->traces[i]);
+    }
+
+    matcher_free(matcher);
+    return NULL;
+}
+
+// Match a batch of traces, the threads taking the next trace as they finish
+void match_traces(RoutingIndex *ri, Trace *traces, int count, int nrof_threads) {
+    MatchBatch batch;
+    pthread_t *threads;
+    int i;
+
+    // The threads share the way lengths
+    routing_index_way_lengths(ri);
+
+    batch.ri = ri;
+    batch.traces = traces;
+    batch.count = count;
+    batch.next = 0;
+    pthread_mutex_init(&batch.lock, NULL);
+
+    if (nrof_threads <= 1) {
+        match_worker_run(&batch);
+    } else {
+        threads = malloc(nrof_threads * sizeof(pthread_t));
+        for (i = 0; i < nrof_threads; i++) {
+            if (pthread_create(&threads[i], NULL, match_worker_run, &batch)) {
+                fprintf(stderr, "Couldn't start a matching thread\n");
+                exit(-1);
+            }
+        }
+        for (i = 0; i < nrof_threads; i++)
+            pthread_join(threads[i], NULL);
+        free(threads);
+    }
+
+    pthread_mutex_destroy(&batch.lock);
+}
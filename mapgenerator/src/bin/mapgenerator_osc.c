@@ -0,0 +1,147 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <expat.h>
+#include "mapgenerator.h"
+
+// Reader for OSM change files (.osc), see http://wiki.openstreetmap.org/wiki/OsmChange
+//
+// The nodes and ways of a change file are passed to the handler as for a
+// full file. Before the elements of each create, modify or delete section
+// the change callback is called with the action of that section. Deleted
+// elements may come without their contents, only the ids can be relied on.
+
+#define OSC_BUFF_SIZE (1024*1024)
+
+typedef struct _OscParser OscParser;
+
+struct _OscParser {
+    OsmHandler *handler;
+    int in_way;
+};
+
+void
+osc_start(void *data, const char *el, const char **attr) {
+    OscParser *parser = data;
+    OsmHandler *handler = parser->handler;
+    int i;
+
+    if (!strcmp(el, "create")) {
+        handler->change(handler->data, OSC_CREATE);
+    }
+    else if (!strcmp(el, "modify")) {
+        handler->change(handler->data, OSC_MODIFY);
+    }
+    else if (!strcmp(el, "delete")) {
+        handler->change(handler->data, OSC_DELETE);
+    }
+    else if (!strcmp(el, "node")) {
+        unsigned int id = 0;
+        double lat = 0.0, lon = 0.0;
+
+        for (i = 0; attr[i]; i += 2) {
+            if (!strcmp(attr[i], "id"))
+                sscanf(attr[i+1], "%u", &id);
+            if (!strcmp(attr[i], "lat"))
+                sscanf(attr[i+1], "%lf", &lat);
+            if (!strcmp(attr[i], "lon"))
+                sscanf(attr[i+1], "%lf", &lon);
+        }
+
+        handler->node(handler->data, id, lat, lon);
+    }
+    else if (!strcmp(el, "way")) {
+        unsigned int id = 0;
+
+        for (i = 0; attr[i]; i += 2) {
+            if (!strcmp(attr[i], "id"))
+                sscanf(attr[i+1], "%u", &id);
+        }
+
+        handler->way_start(handler->data, id);
+        parser->in_way = 1;
+    }
+    else if (!strcmp(el, "tag") && parser->in_way) {
+        const char *key = NULL, *value = NULL;
+
+        for (i = 0; attr[i]; i += 2) {
+            if (!strcmp(attr[i], "k"))
+                key = attr[i+1];
+            else if (!strcmp(attr[i], "v"))
+                value = attr[i+1];
+        }
+
+        if (key && value)
+            handler->way_tag(handler->data, key, value);
+    }
+    else if (!strcmp(el, "nd") && parser->in_way) {
+        unsigned int ref = 0;
+
+        for (i = 0; attr[i]; i += 2) {
+            if (!strcmp(attr[i], "ref"))
+                sscanf(attr[i+1], "%u", &ref);
+        }
+
+        handler->way_node(handler->data, ref);
+    }
+}
+
+void
+osc_end(void *data, const char *el) {
+    OscParser *parser = data;
+
+    if (!strcmp(el, "way")) {
+        parser->handler->way_end(parser->handler->data);
+        parser->in_way = 0;
+    }
+}
+
+// Parse a change file, passing all elements to the handler which must have
+// every callback set. Returns -1 if the file can't be opened, 0 otherwise.
+int osc_parse_file(const char *filename, OsmHandler *handler) {
+    OscParser osc;
+    XML_Parser parser;
+    FILE *fp;
+
+    fp = fopen(filename, "r");
+    if (!fp)
+        return -1;
+
+    parser = XML_ParserCreate(NULL);
+    if (!parser) {
+        fprintf(stderr, "Couldn't allocate memory for parser\n");
+        exit(-1);
+    }
+    osc.handler = handler;
+    osc.in_way = 0;
+    XML_SetUserData(parser, &osc);
+    XML_SetElementHandler(parser, osc_start, osc_end);
+
+    for (;;) {
+        int bytes_read;
+        void *buff = XML_GetBuffer(parser, OSC_BUFF_SIZE);
+        if (!buff) {
+            fprintf(stderr, "Couldn't allocate memory for buffer\n");
+            exit(-1);
+        }
+        bytes_read = fread(buff, 1, OSC_BUFF_SIZE, fp);
+        if (ferror(fp)) {
+            fprintf(stderr, "Can't read from file\n");
+            exit(-1);
+        }
+
+        if (! XML_ParseBuffer(parser, bytes_read, bytes_read == 0)) {
+            fprintf(stderr, "Parse error at line %d:\n%s\n",
+                    (int)XML_GetCurrentLineNumber(parser),
+                    XML_ErrorString(XML_GetErrorCode(parser)));
+            exit(-1);
+        }
+
+        if (bytes_read == 0)
+            break;
+    }
+
+    XML_ParserFree(parser);
+    fclose(fp);
+    return 0;
+}
@@ -0,0 +1,664 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <zlib.h>
+#include "mapgenerator.h"
+
+// Reader for the OSM PBF format, see http://wiki.openstreetmap.org/wiki/PBF_Format
+//
+// The file is a sequence of blobs, each holding a zlib compressed protobuf
+// message. Blobs are read sequentially by the calling thread and handed to
+// a pool of worker threads which inflate and decode them. The decoded
+// blocks are then passed to the handler in file order, so the handler sees
+// the same sequence of nodes and ways as with the XML parser.
+
+#define PBF_MAX_HEADER_SIZE (64*1024)
+#define PBF_MAX_BLOB_SIZE (32*1024*1024)
+#define PBF_BLOCKS_PER_THREAD 4
+
+typedef struct _PbfBuffer PbfBuffer;
+typedef struct _PbfNode PbfNode;
+typedef struct _PbfWay PbfWay;
+typedef struct _PbfBlock PbfBlock;
+typedef struct _PbfReader PbfReader;
+
+enum { PBF_BLOCK_EMPTY, PBF_BLOCK_READ, PBF_BLOCK_DECODING, PBF_BLOCK_DONE };
+
+struct _PbfBuffer {
+    const unsigned char *pos;
+    const unsigned char *end;
+};
+
+struct _PbfNode {
+    int64_t id;
+    double lat;
+    double lon;
+};
+
+struct _PbfWay {
+    int64_t id;
+    int first_tag;
+    int nrof_tags;
+    int first_ref;
+    int nrof_refs;
+};
+
+struct _PbfBlock {
+    int state;
+    int seq;
+    int is_header;
+
+    // Raw blob as read from file, and the inflated message
+    unsigned char *blob;
+    int blob_size;
+    int blob_allocated;
+    unsigned char *data;
+    int data_allocated;
+
+    // String table, copied so that each string is NUL terminated
+    char *strings;
+    int strings_allocated;
+    char **string_table;
+    int nrof_strings;
+    int string_table_allocated;
+
+    PbfBuffer *groups;
+    int nrof_groups;
+    int groups_allocated;
+
+    PbfNode *nodes;
+    int nrof_nodes;
+    int nodes_allocated;
+    PbfWay *ways;
+    int nrof_ways;
+    int ways_allocated;
+    unsigned int *tags; // Key and value string indices for each tag
+    int nrof_tags;
+    int tags_allocated;
+    int64_t *refs;
+    int nrof_refs;
+    int refs_allocated;
+};
+
+struct _PbfReader {
+    OsmHandler *handler;
+    PbfBlock *blocks;
+    int nrof_blocks;
+    pthread_t *threads;
+    int nrof_threads;
+    pthread_mutex_t lock;
+    pthread_cond_t work_cond;
+    pthread_cond_t done_cond;
+    int quit;
+};
+
+void pbf_error(const char *msg) {
+    fprintf(stderr, "PBF: %s\n", msg);
+    exit(-1);
+}
+
+// Make room for at least needed elements of the given size
+void * pbf_grow(void *array, int *allocated, int needed, int size) {
+    if (needed <= *allocated)
+        return array;
+
+    while (*allocated < needed)
+        *allocated = *allocated ? 2*(*allocated) : 1024;
+    array = realloc(array, (size_t)*allocated * size);
+    if (!array)
+        pbf_error("Couldn't allocate memory");
+
+    return array;
+}
+
+uint64_t pbf_varint(PbfBuffer *b) {
+    uint64_t value = 0;
+    int shift = 0;
+
+    while (b->pos < b->end && shift < 64) {
+        unsigned char c = *b->pos++;
+        value |= (uint64_t)(c & 0x7f) << shift;
+        if (!(c & 0x80))
+            return value;
+        shift += 7;
+    }
+
+    pbf_error("Malformed varint");
+    return 0;
+}
+
+int64_t pbf_svarint(PbfBuffer *b) {
+    uint64_t value = pbf_varint(b);
+
+    // Zig-zag decoding
+    return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+// Read a field key, returns 0 at the end of the buffer
+int pbf_key(PbfBuffer *b, int *field, int *wire_type) {
+    uint64_t key;
+
+    if (b->pos >= b->end)
+        return 0;
+
+    key = pbf_varint(b);
+    *field = key >> 3;
+    *wire_type = key & 0x07;
+
+    return 1;
+}
+
+// Read a length delimited field as a buffer of its own
+PbfBuffer pbf_bytes(PbfBuffer *b) {
+    PbfBuffer sub;
+    uint64_t size;
+
+    size = pbf_varint(b);
+    if (size > (uint64_t)(b->end - b->pos))
+        pbf_error("Field extends past end of message");
+
+    sub.pos = b->pos;
+    sub.end = b->pos + size;
+    b->pos += size;
+
+    return sub;
+}
+
+void pbf_skip(PbfBuffer *b, int wire_type) {
+    switch (wire_type) {
+        case 0:
+            pbf_varint(b);
+            break;
+        case 1:
+            b->pos += 8;
+            break;
+        case 2:
+            pbf_bytes(b);
+            break;
+        case 5:
+            b->pos += 4;
+            break;
+        default:
+            pbf_error("Unsupported wire type");
+    }
+
+    if (b->pos > b->end)
+        pbf_error("Field extends past end of message");
+}
+
+int pbf_bytes_equal(PbfBuffer b, const char *s) {
+    int len = strlen(s);
+
+    return b.end - b.pos == len && !memcmp(b.pos, s, len);
+}
+
+// Read the next blob from file, skipping blob types we don't know
+int pbf_read_blob(FILE *fp, PbfBlock *block) {
+    unsigned char header[PBF_MAX_HEADER_SIZE];
+    unsigned char size_buf[4];
+    unsigned int header_size;
+    PbfBuffer b, type;
+    int field, wire_type, data_size;
+
+    for (;;) {
+        if (fread(size_buf, 1, 4, fp) != 4)
+            return 0;
+
+        header_size = size_buf[0] << 24 | size_buf[1] << 16 | size_buf[2] << 8 | size_buf[3];
+        if (header_size > PBF_MAX_HEADER_SIZE)
+            pbf_error("Blob header too large");
+        if (fread(header, 1, header_size, fp) != header_size)
+            pbf_error("Unexpected end of file");
+
+        // Parse the BlobHeader
+        b.pos = header;
+        b.end = header + header_size;
+        type.pos = type.end = NULL;
+        data_size = -1;
+        while (pbf_key(&b, &field, &wire_type)) {
+            if (field == 1 && wire_type == 2)
+                type = pbf_bytes(&b);
+            else if (field == 3 && wire_type == 0)
+                data_size = pbf_varint(&b);
+            else
+                pbf_skip(&b, wire_type);
+        }
+        if (data_size < 0 || data_size > PBF_MAX_BLOB_SIZE)
+            pbf_error("Invalid blob size");
+
+        if (pbf_bytes_equal(type, "OSMData") || pbf_bytes_equal(type, "OSMHeader"))
+            break;
+
+        if (fseek(fp, data_size, SEEK_CUR) < 0)
+            pbf_error("Unexpected end of file");
+    }
+
+    block->is_header = pbf_bytes_equal(type, "OSMHeader");
+    block->blob = pbf_grow(block->blob, &block->blob_allocated, data_size, 1);
+    block->blob_size = data_size;
+    if (fread(block->blob, 1, data_size, fp) != data_size)
+        pbf_error("Unexpected end of file");
+
+    return 1;
+}
+
+// Unpack the Blob message, returns a buffer with the contained message
+PbfBuffer pbf_block_inflate(PbfBlock *block) {
+    PbfBuffer b, raw, zlib_data;
+    int field, wire_type, raw_size;
+    uLongf dest_size;
+
+    b.pos = block->blob;
+    b.end = block->blob + block->blob_size;
+    raw.pos = raw.end = NULL;
+    zlib_data.pos = zlib_data.end = NULL;
+    raw_size = -1;
+
+    while (pbf_key(&b, &field, &wire_type)) {
+        if (field == 1 && wire_type == 2)
+            raw = pbf_bytes(&b);
+        else if (field == 2 && wire_type == 0)
+            raw_size = pbf_varint(&b);
+        else if (field == 3 && wire_type == 2)
+            zlib_data = pbf_bytes(&b);
+        else if (wire_type == 2)
+            pbf_error("Unsupported blob compression");
+        else
+            pbf_skip(&b, wire_type);
+    }
+
+    if (raw.pos)
+        return raw;
+
+    if (!zlib_data.pos || raw_size < 0 || raw_size > PBF_MAX_BLOB_SIZE)
+        pbf_error("Invalid blob");
+
+    block->data = pbf_grow(block->data, &block->data_allocated, raw_size, 1);
+    dest_size = raw_size;
+    if (uncompress(block->data, &dest_size, zlib_data.pos, zlib_data.end - zlib_data.pos) != Z_OK
+            || dest_size != raw_size)
+        pbf_error("Couldn't inflate blob");
+
+    b.pos = block->data;
+    b.end = block->data + raw_size;
+    return b;
+}
+
+void pbf_check_header(PbfBuffer b) {
+    int field, wire_type;
+
+    while (pbf_key(&b, &field, &wire_type)) {
+        if (field == 4 && wire_type == 2) {
+            PbfBuffer feature = pbf_bytes(&b);
+            if (!pbf_bytes_equal(feature, "OsmSchema-V0.6") &&
+                    !pbf_bytes_equal(feature, "DenseNodes")) {
+                fprintf(stderr, "PBF: Unsupported required feature '%.*s'\n",
+                        (int)(feature.end - feature.pos), feature.pos);
+                exit(-1);
+            }
+        } else {
+            pbf_skip(&b, wire_type);
+        }
+    }
+}
+
+void pbf_read_string_table(PbfBlock *block, PbfBuffer b) {
+    int field, wire_type;
+    char *s;
+
+    // All strings fit in the table message, with room for the terminators
+    block->strings = pbf_grow(block->strings, &block->strings_allocated, b.end - b.pos, 1);
+    s = block->strings;
+
+    while (pbf_key(&b, &field, &wire_type)) {
+        if (field == 1 && wire_type == 2) {
+            PbfBuffer str = pbf_bytes(&b);
+            int len = str.end - str.pos;
+
+            block->string_table = pbf_grow(block->string_table, &block->string_table_allocated,
+                    block->nrof_strings + 1, sizeof(char *));
+            block->string_table[block->nrof_strings++] = s;
+            memcpy(s, str.pos, len);
+            s[len] = '\0';
+            s += len + 1;
+        } else {
+            pbf_skip(&b, wire_type);
+        }
+    }
+}
+
+void pbf_add_node(PbfBlock *block, int64_t id, double lat, double lon) {
+    PbfNode *node;
+
+    block->nodes = pbf_grow(block->nodes, &block->nodes_allocated,
+            block->nrof_nodes + 1, sizeof(PbfNode));
+    node = &block->nodes[block->nrof_nodes++];
+    node->id = id;
+    node->lat = lat;
+    node->lon = lon;
+}
+
+void pbf_decode_node(PbfBlock *block, PbfBuffer b,
+        int64_t granularity, int64_t lat_offset, int64_t lon_offset) {
+    int field, wire_type;
+    int64_t id = 0, lat = 0, lon = 0;
+
+    while (pbf_key(&b, &field, &wire_type)) {
+        if (field == 1 && wire_type == 0)
+            id = pbf_svarint(&b);
+        else if (field == 8 && wire_type == 0)
+            lat = pbf_svarint(&b);
+        else if (field == 9 && wire_type == 0)
+            lon = pbf_svarint(&b);
+        else
+            pbf_skip(&b, wire_type);
+    }
+
+    pbf_add_node(block, id, 1e-9 * (lat_offset + granularity*lat),
+            1e-9 * (lon_offset + granularity*lon));
+}
+
+void pbf_decode_dense_nodes(PbfBlock *block, PbfBuffer b,
+        int64_t granularity, int64_t lat_offset, int64_t lon_offset) {
+    PbfBuffer ids, lats, lons;
+    int field, wire_type;
+    int64_t id = 0, lat = 0, lon = 0;
+
+    ids.pos = ids.end = NULL;
+    lats = lons = ids;
+    while (pbf_key(&b, &field, &wire_type)) {
+        if (field == 1 && wire_type == 2)
+            ids = pbf_bytes(&b);
+        else if (field == 8 && wire_type == 2)
+            lats = pbf_bytes(&b);
+        else if (field == 9 && wire_type == 2)
+            lons = pbf_bytes(&b);
+        else
+            pbf_skip(&b, wire_type);
+    }
+
+    // Ids and coordinates are delta coded, in parallel packed arrays
+    while (ids.pos < ids.end) {
+        if (lats.pos >= lats.end || lons.pos >= lons.end)
+            pbf_error("Dense node arrays differ in length");
+
+        id += pbf_svarint(&ids);
+        lat += pbf_svarint(&lats);
+        lon += pbf_svarint(&lons);
+
+        pbf_add_node(block, id, 1e-9 * (lat_offset + granularity*lat),
+                1e-9 * (lon_offset + granularity*lon));
+    }
+}
+
+void pbf_decode_way(PbfBlock *block, PbfBuffer b) {
+    PbfBuffer keys, vals, refs;
+    PbfWay *way;
+    int field, wire_type;
+    int64_t id = 0, ref = 0;
+
+    keys.pos = keys.end = NULL;
+    vals = refs = keys;
+    while (pbf_key(&b, &field, &wire_type)) {
+        if (field == 1 && wire_type == 0)
+            id = pbf_varint(&b);
+        else if (field == 2 && wire_type == 2)
+            keys = pbf_bytes(&b);
+        else if (field == 3 && wire_type == 2)
+            vals = pbf_bytes(&b);
+        else if (field == 8 && wire_type == 2)
+            refs = pbf_bytes(&b);
+        else
+            pbf_skip(&b, wire_type);
+    }
+
+    block->ways = pbf_grow(block->ways, &block->ways_allocated,
+            block->nrof_ways + 1, sizeof(PbfWay));
+    way = &block->ways[block->nrof_ways++];
+    way->id = id;
+    way->first_tag = block->nrof_tags;
+    way->nrof_tags = 0;
+    way->first_ref = block->nrof_refs;
+    way->nrof_refs = 0;
+
+    while (keys.pos < keys.end) {
+        unsigned int k, v;
+
+        if (vals.pos >= vals.end)
+            pbf_error("Way keys and values differ in length");
+        k = pbf_varint(&keys);
+        v = pbf_varint(&vals);
+        if (k >= block->nrof_strings || v >= block->nrof_strings)
+            pbf_error("String index out of range");
+
+        block->tags = pbf_grow(block->tags, &block->tags_allocated,
+                2*(block->nrof_tags + 1), sizeof(unsigned int));
+        block->tags[2*block->nrof_tags] = k;
+        block->tags[2*block->nrof_tags + 1] = v;
+        block->nrof_tags++;
+        way->nrof_tags++;
+    }
+
+    // Node references are delta coded
+    while (refs.pos < refs.end) {
+        ref += pbf_svarint(&refs);
+        block->refs = pbf_grow(block->refs, &block->refs_allocated,
+                block->nrof_refs + 1, sizeof(int64_t));
+        block->refs[block->nrof_refs++] = ref;
+        way->nrof_refs++;
+    }
+}
+
+// Decode a PrimitiveBlock into the node and way arrays of the block
+void pbf_decode_primitive_block(PbfReader *r, PbfBlock *block, PbfBuffer b) {
+    int field, wire_type, i;
+    int64_t granularity = 100, lat_offset = 0, lon_offset = 0;
+
+    block->nrof_strings = 0;
+    block->nrof_groups = 0;
+    block->nrof_nodes = 0;
+    block->nrof_ways = 0;
+    block->nrof_tags = 0;
+    block->nrof_refs = 0;
+
+    // The coordinate scaling comes after the groups, so find it first
+    while (pbf_key(&b, &field, &wire_type)) {
+        if (field == 1 && wire_type == 2) {
+            pbf_read_string_table(block, pbf_bytes(&b));
+        } else if (field == 2 && wire_type == 2) {
+            block->groups = pbf_grow(block->groups, &block->groups_allocated,
+                    block->nrof_groups + 1, sizeof(PbfBuffer));
+            block->groups[block->nrof_groups++] = pbf_bytes(&b);
+        } else if (field == 17 && wire_type == 0) {
+            granularity = pbf_varint(&b);
+        } else if (field == 19 && wire_type == 0) {
+            lat_offset = pbf_varint(&b);
+        } else if (field == 20 && wire_type == 0) {
+            lon_offset = pbf_varint(&b);
+        } else {
+            pbf_skip(&b, wire_type);
+        }
+    }
+
+    for (i = 0; i < block->nrof_groups; i++) {
+        PbfBuffer group = block->groups[i];
+
+        while (pbf_key(&group, &field, &wire_type)) {
+            if (field == 1 && wire_type == 2 && r->handler->node)
+                pbf_decode_node(block, pbf_bytes(&group), granularity, lat_offset, lon_offset);
+            else if (field == 2 && wire_type == 2 && r->handler->node)
+                pbf_decode_dense_nodes(block, pbf_bytes(&group), granularity, lat_offset, lon_offset);
+            else if (field == 3 && wire_type == 2 && r->handler->way_start)
+                pbf_decode_way(block, pbf_bytes(&group));
+            else
+                pbf_skip(&group, wire_type);
+        }
+    }
+}
+
+void pbf_block_decode(PbfReader *r, PbfBlock *block) {
+    PbfBuffer b;
+
+    b = pbf_block_inflate(block);
+    if (block->is_header) {
+        pbf_check_header(b);
+        block->nrof_nodes = 0;
+        block->nrof_ways = 0;
+    } else {
+        pbf_decode_primitive_block(r, block, b);
+    }
+}
+
+// Pass a decoded block on to the handler, called in file order
+void pbf_block_emit(PbfReader *r, PbfBlock *block) {
+    OsmHandler *h = r->handler;
+    int i, j;
+
+    for (i = 0; i < block->nrof_nodes; i++) {
+        PbfNode *node = &block->nodes[i];
+        h->node(h->data, node->id, node->lat, node->lon);
+    }
+
+    for (i = 0; i < block->nrof_ways; i++) {
+        PbfWay *way = &block->ways[i];
+
+        h->way_start(h->data, way->id);
+        for (j = way->first_tag; j < way->first_tag + way->nrof_tags; j++) {
+            h->way_tag(h->data, block->string_table[block->tags[2*j]],
+                    block->string_table[block->tags[2*j + 1]]);
+        }
+        for (j = way->first_ref; j < way->first_ref + way->nrof_refs; j++)
+            h->way_node(h->data, block->refs[j]);
+        h->way_end(h->data);
+    }
+}
+
+void * pbf_worker(void *data) {
+    PbfReader *r = data;
+    PbfBlock *block;
+    int i;
+
+    pthread_mutex_lock(&r->lock);
+    for (;;) {
+        // Take the oldest block waiting to be decoded
+        block = NULL;
+        for (i = 0; i < r->nrof_blocks; i++) {
+            if (r->blocks[i].state == PBF_BLOCK_READ &&
+                    (!block || r->blocks[i].seq < block->seq))
+                block = &r->blocks[i];
+        }
+
+        if (block) {
+            block->state = PBF_BLOCK_DECODING;
+            pthread_mutex_unlock(&r->lock);
+
+            pbf_block_decode(r, block);
+
+            pthread_mutex_lock(&r->lock);
+            block->state = PBF_BLOCK_DONE;
+            pthread_cond_broadcast(&r->done_cond);
+            continue;
+        }
+
+        if (r->quit)
+            break;
+        pthread_cond_wait(&r->work_cond, &r->lock);
+    }
+    pthread_mutex_unlock(&r->lock);
+
+    return NULL;
+}
+
+// Wait for a submitted block to be decoded, then emit it and free the slot
+void pbf_block_finish(PbfReader *r, PbfBlock *block) {
+    pthread_mutex_lock(&r->lock);
+    while (block->state != PBF_BLOCK_DONE)
+        pthread_cond_wait(&r->done_cond, &r->lock);
+    pthread_mutex_unlock(&r->lock);
+
+    pbf_block_emit(r, block);
+    block->state = PBF_BLOCK_EMPTY;
+}
+
+int pbf_parse_file(const char *filename, OsmHandler *handler, int nrof_threads) {
+    PbfReader r;
+    PbfBlock *block;
+    FILE *fp;
+    int i, seq;
+
+    fp = fopen(filename, "r");
+    if (!fp)
+        return -1;
+
+    if (nrof_threads < 1)
+        nrof_threads = 1;
+
+    r.handler = handler;
+    r.quit = 0;
+    r.nrof_threads = nrof_threads;
+    r.nrof_blocks = PBF_BLOCKS_PER_THREAD * nrof_threads;
+    r.blocks = calloc(r.nrof_blocks, sizeof(PbfBlock));
+    r.threads = malloc(nrof_threads * sizeof(pthread_t));
+    pthread_mutex_init(&r.lock, NULL);
+    pthread_cond_init(&r.work_cond, NULL);
+    pthread_cond_init(&r.done_cond, NULL);
+
+    for (i = 0; i < nrof_threads; i++) {
+        if (pthread_create(&r.threads[i], NULL, pbf_worker, &r))
+            pbf_error("Couldn't create decoder thread");
+    }
+
+    // Blocks are used round robin, so a slot in use always holds the
+    // oldest block, which must be emitted before the slot is reused
+    for (seq = 0; ; seq++) {
+        block = &r.blocks[seq % r.nrof_blocks];
+        if (block->state != PBF_BLOCK_EMPTY)
+            pbf_block_finish(&r, block);
+
+        if (!pbf_read_blob(fp, block))
+            break;
+
+        pthread_mutex_lock(&r.lock);
+        block->seq = seq;
+        block->state = PBF_BLOCK_READ;
+        pthread_cond_signal(&r.work_cond);
+        pthread_mutex_unlock(&r.lock);
+    }
+
+    // Emit the blocks still in flight, oldest first
+    for (i = 1; i < r.nrof_blocks; i++) {
+        block = &r.blocks[(seq + i) % r.nrof_blocks];
+        if (block->state != PBF_BLOCK_EMPTY)
+            pbf_block_finish(&r, block);
+    }
+
+    pthread_mutex_lock(&r.lock);
+    r.quit = 1;
+    pthread_cond_broadcast(&r.work_cond);
+    pthread_mutex_unlock(&r.lock);
+    for (i = 0; i < nrof_threads; i++)
+        pthread_join(r.threads[i], NULL);
+
+    for (i = 0; i < r.nrof_blocks; i++) {
+        block = &r.blocks[i];
+        free(block->blob);
+        free(block->data);
+        free(block->strings);
+        free(block->string_table);
+        free(block->groups);
+        free(block->nodes);
+        free(block->ways);
+        free(block->tags);
+        free(block->refs);
+    }
+    free(r.blocks);
+    free(r.threads);
+    pthread_mutex_destroy(&r.lock);
+    pthread_cond_destroy(&r.work_cond);
+    pthread_cond_destroy(&r.done_cond);
+    fclose(fp);
+
+    return 0;
+}
@@ -0,0 +1,313 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "mapgenerator.h"
+
+// Point to point routing over a RoutingIndex with A*
+//
+// The cost of a way is taken from the compiled profile, and the remaining
+// cost from a node is estimated by the distance to the target, scaled by
+// the smallest factor of any tagset so that it never overestimates. Open
+// nodes are kept in a NodeHeap, so that the key of a node can be lowered
+// in place when a cheaper route to it is found.
+//
+// The search state of the nodes is kept between queries. Each node
+// remembers the query that last touched it, so a new query only bumps the
+// query number instead of clearing the arrays.
+
+// Compute the length of every way of a routing index, the first time it is
+// needed. Call it before sharing the index between threads.
+void routing_index_way_lengths(RoutingIndex *ri) {
+    unsigned int i, w;
+
+    if (ri->way_lengths)
+        return;
+
+    ri->way_lengths = malloc(ri->nrof_ways * sizeof(double));
+    if (ri->nrof_ways > 0 && !ri->way_lengths) {
+        fprintf(stderr, "Couldn't allocate memory for way lengths\n");
+        exit(-1);
+    }
+    for (i = 0; i < ri->nrof_nodes; i++) {
+        RoutingNode *nd = &ri->nodes[i];
+        for (w = nd->way.start; w < nd->way.end; w++) {
+            RoutingNode *next = &ri->nodes[ri->ways[w].next];
+            ri->way_lengths[w] = distance(nd->lat, nd->lon, next->lat, next->lon);
+        }
+    }
+}
+
+// Compile a profile for a routing index. The lengths of the ways are
+// computed the first time a profile is compiled for the index, so compile
+// all profiles before sharing the index between threads.
+CompiledProfile * profile_compile(RoutingIndex *ri, RoutingProfile *profile) {
+    CompiledProfile *cp = malloc(sizeof(CompiledProfile));
+    unsigned int i, j;
+
+    routing_index_way_lengths(ri);
+
+    cp->profile = profile;
+    cp->ri = ri;
+    cp->tagset_factors = malloc((ri->nrof_tagsets ? ri->nrof_tagsets : 1) * sizeof(double));
+    cp->min_factor = 0.0;
+    cp->max_factor = 0.0;
+    for (i = 0; i < ri->nrof_tagsets; i++) {
+        RoutingTagSet *tagset = (void *)ri->tagsets + ri->tagset_offsets[i];
+        double factor = 1.0;
+
+        for (j = 0; j < tagset->size; j++)
+            factor *= profile->penalty[tagset->tags[j]];
+        cp->tagset_factors[i] = factor;
+        if (i == 0 || factor < cp->min_factor)
+            cp->min_factor = factor;
+        if (i == 0 || factor > cp->max_factor)
+            cp->max_factor = factor;
+    }
+
+    return cp;
+}
+
+void profile_free(CompiledProfile *cp) {
+    free(cp->tagset_factors);
+    free(cp);
+}
+
+Router * router_new(CompiledProfile *profile) {
+    RoutingIndex *ri = profile->ri;
+    Router *router = malloc(sizeof(Router));
+
+    router->ri = ri;
+    router->profile = profile;
+    router->cost = malloc(ri->nrof_nodes * sizeof(double));
+    router->previous = malloc(ri->nrof_nodes * sizeof(unsigned int));
+    router->touched = calloc(ri->nrof_nodes, sizeof(unsigned int));
+    if (!router->cost || !router->previous || !router->touched) {
+        fprintf(stderr, "Couldn't allocate memory for the router\n");
+        exit(-1);
+    }
+    node_heap_init(&router->heap, ri->nrof_nodes);
+    router->query = 0;
+    router->nrof_settled = 0;
+
+    // The cheapest way per meter bounds the cost of the remaining route
+    router->heuristic_factor = profile->min_factor;
+
+    return router;
+}
+
+void router_free(Router *router) {
+    free(router->cost);
+    free(router->previous);
+    free(router->touched);
+    node_heap_free(&router->heap);
+    free(router);
+}
+
+void route_free(Route *route) {
+    free(route->nodes);
+    free(route);
+}
+
+// Reset the state of a node the first time the current query reaches it
+void router_touch(Router *router, unsigned int node) {
+    if (router->touched[node] != router->query) {
+        router->touched[node] = router->query;
+        router->cost[node] = INFINITY;
+        router->heap.position[node] = NODE_HEAP_NOT_SEEN;
+    }
+}
+
+void node_heap_init(NodeHeap *heap, unsigned int nrof_nodes) {
+    heap->entries = malloc(nrof_nodes * sizeof(NodeHeapEntry));
+    heap->position = malloc(nrof_nodes * sizeof(int));
+    if (nrof_nodes > 0 && (!heap->entries || !heap->position)) {
+        fprintf(stderr, "Couldn't allocate memory for the node heap\n");
+        exit(-1);
+    }
+    heap->size = 0;
+}
+
+void node_heap_free(NodeHeap *heap) {
+    free(heap->entries);
+    free(heap->position);
+}
+
+void node_heap_set(NodeHeap *heap, int i, NodeHeapEntry entry) {
+    heap->entries[i] = entry;
+    heap->position[entry.node] = i;
+}
+
+// Move an entry towards the root until its parent has a lower key
+void node_heap_up(NodeHeap *heap, int i) {
+    NodeHeapEntry entry = heap->entries[i];
+
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (heap->entries[parent].key <= entry.key)
+            break;
+        node_heap_set(heap, i, heap->entries[parent]);
+        i = parent;
+    }
+    node_heap_set(heap, i, entry);
+}
+
+// Move an entry towards the leaves until its children have higher keys
+void node_heap_down(NodeHeap *heap, int i) {
+    NodeHeapEntry entry = heap->entries[i];
+
+    for (;;) {
+        int child = 2*i + 1;
+        if (child >= heap->size)
+            break;
+        if (child + 1 < heap->size && heap->entries[child + 1].key < heap->entries[child].key)
+            child++;
+        if (entry.key <= heap->entries[child].key)
+            break;
+        node_heap_set(heap, i, heap->entries[child]);
+        i = child;
+    }
+    node_heap_set(heap, i, entry);
+}
+
+// Add a node to the heap, or lower its key if it is already there. The
+// position of a node not in the heap must be one of the negative states.
+void node_heap_update(NodeHeap *heap, unsigned int node, double key) {
+    int i = heap->position[node];
+
+    if (i < 0) {
+        i = heap->size++;
+        heap->entries[i].node = node;
+        heap->position[node] = i;
+    }
+    heap->entries[i].key = key;
+    node_heap_up(heap, i);
+}
+
+// Remove the node with the lowest key and mark it closed
+unsigned int node_heap_pop(NodeHeap *heap) {
+    unsigned int node = heap->entries[0].node;
+
+    heap->size--;
+    if (heap->size > 0) {
+        heap->entries[0] = heap->entries[heap->size];
+        node_heap_down(heap, 0);
+    }
+    heap->position[node] = NODE_HEAP_CLOSED;
+    return node;
+}
+
+// Make a route of the given node indices, with their positions copied
+Route * route_new(RoutingIndex *ri, unsigned int *path, int count, double cost) {
+    Route *route = malloc(sizeof(Route));
+    int i;
+
+    route->nrof_nodes = count;
+    route->nodes = malloc(count * sizeof(RoutingNode));
+    route->length = 0.0;
+    route->cost = cost;
+    for (i = 0; i < count; i++) {
+        route->nodes[i] = ri->nodes[path[i]];
+        if (i > 0)
+            route->length += distance(route->nodes[i-1].lat, route->nodes[i-1].lon,
+                    route->nodes[i].lat, route->nodes[i].lon);
+    }
+
+    return route;
+}
+
+// Follow the previous nodes back from the target to build the route
+Route * router_make_route(Router *router, unsigned int from, unsigned int to) {
+    Route *route;
+    unsigned int *path;
+    unsigned int n;
+    int i, count;
+
+    count = 1;
+    for (n = to; n != from; n = router->previous[n])
+        count++;
+
+    path = malloc(count * sizeof(unsigned int));
+    n = to;
+    for (i = count - 1; i >= 0; i--) {
+        path[i] = n;
+        n = router->previous[n];
+    }
+
+    route = route_new(router->ri, path, count, router->cost[to]);
+    free(path);
+    return route;
+}
+
+// Find the cheapest route between two node indices of the routing index.
+// Returns NULL if there is none, or if the cheapest is longer than the
+// max_route_length of the profile when that is positive.
+Route * router_route(Router *router, unsigned int from, unsigned int to) {
+    RoutingIndex *ri = router->ri;
+    RoutingProfile *profile = router->profile->profile;
+    RoutingNode *target;
+    Route *route;
+    // No route within the length costs more than with the highest factor
+    double max_cost = profile->max_route_length > 0.0 ?
+        profile->max_route_length * router->profile->max_factor : INFINITY;
+
+    if (from >= ri->nrof_nodes || to >= ri->nrof_nodes)
+        return NULL;
+    target = &ri->nodes[to];
+
+    // Start a new query, clearing the touched marks when the number wraps
+    router->query++;
+    if (router->query == 0) {
+        memset(router->touched, 0, ri->nrof_nodes * sizeof(unsigned int));
+        router->query = 1;
+    }
+    router->heap.size = 0;
+    router->nrof_settled = 0;
+
+    router_touch(router, from);
+    router->cost[from] = 0.0;
+    router->previous[from] = from;
+    node_heap_update(&router->heap, from, router->heuristic_factor *
+            distance(ri->nodes[from].lat, ri->nodes[from].lon, target->lat, target->lon));
+
+    while (router->heap.size > 0) {
+        RoutingNode *nd;
+        unsigned int n, w;
+
+        // The key is a lower bound of any route through the open nodes
+        if (router->heap.entries[0].key > max_cost)
+            break;
+
+        n = node_heap_pop(&router->heap);
+        router->nrof_settled++;
+        if (n == to) {
+            route = router_make_route(router, from, to);
+            if (profile->max_route_length > 0.0 && route->length > profile->max_route_length) {
+                route_free(route);
+                return NULL;
+            }
+            return route;
+        }
+
+        nd = &ri->nodes[n];
+        for (w = nd->way.start; w < nd->way.end; w++) {
+            RoutingWay *way = &ri->ways[w];
+            RoutingNode *next = &ri->nodes[way->next];
+            double cost;
+
+            router_touch(router, way->next);
+            if (router->heap.position[way->next] == NODE_HEAP_CLOSED)
+                continue;
+
+            cost = router->cost[n] + way_cost(router->profile, w);
+            if (cost < router->cost[way->next]) {
+                router->cost[way->next] = cost;
+                router->previous[way->next] = n;
+                node_heap_update(&router->heap, way->next, cost + router->heuristic_factor *
+                        distance(next->lat, next->lon, target->lat, target->lon));
+            }
+        }
+    }
+
+    return NULL;
+}
@@ -3,10 +3,28 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <zlib.h>
 #include "mapgenerator.h"
 
 #define EARTH_RADIUS 6371009
 
+// Arena the cells of lists are allocated from, or NULL to use malloc
+Arena *list_arena = NULL;
+
+// Monotonic wall clock time in seconds, for timing and benchmarks
+double current_time() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
 // Calculate the distance between two points on the earths surface
 double distance(double from_lat, double from_lon, double to_lat, double to_lon) {
     // Earth radius
@@ -34,11 +52,116 @@ double effective_distance(RoutingProfile *profile, RoutingTagSet *tagset,
     return dist;
 }
 
+Arena * arena_new(const char *name, size_t block_size) {
+    Arena *arena = malloc(sizeof(Arena));
+
+    arena->name = name;
+    arena->first = NULL;
+    arena->current = NULL;
+    arena->block_size = block_size;
+    arena->used = 0;
+    arena->peak = 0;
+    arena->reserved = 0;
+    arena->nrof_blocks = 0;
+    return arena;
+}
+
+void * arena_alloc(Arena *arena, size_t size) {
+    ArenaBlock *block = arena->current;
+    void *p;
+
+    size = (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+
+    // Move on to the next block, reusing blocks kept from before a reset
+    while (!block || block->used + size > block->size) {
+        if (block && block->next) {
+            block = block->next;
+            block->used = 0;
+            continue;
+        }
+
+        ArenaBlock *new_block;
+        size_t block_size = size > arena->block_size ? size : arena->block_size;
+        new_block = malloc(sizeof(ArenaBlock) + block_size);
+        if (!new_block) {
+            fprintf(stderr, "Couldn't allocate memory for %s arena\n", arena->name);
+            exit(-1);
+        }
+        new_block->next = NULL;
+        new_block->size = block_size;
+        new_block->used = 0;
+        if (block)
+            block->next = new_block;
+        else
+            arena->first = new_block;
+        arena->reserved += block_size;
+        arena->nrof_blocks++;
+        block = new_block;
+    }
+    arena->current = block;
+
+    p = (char *)(block + 1) + block->used;
+    block->used += size;
+    arena->used += size;
+    if (arena->used > arena->peak)
+        arena->peak = arena->used;
+    return p;
+}
+
+// Release everything allocated from the arena, keeping the blocks
+void arena_reset(Arena *arena) {
+    arena->current = arena->first;
+    if (arena->first)
+        arena->first->used = 0;
+    arena->used = 0;
+}
+
+void arena_free(Arena *arena) {
+    ArenaBlock *block = arena->first;
+
+    while (block) {
+        ArenaBlock *next = block->next;
+        free(block);
+        block = next;
+    }
+    free(arena);
+}
+
+void arena_report(Arena *arena) {
+    printf("Arena %s: %.1f MB peak, %.1f MB in %d blocks\n", arena->name,
+            arena->peak / 1e6, arena->reserved / 1e6, arena->nrof_blocks);
+}
+
+// Allocate list cells from an arena from now on, returns the previous one
+Arena * list_set_arena(Arena *arena) {
+    Arena *previous = list_arena;
+
+    list_arena = arena;
+    return previous;
+}
+
+List * list_cell_new() {
+    if (list_arena)
+        return arena_alloc(list_arena, sizeof(List));
+    return malloc(sizeof(List));
+}
+
+// Free the cells of a list, unless they belong to an arena
+void list_free(List *list) {
+    if (list_arena)
+        return;
+    while (list) {
+        List *next = list->next;
+        free(list);
+        list = next;
+    }
+}
+
 List * list_sorted_insert(List *list, void *data, List_Compare_Cb compare) {
     List *cn;
     List *l;
 
-    l = malloc(sizeof(List));
+    l = list_cell_new();
     l->data = data;
     l->next = NULL;
     l->prev = NULL;
@@ -151,7 +274,7 @@ List * list_sort(List *list, List_Compare_Cb compare) {
 List * list_prepend(List *list, void *data) {
     List *l;
 
-    l = malloc(sizeof(List));
+    l = list_cell_new();
     l->data = data;
     l->next = list;
     l->prev = NULL;
@@ -166,7 +289,7 @@ List * list_append(List *list, void *data) {
     List *l;
     List *ll;
 
-    l = malloc(sizeof(List));
+    l = list_cell_new();
     l->data = data;
     l->next = NULL;
     l->prev = NULL;
@@ -208,6 +331,282 @@ int list_count(List *list) {
     return count;
 }
 
+void vector_init(Vector *vector) {
+    vector->data = NULL;
+    vector->size = 0;
+    vector->allocated = 0;
+}
+
+void vector_append(Vector *vector, void *data) {
+    if (vector->size == vector->allocated) {
+        vector->allocated = vector->allocated ? 2*vector->allocated : 16;
+        vector->data = realloc(vector->data, vector->allocated*sizeof(void *));
+        if (!vector->data) {
+            fprintf(stderr, "Couldn't allocate memory for %d items\n", vector->allocated);
+            exit(-1);
+        }
+    }
+    vector->data[vector->size++] = data;
+}
+
+// Merge sort of the items in [low, high), stable like list_sort
+void vector_merge_sort(void **data, void **buffer, int low, int high, 
+        List_Compare_Cb compare) {
+    int mid, i, j, k;
+
+    if (high - low < 2)
+        return;
+
+    mid = (low + high) / 2;
+    vector_merge_sort(data, buffer, low, mid, compare);
+    vector_merge_sort(data, buffer, mid, high, compare);
+
+    // Merge the sorted halves
+    i = low;
+    j = mid;
+    for (k = low; k < high; k++) {
+        if (j >= high || (i < mid && compare(data[i], data[j]) <= 0))
+            buffer[k] = data[i++];
+        else
+            buffer[k] = data[j++];
+    }
+    memcpy(data + low, buffer + low, (high - low)*sizeof(void *));
+}
+
+// Sort the items with a compare callback taking two items, same as for lists
+void vector_sort(Vector *vector, List_Compare_Cb compare) {
+    void **buffer;
+
+    if (vector->size < 2)
+        return;
+    buffer = malloc(vector->size*sizeof(void *));
+    vector_merge_sort(vector->data, buffer, 0, vector->size, compare);
+    free(buffer);
+}
+
+// Free the array, leaving an empty vector. The items are not freed.
+void vector_free(Vector *vector) {
+    free(vector->data);
+    vector_init(vector);
+}
+
+// Sort nodes by id in place with an LSD radix sort, one byte per pass
+void routing_nodes_sort(RoutingNode *nodes, int count) {
+    RoutingNode *src, *dst, *tmp;
+    unsigned int count_table[256];
+    unsigned int offset, c;
+    int i, pass, sorted;
+
+    // OSM files are usually already sorted by id
+    sorted = 1;
+    for (i = 1; i < count && sorted; i++) {
+        if (nodes[i-1].id > nodes[i].id)
+            sorted = 0;
+    }
+    if (sorted)
+        return;
+
+    tmp = malloc(count * sizeof(RoutingNode));
+    if (!tmp) {
+        fprintf(stderr, "Couldn't allocate memory for sorting nodes\n");
+        exit(-1);
+    }
+
+    src = nodes;
+    dst = tmp;
+    for (pass = 0; pass < 4; pass++) {
+        int shift = 8*pass;
+
+        memset(count_table, 0, sizeof(count_table));
+        for (i = 0; i < count; i++)
+            count_table[(src[i].id >> shift) & 0xff]++;
+
+        // Skip the pass if all ids share this byte
+        if (count_table[(src[0].id >> shift) & 0xff] == count)
+            continue;
+
+        offset = 0;
+        for (i = 0; i < 256; i++) {
+            c = count_table[i];
+            count_table[i] = offset;
+            offset += c;
+        }
+
+        for (i = 0; i < count; i++)
+            dst[count_table[(src[i].id >> shift) & 0xff]++] = src[i];
+
+        // Swap buffers
+        tmp = src;
+        src = dst;
+        dst = tmp;
+    }
+
+    if (src != nodes) {
+        memcpy(nodes, src, count * sizeof(RoutingNode));
+        free(src);
+    } else {
+        free(dst);
+    }
+}
+
+// Build an index mapping OSM ids directly to positions in the node array.
+// Densely numbered ids get a single flat table, otherwise the id space is
+// split into pages which are only allocated where there are nodes.
+NodeIndex * node_index_new(RoutingNode *nodes, int count) {
+    NodeIndex *ni;
+    unsigned int id, span;
+    int i;
+
+    ni = malloc(sizeof(NodeIndex));
+    ni->min_id = 0;
+    ni->max_id = 0;
+    ni->table = NULL;
+    ni->pages = NULL;
+    ni->nrof_pages = 0;
+    ni->dense = 1;
+
+    // An empty index still has a table for the lookup of id 0 to miss in
+    if (count == 0) {
+        ni->table = malloc(sizeof(int));
+        if (!ni->table) {
+            fprintf(stderr, "Couldn't allocate memory for node index\n");
+            exit(-1);
+        }
+        ni->table[0] = -1;
+        return ni;
+    }
+
+    ni->min_id = nodes[0].id;
+    ni->max_id = nodes[0].id;
+    for (i = 1; i < count; i++) {
+        if (nodes[i].id < ni->min_id)
+            ni->min_id = nodes[i].id;
+        if (nodes[i].id > ni->max_id)
+            ni->max_id = nodes[i].id;
+    }
+    span = ni->max_id - ni->min_id + 1;
+
+    if (span != 0 && span / NODE_INDEX_MAX_DENSE_RATIO <= count) {
+        ni->table = malloc(span * sizeof(int));
+        if (!ni->table) {
+            fprintf(stderr, "Couldn't allocate memory for node index\n");
+            exit(-1);
+        }
+        memset(ni->table, -1, span * sizeof(int));
+        for (i = 0; i < count; i++)
+            ni->table[nodes[i].id - ni->min_id] = i;
+    } else {
+        ni->dense = 0;
+        ni->nrof_pages = ((span - 1) >> NODE_INDEX_PAGE_BITS) + 1;
+        ni->pages = calloc(ni->nrof_pages, sizeof(int *));
+        for (i = 0; i < count; i++) {
+            int **page;
+
+            id = nodes[i].id - ni->min_id;
+            page = &ni->pages[id >> NODE_INDEX_PAGE_BITS];
+            if (!*page) {
+                *page = malloc(NODE_INDEX_PAGE_SIZE * sizeof(int));
+                if (!*page) {
+                    fprintf(stderr, "Couldn't allocate memory for node index\n");
+                    exit(-1);
+                }
+                memset(*page, -1, NODE_INDEX_PAGE_SIZE * sizeof(int));
+            }
+            (*page)[id & (NODE_INDEX_PAGE_SIZE - 1)] = i;
+        }
+    }
+
+    return ni;
+}
+
+// Get the position of a node in the node array, or -1 if not found
+int node_index_lookup(NodeIndex *ni, unsigned int id) {
+    int *page;
+
+    if (id < ni->min_id || id > ni->max_id)
+        return -1;
+    id -= ni->min_id;
+
+    if (ni->dense)
+        return ni->table[id];
+
+    page = ni->pages[id >> NODE_INDEX_PAGE_BITS];
+    if (!page)
+        return -1;
+    return page[id & (NODE_INDEX_PAGE_SIZE - 1)];
+}
+
+void node_index_free(NodeIndex *ni) {
+    unsigned int i;
+
+    if (!ni)
+        return;
+
+    free(ni->table);
+    for (i = 0; i < ni->nrof_pages; i++)
+        free(ni->pages[i]);
+    free(ni->pages);
+    free(ni);
+}
+
+// FNV-1a hash of a key/value pair, starting from a seed
+unsigned int tag_hash(unsigned int seed, const char *key, const char *value) {
+    unsigned int hash = 2166136261u ^ seed;
+
+    while (*key)
+        hash = (hash ^ (unsigned char)*key++) * 16777619u;
+    hash = (hash ^ '=') * 16777619u;
+    while (*value)
+        hash = (hash ^ (unsigned char)*value++) * 16777619u;
+    return hash ^ (hash >> 15);
+}
+
+// Find a seed that hashes every key/value pair to its own slot, growing
+// the table until one is found
+TagMatcher * tag_matcher_new(char **keys, char **values, int count) {
+    TagMatcher *tm;
+    unsigned int size, seed;
+    int i;
+
+    tm = malloc(sizeof(TagMatcher));
+    tm->keys = keys;
+    tm->values = values;
+    tm->slots = NULL;
+
+    for (size = 256; ; size *= 2) {
+        tm->mask = size - 1;
+        tm->slots = realloc(tm->slots, size * sizeof(int));
+        for (seed = 0; seed < 10000; seed++) {
+            for (i = 0; i < size; i++)
+                tm->slots[i] = -1;
+            for (i = 0; i < count; i++) {
+                unsigned int slot = tag_hash(seed, keys[i], values[i]) & tm->mask;
+                if (tm->slots[slot] >= 0)
+                    break;
+                tm->slots[slot] = i;
+            }
+            if (i == count) {
+                tm->seed = seed;
+                return tm;
+            }
+        }
+    }
+}
+
+// Return the tag of a key/value pair, or -1 if it is not recognized
+int tag_matcher_lookup(TagMatcher *tm, const char *key, const char *value) {
+    int tag = tm->slots[tag_hash(tm->seed, key, value) & tm->mask];
+
+    if (tag >= 0 && !strcmp(key, tm->keys[tag]) && !strcmp(value, tm->values[tag]))
+        return tag;
+    return -1;
+}
+
+void tag_matcher_free(TagMatcher *tm) {
+    free(tm->slots);
+    free(tm);
+}
+
 int routing_index_bsearch(RoutingNode *nodes, int id, int low, int high) {
     int mid;
 
@@ -228,176 +627,417 @@ int routing_index_find_node(RoutingIndex *ri, int id) {
     return routing_index_bsearch(ri->nodes, id, 0, ri->nrof_nodes-1);
 }
 
-int min_lat_bsearch(RoutingNode **nodes, double lat, int low, int high) {
-    int mid;
-
-    if (high < low) {
-        return high; // no exact match, return closest
-    }
-
-    mid = low + ((high - low) / 2);
-    if (nodes[mid]->lat > lat) {
-        return min_lat_bsearch(nodes, lat, low, mid-1);
-    } else if (nodes[mid]->lat < lat) {
-        return min_lat_bsearch(nodes, lat, mid+1, high);
-    } else {
-        return mid;
-    }
+// Write a section of a routing index or contraction hierarchy, padded with
+// zeros to a multiple of 8 bytes, and add it to the adler32 checksum
+void write_routing_section(FILE *fp, const void *data, unsigned int size, 
+        unsigned int *offset, unsigned long *checksum) {
+    char zeros[8] = { 0 };
+    unsigned int padding = (8 - size % 8) % 8;
+
+    fwrite(data, 1, size, fp);
+    fwrite(zeros, 1, padding, fp);
+    *checksum = adler32(*checksum, data, size);
+    *checksum = adler32(*checksum, (const Bytef *)zeros, padding);
+    *offset += size + padding;
 }
 
-int
-node_sort_by_lat_cb(const void *n1, const void *n2)
-{
-    const RoutingNode *m1 = NULL;
-    const RoutingNode *m2 = NULL;
-
-    if (!n1) return(1);
-    if (!n2) return(-1);
+// Return 1 if an array of count elements of the given size at offset lies
+// within the file and is aligned
+int routing_section_is_valid(RoutingFileHeader *header, unsigned int offset, 
+        unsigned int count, unsigned int size) {
+    if (offset % 8 || offset < sizeof(RoutingFileHeader) || offset > header->file_size)
+        return 0;
+    if (size && count > (header->file_size - offset) / size)
+        return 0;
+    return 1;
+}
 
-    m1 = n1;
-    m2 = n2;
+// Check that the arrays of a routing index only refer to what is in it, so
+// that searches can follow them without checking
+int routing_index_is_valid(RoutingIndex *ri) {
+    unsigned int i, j;
 
-    if (m1->lat > m2->lat)
-        return 1;
-    if (m1->lat < m2->lat)
-        return -1;
-    return 0;
+    for (i = 0; i < ri->nrof_nodes; i++) {
+        RoutingNode *nd = &ri->nodes[i];
+        if (nd->way.start > nd->way.end || nd->way.end > ri->nrof_ways)
+            return 0;
+        if (ri->spatial[i] >= ri->nrof_nodes)
+            return 0;
+    }
+    for (i = 0; i < ri->nrof_ways; i++) {
+        if (ri->ways[i].next >= ri->nrof_nodes || ri->ways[i].tagset >= ri->nrof_tagsets)
+            return 0;
+    }
+    for (i = 0; i < ri->nrof_tagsets; i++) {
+        unsigned int offset = ri->tagset_offsets[i];
+        RoutingTagSet *tagset;
+
+        if (ri->tagset_offsets[i] < 0 || ri->tagsets_size < sizeof(RoutingTagSet)
+                || offset > ri->tagsets_size - sizeof(RoutingTagSet))
+            return 0;
+        tagset = (void *)ri->tagsets + offset;
+        if (tagset->size > (ri->tagsets_size - offset - sizeof(RoutingTagSet)) / sizeof(TAG))
+            return 0;
+        for (j = 0; j < tagset->size; j++) {
+            if (tagset->tags[j] < 0 || tagset->tags[j] >= NROF_TAGS)
+                return 0;
+        }
+    }
+    return 1;
 }
 
-RoutingNode ** ww_nodes_get_sorted_by_lat(RoutingIndex *ri) {
-    int i;
-    RoutingNode **nodes;
-    List *node_list, *cn;
+// Map a routing index file written by the generator. The arrays of the
+// returned index point into the mapping, so nothing is copied and the
+// pages are shared with other processes using the same file. Returns
+// NULL if the file can't be opened or fails validation.
+RoutingIndex * routing_index_open(const char *filename) {
+    RoutingIndex *ri;
+    RoutingFileHeader *header;
+    struct stat st;
+    void *map;
+    uLong checksum;
+    int fd;
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Can't open routing index %s\n", filename);
+        return NULL;
+    }
+    if (fstat(fd, &st) < 0 || st.st_size < sizeof(RoutingFileHeader)) {
+        fprintf(stderr, "Not a routing index: %s\n", filename);
+        close(fd);
+        return NULL;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Can't map routing index %s\n", filename);
+        return NULL;
+    }
 
-    node_list = NULL;
-    for (i = 0; i < ri->nrof_nodes; i++) {
-        node_list = list_prepend(node_list, &ri->nodes[i]);
+    header = map;
+    if (header->magic != ROUTING_FILE_MAGIC || header->version != ROUTING_FILE_VERSION) {
+        fprintf(stderr, "Not a routing index of version %d: %s\n", 
+                ROUTING_FILE_VERSION, filename);
+        munmap(map, st.st_size);
+        return NULL;
+    }
+    if (header->file_size != st.st_size
+            || !routing_section_is_valid(header, header->nodes_offset, 
+                header->nrof_nodes, sizeof(RoutingNode))
+            || !routing_section_is_valid(header, header->ways_offset, 
+                header->nrof_ways, sizeof(RoutingWay))
+            || !routing_section_is_valid(header, header->tagset_offsets_offset, 
+                header->nrof_tagsets, sizeof(int))
+            || !routing_section_is_valid(header, header->tagsets_offset, 
+                header->tagsets_size, 1)
+            || !routing_section_is_valid(header, header->spatial_offset, 
+                header->nrof_nodes, sizeof(unsigned int))) {
+        fprintf(stderr, "Routing index is truncated or corrupt: %s\n", filename);
+        munmap(map, st.st_size);
+        return NULL;
+    }
+    checksum = adler32(adler32(0L, Z_NULL, 0), (const Bytef *)map + sizeof(RoutingFileHeader), 
+            header->file_size - sizeof(RoutingFileHeader));
+    if (checksum != header->checksum) {
+        fprintf(stderr, "Routing index checksum mismatch: %s\n", filename);
+        munmap(map, st.st_size);
+        return NULL;
     }
 
-    node_list = list_sort(node_list, node_sort_by_lat_cb);
-    
-    nodes = malloc(ri->nrof_nodes * sizeof(RoutingNode *));
-    i = 0;
-    cn = node_list;
-    while (cn) {
-        nodes[i++] = (RoutingNode *)(cn->data);
-        cn = cn->next;
+    ri = malloc(sizeof(RoutingIndex));
+    ri->nrof_nodes = header->nrof_nodes;
+    ri->nrof_ways = header->nrof_ways;
+    ri->nrof_tagsets = header->nrof_tagsets;
+    ri->tagsets_size = header->tagsets_size;
+    ri->nodes = (void *)((char *)map + header->nodes_offset);
+    ri->ways = (void *)((char *)map + header->ways_offset);
+    ri->tagset_offsets = (void *)((char *)map + header->tagset_offsets_offset);
+    ri->tagsets = (void *)((char *)map + header->tagsets_offset);
+    ri->spatial = (void *)((char *)map + header->spatial_offset);
+    ri->map = map;
+    ri->way_lengths = NULL;
+    ri->map_size = st.st_size;
+
+    if (!routing_index_is_valid(ri)) {
+        fprintf(stderr, "Routing index is corrupt: %s\n", filename);
+        routing_index_close(ri);
+        return NULL;
     }
+    return ri;
+}
 
-    return nodes;
+// Close a mapped index, or free one built in memory. The tagsets of a built
+// index are those of the generator and are left alone.
+void routing_index_close(RoutingIndex *ri) {
+    free(ri->way_lengths);
+    if (ri->map) {
+        munmap(ri->map, ri->map_size);
+    } else {
+        free(ri->nodes);
+        free(ri->ways);
+        free(ri->spatial);
+    }
+    free(ri);
 }
 
-RoutingNode * ww_find_closest_node(RoutingIndex *ri, RoutingNode **sorted_by_lat, double lat, double lon) {
+// Spatial index of the nodes of a routing index
+//
+// The nodes are ordered as an implicit k-d tree. The node in the middle of
+// a range splits the rest of it, those before it have a lower or equal
+// coordinate and those after it a higher or equal one. The levels split by
+// latitude and longitude in turn. Searches keep track of the box each range
+// lies in and skip the ranges that are farther away than what is sought.
+
+typedef struct _SpatialBox SpatialBox;
+typedef struct _SpatialSearch SpatialSearch;
+
+struct _SpatialBox {
+    double min[2];    // Latitude and longitude
+    double max[2];
+};
+
+struct _SpatialSearch {
+    RoutingIndex *ri;
+    double lat, lon;
+    int k;                  // Nodes sought by a nearest search
+    int count;
+    unsigned int *nodes;    // Nearest found so far, closest first
+    double *distances;
+    double radius;          // Distance of a radius search
+    Routing_Node_Cb cb;
+    void *data;
+};
+
+double spatial_coordinate(RoutingNode *nd, int axis) {
+    return axis ? nd->lon : nd->lat;
+}
 
-    if (!sorted_by_lat) {
-        sorted_by_lat = ww_nodes_get_sorted_by_lat(ri);
+// Partially sort a range of node numbers so that the one at k has the
+// coordinate it would have if sorted, with none higher before it and none
+// lower after it
+void spatial_select(RoutingNode *nodes, unsigned int *order, int low, int high,
+        int k, int axis) {
+    while (high - low > 1) {
+        double pivot = spatial_coordinate(&nodes[order[low + (high - low)/2]], axis);
+        int lt = low, i = low, gt = high;
+
+        // Split into lower than, equal to and higher than the pivot
+        while (i < gt) {
+            double c = spatial_coordinate(&nodes[order[i]], axis);
+            unsigned int tmp = order[i];
+            if (c < pivot) {
+                order[i++] = order[lt];
+                order[lt++] = tmp;
+            } else if (c > pivot) {
+                order[i] = order[--gt];
+                order[gt] = tmp;
+            } else {
+                i++;
+            }
+        }
+
+        if (k < lt)
+            high = lt;
+        else if (k >= gt)
+            low = gt;
+        else
+            return;
     }
+}
 
-    int min_lat_index, i;
-    RoutingNode *nd, *closest;
-    double min_d, distance_to_lat_factor;
+void spatial_build(RoutingNode *nodes, unsigned int *order, int low, int high, int axis) {
+    int mid;
 
-    distance_to_lat_factor = 180.0/(M_PI*EARTH_RADIUS);
+    if (high - low <= 1)
+        return;
 
-    // Get the index of the node with latitude closest to the sought latitude
-    min_lat_index = min_lat_bsearch(sorted_by_lat, lat, 0, ri->nrof_nodes-1);
-    if (min_lat_index < 0 || min_lat_index >= ri->nrof_nodes)
-        return NULL;
+    mid = low + (high - low)/2;
+    spatial_select(nodes, order, low, high, mid, axis);
+    spatial_build(nodes, order, low, mid, !axis);
+    spatial_build(nodes, order, mid + 1, high, !axis);
+}
 
-    closest = sorted_by_lat[min_lat_index];
-    min_d = distance(lat, lon, closest->lat, closest->lon);
-
-    // Check until we find the closest node
-    i = min_lat_index-1;
-    nd = sorted_by_lat[i];
-    while (i >= 0 && abs(nd->lat - lat) < min_d*distance_to_lat_factor) {
-        double d;
-        d = distance(lat, lon, nd->lat, nd->lon);
-        if (d < min_d) {
-            closest = nd;
-            min_d = d;
-        }
-        nd = sorted_by_lat[--i];
+// Order the nodes of an index built by the generator into a k-d tree
+void routing_index_build_spatial(RoutingIndex *ri) {
+    unsigned int i;
+
+    ri->spatial = malloc((ri->nrof_nodes ? ri->nrof_nodes : 1) * sizeof(unsigned int));
+    if (!ri->spatial) {
+        fprintf(stderr, "Couldn't allocate memory for the spatial index\n");
+        exit(-1);
     }
+    for (i = 0; i < ri->nrof_nodes; i++)
+        ri->spatial[i] = i;
+    spatial_build(ri->nodes, ri->spatial, 0, ri->nrof_nodes, 0);
+}
+
+// The least distance, as computed by distance(), from a point to any point
+// in a box. The mean latitude is farthest from the equator, and the scale
+// of longitude lowest, for the point of the box farthest from the equator.
+double spatial_box_distance(SpatialBox *box, double lat, double lon) {
+    double phi = 0.0, lambda = 0.0, phi_m;
+
+    if (lat < box->min[0])
+        phi = (box->min[0] - lat)/180.0*M_PI;
+    else if (lat > box->max[0])
+        phi = (lat - box->max[0])/180.0*M_PI;
+    if (lon < box->min[1])
+        lambda = (box->min[1] - lon)/180.0*M_PI;
+    else if (lon > box->max[1])
+        lambda = (lon - box->max[1])/180.0*M_PI;
+
+    phi_m = (fabs(lat) + fmax(fabs(box->min[0]), fabs(box->max[0])))/360.0*M_PI;
+    return EARTH_RADIUS*sqrt(phi*phi + pow(cos(fmin(phi_m, M_PI/2))*lambda, 2));
+}
 
-    i = min_lat_index+1;
-    nd = sorted_by_lat[i];
-    while (i < ri->nrof_nodes && abs(nd->lat - lat) < min_d*distance_to_lat_factor) {
-        double d;
-        d = distance(lat, lon, nd->lat, nd->lon);
-        if (d < min_d) {
-            closest = nd;
-            min_d = d;
+void spatial_nearest_visit(SpatialSearch *s, int low, int high, int axis, SpatialBox box) {
+    RoutingNode *nd;
+    SpatialBox lower, upper;
+    double d, split;
+    int mid, i;
+
+    if (low >= high)
+        return;
+    if (s->count == s->k && spatial_box_distance(&box, s->lat, s->lon) >= s->distances[s->k - 1])
+        return;
+
+    mid = low + (high - low)/2;
+    nd = &s->ri->nodes[s->ri->spatial[mid]];
+    d = distance(s->lat, s->lon, nd->lat, nd->lon);
+
+    // Insert the node among the nearest, dropping the farthest if full
+    if (s->count < s->k || d < s->distances[s->k - 1]) {
+        i = s->count < s->k ? s->count++ : s->k - 1;
+        while (i > 0 && s->distances[i - 1] > d) {
+            s->nodes[i] = s->nodes[i - 1];
+            s->distances[i] = s->distances[i - 1];
+            i--;
         }
-        nd = sorted_by_lat[++i];
+        s->nodes[i] = s->ri->spatial[mid];
+        s->distances[i] = d;
     }
 
-    return closest;
+    split = spatial_coordinate(nd, axis);
+    lower = upper = box;
+    lower.max[axis] = split;
+    upper.min[axis] = split;
 
+    // The side of the split the point is on first, it has the nearest nodes
+    if ((axis ? s->lon : s->lat) < split) {
+        spatial_nearest_visit(s, low, mid, !axis, lower);
+        spatial_nearest_visit(s, mid + 1, high, !axis, upper);
+    } else {
+        spatial_nearest_visit(s, mid + 1, high, !axis, upper);
+        spatial_nearest_visit(s, low, mid, !axis, lower);
+    }
 }
 
-int * ww_find_nodes(RoutingIndex *ri, RoutingNode **sorted_by_lat, 
-        double lat, double lon, double radius) {
+void spatial_radius_visit(SpatialSearch *s, int low, int high, int axis, SpatialBox box) {
+    RoutingNode *nd;
+    SpatialBox lower, upper;
+    double d, split;
+    int mid;
+
+    if (low >= high || spatial_box_distance(&box, s->lat, s->lon) > s->radius)
+        return;
 
-    if (!sorted_by_lat) {
-        sorted_by_lat = ww_nodes_get_sorted_by_lat(ri);
+    mid = low + (high - low)/2;
+    nd = &s->ri->nodes[s->ri->spatial[mid]];
+    d = distance(s->lat, s->lon, nd->lat, nd->lon);
+    if (d <= s->radius) {
+        if (s->cb)
+            s->cb(s->data, s->ri->spatial[mid], d);
+        s->count++;
     }
 
-    int min_lat_index, i, *result;
-    RoutingNode *nd, *closest;
-    double min_d, max_lat_diff, distance_to_lat_factor;
-    List *l, *nodes;
-        
-    distance_to_lat_factor = 180.0/(M_PI*EARTH_RADIUS);
-    max_lat_diff = radius * distance_to_lat_factor;
+    split = spatial_coordinate(nd, axis);
+    lower = upper = box;
+    lower.max[axis] = split;
+    upper.min[axis] = split;
+    spatial_radius_visit(s, low, mid, !axis, lower);
+    spatial_radius_visit(s, mid + 1, high, !axis, upper);
+}
 
-    nodes = NULL;
+void spatial_search_init(SpatialSearch *s, SpatialBox *box, RoutingIndex *ri,
+        double lat, double lon) {
+    memset(s, 0, sizeof(SpatialSearch));
+    s->ri = ri;
+    s->lat = lat;
+    s->lon = lon;
+    box->min[0] = -90.0;
+    box->max[0] = 90.0;
+    box->min[1] = -180.0;
+    box->max[1] = 180.0;
+}
 
-    // Get the index of the node with latitude closest to the sought latitude
-    min_lat_index = min_lat_bsearch(sorted_by_lat, lat, 0, ri->nrof_nodes-1);
-    if (min_lat_index < 0 || min_lat_index >= ri->nrof_nodes)
-        return NULL;
+// Find the k nodes nearest to a point. Their numbers are stored in nodes
+// and their distances in distances, which may be NULL, closest first.
+// Returns the number found, which is less than k only if the index has
+// fewer nodes.
+int routing_index_nearest(RoutingIndex *ri, double lat, double lon, int k,
+        unsigned int *nodes, double *distances) {
+    SpatialSearch s;
+    SpatialBox box;
+    double *buffer = NULL;
+
+    if (k <= 0)
+        return 0;
+    if (!distances)
+        distances = buffer = malloc(k * sizeof(double));
+
+    spatial_search_init(&s, &box, ri, lat, lon);
+    s.k = k;
+    s.nodes = nodes;
+    s.distances = distances;
+    spatial_nearest_visit(&s, 0, ri->nrof_nodes, 0, box);
+
+    free(buffer);
+    return s.count;
+}
 
-    // Check all nodes which could be close enough, given only latitude
-    i = min_lat_index;
-    nd = sorted_by_lat[i];
-    while (i >= 0 && abs(nd->lat - lat) < max_lat_diff) {
-        double d;
-        d = distance(lat, lon, nd->lat, nd->lon);
-        if (d < radius) {
-            nodes = list_prepend(nodes, &(nd->id));
-        }
-        nd = sorted_by_lat[--i];
-    }
+// Call cb with every node within radius meters of a point, in no
+// particular order. Returns the number of nodes found.
+int routing_index_radius(RoutingIndex *ri, double lat, double lon, double radius,
+        Routing_Node_Cb cb, void *data) {
+    SpatialSearch s;
+    SpatialBox box;
 
-    i = min_lat_index+1;
-    nd = sorted_by_lat[i];
-    while (i < ri->nrof_nodes && abs(nd->lat - lat) < max_lat_diff) {
-        double d;
-        d = distance(lat, lon, nd->lat, nd->lon);
-        if (d < radius) {
-            nodes = list_prepend(nodes, &(nd->id));
-        }
-        nd = sorted_by_lat[++i];
-    }
+    spatial_search_init(&s, &box, ri, lat, lon);
+    s.radius = radius;
+    s.cb = cb;
+    s.data = data;
+    spatial_radius_visit(&s, 0, ri->nrof_nodes, 0, box);
 
-    // Build return array
-    result = malloc(sizeof(int) * (list_count(nodes)+1));
-    for (i = 0, l = nodes; l; i++, l = l->next) {
-        int *id;
-        id = l->data;
-        result[i] = *id;
-    }
-    result[i] = -1;
+    return s.count;
+}
 
-    // Free list
-    l = nodes;
-    while (l) {
-        List *ll = l->next;
-        free(l);
-        l = ll;
-    }
+typedef struct _SpatialBuffer SpatialBuffer;
 
-    return result;
+struct _SpatialBuffer {
+    unsigned int *nodes;
+    int size;
+    int count;
+};
+
+void
+spatial_buffer_cb(void *data, unsigned int node, double distance) {
+    SpatialBuffer *buffer = data;
+
+    if (buffer->count < buffer->size)
+        buffer->nodes[buffer->count] = node;
+    buffer->count++;
 }
 
+// Store the numbers of the nodes within radius meters of a point in a
+// buffer of the given size. Returns the number of nodes found, which may
+// be more than were stored, like snprintf.
+int routing_index_radius_nodes(RoutingIndex *ri, double lat, double lon, double radius,
+        unsigned int *nodes, int size) {
+    SpatialBuffer buffer;
+
+    buffer.nodes = nodes;
+    buffer.size = size;
+    buffer.count = 0;
+    return routing_index_radius(ri, lat, lon, radius, spatial_buffer_cb, &buffer);
+}
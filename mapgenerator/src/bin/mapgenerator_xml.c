@@ -0,0 +1,435 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "mapgenerator.h"
+
+// Scanner for the subset of XML used by OSM files
+//
+// The file is mapped and scanned in place. Element boundaries are found
+// with memchr, attribute values are used where they lie in the file and
+// numbers are parsed directly from them. Only tag keys and values are
+// copied, to NUL terminate them and resolve entities. Input that uses XML
+// features outside this subset, such as a DOCTYPE or CDATA sections, is
+// left to expat.
+
+#define XML_MAX_ATTRIBUTES 16
+#define XML_MAX_STRING 1024
+
+typedef struct _XmlAttribute XmlAttribute;
+typedef struct _XmlScanner XmlScanner;
+
+struct _XmlAttribute {
+    const char *name;
+    int name_length;
+    const char *value;
+    int value_length;
+};
+
+struct _XmlScanner {
+    const char *content;
+    const char *pos;
+    const char *end;
+    OsmHandler *handler;
+    int started; // Set when the first element has been passed to the handler
+    int in_way;
+    XmlAttribute attributes[XML_MAX_ATTRIBUTES];
+    int nrof_attributes;
+    char key[XML_MAX_STRING];
+    char value[XML_MAX_STRING];
+};
+
+// Powers of ten that are exact in a double
+const double xml_powers_of_ten[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+void xml_error(XmlScanner *s, const char *msg) {
+    int line = 1;
+    const char *p;
+
+    for (p = s->content; p < s->pos; p++)
+        if (*p == '\n')
+            line++;
+    fprintf(stderr, "XML: %s at line %d\n", msg, line);
+    if (s->started)
+        fprintf(stderr, "Use -x to parse the file with expat instead.\n");
+    exit(-1);
+}
+
+int xml_is_space(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+// Return a pointer to the first occurrence of a string, or NULL
+const char * xml_find(const char *pos, const char *end, const char *str) {
+    int len = strlen(str);
+
+    while (pos && end - pos >= len) {
+        pos = memchr(pos, str[0], end - pos - len + 1);
+        if (!pos)
+            return NULL;
+        if (!memcmp(pos, str, len))
+            return pos;
+        pos++;
+    }
+    return NULL;
+}
+
+unsigned int xml_parse_uint(const char *p, int length) {
+    unsigned int value = 0;
+    int i;
+
+    for (i = 0; i < length && p[i] >= '0' && p[i] <= '9'; i++)
+        value = 10*value + (p[i] - '0');
+    return value;
+}
+
+// Parse a decimal number, exactly when it has at most 15 significant digits
+// and no exponent, otherwise with strtod
+double xml_parse_double(const char *p, int length) {
+    unsigned long long mantissa = 0;
+    int digits = 0;
+    int decimals = 0;
+    int negative = 0;
+    int i = 0;
+    double value;
+
+    if (i < length && (p[i] == '-' || p[i] == '+'))
+        negative = p[i++] == '-';
+    for (; i < length && p[i] >= '0' && p[i] <= '9'; i++, digits++)
+        mantissa = 10*mantissa + (p[i] - '0');
+    if (i < length && p[i] == '.') {
+        for (i++; i < length && p[i] >= '0' && p[i] <= '9'; i++, digits++, decimals++)
+            mantissa = 10*mantissa + (p[i] - '0');
+    }
+
+    if (i < length || digits > 15 || decimals > 22) {
+        char buf[64];
+        if (length >= sizeof(buf))
+            length = sizeof(buf) - 1;
+        memcpy(buf, p, length);
+        buf[length] = '\0';
+        return strtod(buf, NULL);
+    }
+
+    value = (double)mantissa / xml_powers_of_ten[decimals];
+    return negative ? -value : value;
+}
+
+// Write a code point as UTF-8, return the number of bytes
+int xml_put_utf8(char *out, unsigned int c) {
+    if (c < 0x80) {
+        out[0] = c;
+        return 1;
+    } else if (c < 0x800) {
+        out[0] = 0xc0 | (c >> 6);
+        out[1] = 0x80 | (c & 0x3f);
+        return 2;
+    } else if (c < 0x10000) {
+        out[0] = 0xe0 | (c >> 12);
+        out[1] = 0x80 | ((c >> 6) & 0x3f);
+        out[2] = 0x80 | (c & 0x3f);
+        return 3;
+    }
+    out[0] = 0xf0 | (c >> 18);
+    out[1] = 0x80 | ((c >> 12) & 0x3f);
+    out[2] = 0x80 | ((c >> 6) & 0x3f);
+    out[3] = 0x80 | (c & 0x3f);
+    return 4;
+}
+
+// Copy an attribute value to a NUL terminated string, resolving entities
+void xml_copy_string(XmlScanner *s, char *out, const char *p, int length) {
+    const char *end = p + length;
+    int n = 0;
+
+    while (p < end) {
+        const char *amp = memchr(p, '&', end - p);
+        int chunk = (amp ? amp : end) - p;
+
+        if (n + chunk + 4 >= XML_MAX_STRING)
+            chunk = XML_MAX_STRING - 5 - n;
+        if (chunk < 0)
+            chunk = 0;
+        memcpy(out + n, p, chunk);
+        n += chunk;
+        if (!amp || n + 4 >= XML_MAX_STRING)
+            break;
+
+        p = memchr(amp, ';', end - amp);
+        if (!p)
+            xml_error(s, "Unterminated entity");
+        if (amp[1] == '#') {
+            unsigned int c = amp[2] == 'x' ? strtoul(amp + 3, NULL, 16) : strtoul(amp + 2, NULL, 10);
+            n += xml_put_utf8(out + n, c);
+        } else if (p - amp == 4 && !memcmp(amp, "&amp", 4)) {
+            out[n++] = '&';
+        } else if (p - amp == 3 && !memcmp(amp, "&lt", 3)) {
+            out[n++] = '<';
+        } else if (p - amp == 3 && !memcmp(amp, "&gt", 3)) {
+            out[n++] = '>';
+        } else if (p - amp == 5 && !memcmp(amp, "&quot", 5)) {
+            out[n++] = '"';
+        } else if (p - amp == 5 && !memcmp(amp, "&apos", 5)) {
+            out[n++] = '\'';
+        } else {
+            xml_error(s, "Unknown entity");
+        }
+        p++;
+    }
+    out[n] = '\0';
+}
+
+XmlAttribute * xml_attribute(XmlScanner *s, const char *name) {
+    int i;
+    int len = strlen(name);
+
+    for (i = 0; i < s->nrof_attributes; i++) {
+        if (s->attributes[i].name_length == len && !memcmp(s->attributes[i].name, name, len))
+            return &s->attributes[i];
+    }
+    return NULL;
+}
+
+// Read the attributes of a start tag, return 1 if the element is empty
+int xml_scan_attributes(XmlScanner *s) {
+    const char *p = s->pos;
+    const char *end = s->end;
+
+    s->nrof_attributes = 0;
+    for (;;) {
+        XmlAttribute *a;
+        const char *q;
+        char quote;
+
+        while (p < end && xml_is_space(*p))
+            p++;
+        if (p >= end)
+            xml_error(s, "Unterminated element");
+        if (*p == '>') {
+            s->pos = p + 1;
+            return 0;
+        }
+        if (*p == '/') {
+            if (p + 1 >= end || p[1] != '>')
+                xml_error(s, "Malformed element");
+            s->pos = p + 2;
+            return 1;
+        }
+
+        q = p;
+        while (p < end && *p != '=' && !xml_is_space(*p))
+            p++;
+        if (s->nrof_attributes < XML_MAX_ATTRIBUTES) {
+            a = &s->attributes[s->nrof_attributes++];
+            a->name = q;
+            a->name_length = p - q;
+        } else {
+            a = NULL;
+        }
+        while (p < end && xml_is_space(*p))
+            p++;
+        if (p >= end || *p != '=')
+            xml_error(s, "Malformed attribute");
+        p++;
+        while (p < end && xml_is_space(*p))
+            p++;
+        if (p >= end || (*p != '"' && *p != '\''))
+            xml_error(s, "Malformed attribute");
+        quote = *p++;
+        q = memchr(p, quote, end - p);
+        if (!q)
+            xml_error(s, "Unterminated attribute");
+        if (a) {
+            a->value = p;
+            a->value_length = q - p;
+        }
+        p = q + 1;
+    }
+}
+
+void xml_scan_element(XmlScanner *s, const char *name, int name_length) {
+    OsmHandler *h = s->handler;
+    XmlAttribute *a;
+    int empty;
+
+    empty = xml_scan_attributes(s);
+    s->started = 1;
+
+    if (name_length == 4 && !memcmp(name, "node", 4)) {
+        unsigned int id = 0;
+        double lat = 0.0, lon = 0.0;
+
+        if (!h->node)
+            return;
+        if ((a = xml_attribute(s, "id")))
+            id = xml_parse_uint(a->value, a->value_length);
+        if ((a = xml_attribute(s, "lat")))
+            lat = xml_parse_double(a->value, a->value_length);
+        if ((a = xml_attribute(s, "lon")))
+            lon = xml_parse_double(a->value, a->value_length);
+        h->node(h->data, id, lat, lon);
+    } else if (name_length == 3 && !memcmp(name, "way", 3)) {
+        unsigned int id = 0;
+
+        if (!h->way_start)
+            return;
+        if ((a = xml_attribute(s, "id")))
+            id = xml_parse_uint(a->value, a->value_length);
+        h->way_start(h->data, id);
+        s->in_way = 1;
+        if (empty) {
+            h->way_end(h->data);
+            s->in_way = 0;
+        }
+    } else if (!s->in_way) {
+        return;
+    } else if (name_length == 2 && !memcmp(name, "nd", 2)) {
+        if ((a = xml_attribute(s, "ref")))
+            h->way_node(h->data, xml_parse_uint(a->value, a->value_length));
+        else
+            h->way_node(h->data, 0);
+    } else if (name_length == 3 && !memcmp(name, "tag", 3)) {
+        XmlAttribute *k = xml_attribute(s, "k");
+        XmlAttribute *v = xml_attribute(s, "v");
+
+        if (k && v) {
+            xml_copy_string(s, s->key, k->value, k->value_length);
+            xml_copy_string(s, s->value, v->value, v->value_length);
+            h->way_tag(h->data, s->key, s->value);
+        }
+    }
+}
+
+// Check the XML declaration and the prolog for anything the scanner does
+// not handle, return 0 if expat should be used instead
+int xml_check_prolog(XmlScanner *s) {
+    const char *p = s->content;
+    const char *end = s->end;
+    const char *q;
+
+    while (p < end) {
+        p = memchr(p, '<', end - p);
+        if (!p || p + 1 >= end)
+            return 0;
+        if (p[1] == '?') {
+            q = xml_find(p, end, "?>");
+            if (!q)
+                return 0;
+            if (!strncmp(p, "<?xml", 5)) {
+                const char *enc = xml_find(p, q, "encoding");
+                if (enc) {
+                    enc += 8;
+                    while (enc < q && (xml_is_space(*enc) || *enc == '=' || *enc == '"' || *enc == '\''))
+                        enc++;
+                    if (strncasecmp(enc, "UTF-8", 5) && strncasecmp(enc, "US-ASCII", 8))
+                        return 0;
+                }
+            }
+            p = q + 2;
+        } else if (end - p >= 4 && !memcmp(p, "<!--", 4)) {
+            q = xml_find(p, end, "-->");
+            if (!q)
+                return 0;
+            p = q + 3;
+        } else if (p[1] == '!') {
+            // DOCTYPE, possibly declaring entities
+            return 0;
+        } else {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Scan an OSM XML file, passing nodes and ways to the handler. A NULL
+// callback skips that element type. Return -1 if the file can't be read
+// and 1 if it should be parsed with expat, before anything is passed on.
+int xml_scan_file(const char *filename, OsmHandler *handler) {
+    XmlScanner *s;
+    struct stat st;
+    void *content;
+    int fd;
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return -1;
+    }
+    if (st.st_size == 0) {
+        close(fd);
+        return 1;
+    }
+    content = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (content == MAP_FAILED)
+        return -1;
+    madvise(content, st.st_size, MADV_SEQUENTIAL);
+
+    s = malloc(sizeof(XmlScanner));
+    s->content = s->pos = content;
+    s->end = s->content + st.st_size;
+    s->handler = handler;
+    s->started = 0;
+    s->in_way = 0;
+
+    if (!xml_check_prolog(s)) {
+        munmap(content, st.st_size);
+        free(s);
+        return 1;
+    }
+
+    while ((s->pos = memchr(s->pos, '<', s->end - s->pos))) {
+        const char *name;
+        const char *q;
+
+        s->pos++;
+        if (s->pos >= s->end)
+            xml_error(s, "Unterminated element");
+
+        if (*s->pos == '/') {
+            // End tag, only the end of a way matters
+            name = s->pos + 1;
+            q = memchr(name, '>', s->end - name);
+            if (!q)
+                xml_error(s, "Unterminated element");
+            if (s->in_way && q - name >= 3 && !memcmp(name, "way", 3)
+                    && (q - name == 3 || xml_is_space(name[3]))) {
+                handler->way_end(handler->data);
+                s->in_way = 0;
+            }
+            s->pos = q + 1;
+        } else if (*s->pos == '?') {
+            q = xml_find(s->pos, s->end, "?>");
+            if (!q)
+                xml_error(s, "Unterminated processing instruction");
+            s->pos = q + 2;
+        } else if (*s->pos == '!') {
+            if (s->end - s->pos < 3 || memcmp(s->pos, "!--", 3))
+                xml_error(s, "Unsupported markup");
+            q = xml_find(s->pos, s->end, "-->");
+            if (!q)
+                xml_error(s, "Unterminated comment");
+            s->pos = q + 3;
+        } else {
+            name = s->pos;
+            while (s->pos < s->end && !xml_is_space(*s->pos)
+                    && *s->pos != '/' && *s->pos != '>')
+                s->pos++;
+            xml_scan_element(s, name, s->pos - name);
+        }
+    }
+
+    munmap(content, st.st_size);
+    free(s);
+    return 0;
+}
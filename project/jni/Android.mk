@@ -26,6 +26,6 @@ LOCAL_SRC_FILES := \
 	glmapjni.c \
 	glhelper.c \
 
-LOCAL_LDLIBS    := -llog -lGLESv2
+LOCAL_LDLIBS    := -llog -lGLESv2 -lz
 
 include $(BUILD_SHARED_LIBRARY)
@@ -10,14 +10,23 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
 #include <sys/stat.h>
+#include <sys/types.h>
+#include <dirent.h>
 #include <sys/mman.h>
 #include <fcntl.h>
+#include <zlib.h>
 
 #include "glmaploader.h"
 #include "glhelper.h"
 
+TileArchive *tileArchive = NULL;
+z_stream *inflateStream = NULL;
+void *inflateBuffer = NULL;
+int inflateBufferSize = 0;
+
 void unpackLinesToPolygons(int nrofLines, LineDataFormat *lineData, Vec *points,
         LineVertex *lineVertices, int *nrofLineVertices) {
     int i, j, k;
@@ -333,19 +342,364 @@ void unpackPolygons(Tile *tile, int nrofPolygons, PolygonDataFormat *polygonData
     LOGI("Unpacked: %d polygon vertices.\n", tile->nrofPolygonVertices);
 }
 
+void unpackPolygonTriangles(Tile *tile, int nrofPolygons, PolygonDataFormat *polygonData,
+        Vec *points, int *nrofTriangles, int *indices) {
+    int i, j, k, l;
+    int srcIdx, srcTriangle;
+    int tgtIdx = 0;
+
+    tile->nrofPolygonLayers = 0;
+    tile->polygonLayers = NULL;
+
+    // Scan through the polygons and set up the needed layers
+    for (i = 0; i < nrofPolygons; i++) {
+        int found = 0;
+        int thisPolygonVertices = 3*nrofTriangles[i]; 
+
+        for (l = 0; l < tile->nrofPolygonLayers; l++) {
+            if (colorIsEqual(tile->polygonLayers[l].rgba, polygonData[i].rgba)) {
+                tile->polygonLayers[l].nrofVertices += thisPolygonVertices;
+                found = 1;
+                break;
+            }
+        }
+
+        if (!found) {
+            tile->nrofPolygonLayers++;
+            tile->polygonLayers = realloc(tile->polygonLayers, tile->nrofPolygonLayers * sizeof(PolygonLayer));
+            l = tile->nrofPolygonLayers-1;
+            tile->polygonLayers[l].nrofVertices = thisPolygonVertices;
+            for (k = 0; k < 4; k++) tile->polygonLayers[l].rgba[k] = polygonData[i].rgba[k];
+        }
+
+        tile->nrofPolygonVertices += thisPolygonVertices;
+    }
+
+    // Set up start indices
+    if (tile->nrofPolygonLayers > 0)
+        tile->polygonLayers[0].startVertex = 0;
+    for (l = 1; l < tile->nrofPolygonLayers; l++) {
+        tile->polygonLayers[l].startVertex = tile->polygonLayers[l-1].startVertex 
+            + tile->polygonLayers[l-1].nrofVertices;
+    }
+
+    tile->polygonVertices = malloc(tile->nrofPolygonVertices * sizeof(PolygonVertex));
+
+    // Expand the indexed triangles of each polygon into its layer
+    for (l = 0; l < tile->nrofPolygonLayers; l++) {
+        srcIdx = 0;
+        srcTriangle = 0;
+
+        for (i = 0; i < nrofPolygons; i++) {
+            if (colorIsEqual(tile->polygonLayers[l].rgba, polygonData[i].rgba)) {
+                for (j = 0; j < 3*nrofTriangles[i]; j++) {
+                    Vec p = points[srcIdx + indices[3*srcTriangle + j]];
+                    tile->polygonVertices[tgtIdx].x = p.x;
+                    tile->polygonVertices[tgtIdx].y = p.y;
+                    tgtIdx++;
+                }
+            }
+
+            srcIdx += polygonData[i].size;
+            srcTriangle += nrofTriangles[i];
+        }
+    }
+
+    LOGI("Unpacked: %d layers, %d triangle vertices.\n", tile->nrofPolygonLayers,
+            tile->nrofPolygonVertices);
+}
+
+// Decode n varints, values below 128 take the single byte fast path
+const unsigned char * decodeVarints(const unsigned char *p, int n, int *values) {
+    int i;
+
+    for (i = 0; i < n; i++) {
+        unsigned int value = *p++;
+        if (value & 0x80) {
+            int shift = 7;
+            value &= 0x7f;
+            do {
+                value |= (unsigned int)(*p & 0x7f) << shift;
+                shift += 7;
+            } while (*p++ & 0x80);
+        }
+        values[i] = value;
+    }
+    return p;
+}
+
+// Decode n vertices stored as zig-zag encoded deltas of quantized offsets
+// from the tile origin
+const unsigned char * decodeQuantizedVertices(const unsigned char *p, int n,
+        double originX, double originY, GLfloat resolution, Vec *points) {
+    int i, k;
+    int q[2] = { 0, 0 };
+
+    for (i = 0; i < n; i++) {
+        for (k = 0; k < 2; k++) {
+            unsigned int value = *p++;
+            if (value & 0x80) {
+                int shift = 7;
+                value &= 0x7f;
+                do {
+                    value |= (unsigned int)(*p & 0x7f) << shift;
+                    shift += 7;
+                } while (*p++ & 0x80);
+            }
+            q[k] += (int)(value >> 1) ^ -(int)(value & 1);
+        }
+        points[i].x = originX + q[0]*resolution;
+        points[i].y = originY + q[1]*resolution;
+    }
+    return p;
+}
+
+// Return the data of a tile layer, decompressed into a buffer that is reused
+// between loads if it is compressed, or NULL if it can't be decompressed
+void * inflateTileData(void *content, int *size) {
+    int rawSize, packedSize;
+
+    if (*size < 3*sizeof(int) || *(int *)(content) != TILE_COMPRESSED_MAGIC)
+        return content;
+    rawSize = *(int *)(content + sizeof(int));
+    packedSize = *(int *)(content + 2*sizeof(int));
+
+    if (rawSize > inflateBufferSize) {
+        inflateBuffer = realloc(inflateBuffer, rawSize);
+        inflateBufferSize = rawSize;
+    }
+    if (!inflateStream) {
+        inflateStream = calloc(1, sizeof(z_stream));
+        inflateInit(inflateStream);
+    }
+    inflateReset(inflateStream);
+    inflateStream->next_in = content + 3*sizeof(int);
+    inflateStream->avail_in = packedSize;
+    inflateStream->next_out = inflateBuffer;
+    inflateStream->avail_out = rawSize;
+    if (inflate(inflateStream, Z_FINISH) != Z_STREAM_END) {
+        LOGE("Failed to decompress tile data.\n");
+        return NULL;
+    }
+
+    *size = rawSize;
+    return inflateBuffer;
+}
+
+// Unpack the contents of a .line file into the line vertices of a tile
+int parseMapLines(Tile *tile, void *filecontent, int filesize, const char *filename) {
+    int nrofLines = 0;
+    int i, k;
+
+    filecontent = inflateTileData(filecontent, &filesize);
+    if (!filecontent)
+        return 1;
+
+    if (*(int *)(filecontent) == LINE_FILE_MAGIC) {
+        int layout = *(int *)(filecontent + sizeof(int));
+        if (layout == LINE_LAYOUT_QUANTIZED) {
+            int nrofLinePoints;
+            int nrofStyles;
+            int header[2];
+            double originX, originY;
+            GLfloat resolution;
+            LineDataFormat *styles;
+            LineDataFormat *lineData;
+            Vec *linePoints;
+            const unsigned char *stream;
+            nrofLines = *(int *)(filecontent + 2*sizeof(int));
+            nrofLinePoints = *(int *)(filecontent + 3*sizeof(int));
+            originX = *(double *)(filecontent + 4*sizeof(int));
+            originY = *(double *)(filecontent + 4*sizeof(int) + sizeof(double));
+            resolution = *(GLfloat *)(filecontent + 4*sizeof(int) + 2*sizeof(double));
+            nrofStyles = *(int *)(filecontent + 5*sizeof(int) + 2*sizeof(double));
+            LOGI("Found: %d lines, %d quantized vertices, %d styles.\n", 
+                    nrofLines, nrofLinePoints, nrofStyles);
+
+            // Each line is its style index and length followed by its vertices
+            styles = (filecontent + 6*sizeof(int) + 2*sizeof(double));
+            stream = (const unsigned char *)(styles + nrofStyles);
+            lineData = malloc(nrofLines * sizeof(LineDataFormat));
+            linePoints = malloc(nrofLinePoints * sizeof(Vec));
+            for (i = 0, k = 0; i < nrofLines; i++) {
+                stream = decodeVarints(stream, 2, header);
+                lineData[i] = styles[header[0]];
+                lineData[i].length = header[1];
+                stream = decodeQuantizedVertices(stream, header[1], originX, originY,
+                        resolution, &linePoints[k]);
+                k += header[1];
+            }
+            LOGI("Finished reading.\n");
+
+            tile->nrofLineVertices = 2*nrofLinePoints + 6*nrofLines;
+            if (tile->lineVertices)
+                free(tile->lineVertices);
+            tile->lineVertices = malloc(tile->nrofLineVertices * sizeof(LineVertex));
+            LOGI("Parsing map line data.\n");
+            unpackLinesToPolygons(nrofLines, lineData, linePoints, tile->lineVertices, &tile->nrofLineVertices);
+            LOGI("Finished parsing.\n");
+            free(lineData);
+            free(linePoints);
+        } else if (layout == LINE_LAYOUT_EXTRUDED) {
+            // Lines were extruded when the tile was generated, just copy them
+            tile->nrofLineVertices = *(int *)(filecontent + 2*sizeof(int));
+            LOGI("Found: %d extruded line vertices.\n", tile->nrofLineVertices);
+            if (tile->lineVertices)
+                free(tile->lineVertices);
+            tile->lineVertices = malloc(tile->nrofLineVertices * sizeof(LineVertex));
+            memcpy(tile->lineVertices, filecontent + 3*sizeof(int), 
+                    tile->nrofLineVertices * sizeof(LineVertex));
+            LOGI("Finished reading.\n");
+        } else {
+            LOGE("Unknown line layout %d in '%s'.\n", layout, filename);
+            return 1;
+        }
+    } else {
+        int nrofLinePoints;
+        LineDataFormat *lineData;
+        GLfloat *linePoints;
+        nrofLines = *(int *)(filecontent);
+        nrofLinePoints = *(int *)(filecontent + sizeof(int));
+        LOGI("Found: %d lines, %d vertices.\n", nrofLines, nrofLinePoints);
+
+        lineData = (filecontent + 2*sizeof(int));
+        linePoints = (filecontent + 2*sizeof(int) + nrofLines * sizeof(LineDataFormat));
+
+        LOGI("Finished reading.\n");
+
+        // For each line, we get at most twice the number of points, plus one extra node in the beginning and end
+        tile->nrofLineVertices = 2*nrofLinePoints + 6*nrofLines;
+        if (tile->lineVertices)
+            free(tile->lineVertices);
+        tile->lineVertices = malloc(tile->nrofLineVertices * sizeof(LineVertex));
+        LOGI("Parsing map line data.\n");
+        unpackLinesToPolygons(nrofLines, lineData, (Vec *)linePoints, tile->lineVertices, &tile->nrofLineVertices);
+        LOGI("Finished parsing.\n");
+    }
+
+    return 0;
+}
+
+// Unpack the contents of a .poly file into the polygon layers of a tile
+int parseMapPolygons(Tile *tile, void *filecontent, int filesize, const char *filename) {
+    int nrofPolygons = 0;
+    int nrofPolygonVertices = 0;
+    int i, k;
+
+    filecontent = inflateTileData(filecontent, &filesize);
+    if (!filecontent)
+        return 1;
+
+    if (tile->polygonVertices) 
+        free(tile->polygonVertices);
+    if (tile->polygonLayers)
+        free(tile->polygonLayers);
+    tile->nrofPolygonVertices = 0;
+
+    if (*(int *)(filecontent) == POLY_FILE_MAGIC) {
+        int layout = *(int *)(filecontent + sizeof(int));
+        int nrofTriangles;
+        int nrofColors;
+        int header[3];
+        double originX, originY;
+        GLfloat resolution;
+        GLubyte *colors;
+        PolygonDataFormat *polygonData;
+        int *polygonTriangles;
+        const unsigned char *stream;
+        Vec *vertices;
+        int *indices;
+        int vertex, index;
+        if (layout != POLY_LAYOUT_QUANTIZED) {
+            LOGE("Unknown polygon layout %d in '%s'.\n", layout, filename);
+            tile->polygonVertices = NULL;
+            tile->polygonLayers = NULL;
+            tile->nrofPolygonLayers = 0;
+            return 1;
+        }
+        nrofPolygons = *(int *)(filecontent + 2*sizeof(int));
+        nrofPolygonVertices = *(int *)(filecontent + 3*sizeof(int));
+        originX = *(double *)(filecontent + 4*sizeof(int));
+        originY = *(double *)(filecontent + 4*sizeof(int) + sizeof(double));
+        resolution = *(GLfloat *)(filecontent + 4*sizeof(int) + 2*sizeof(double));
+        nrofTriangles = *(int *)(filecontent + 5*sizeof(int) + 2*sizeof(double));
+        nrofColors = *(int *)(filecontent + 6*sizeof(int) + 2*sizeof(double));
+        LOGI("Found: %d polygons, %d quantized vertices, %d triangles.\n", 
+                nrofPolygons, nrofPolygonVertices, nrofTriangles);
+
+        // Each polygon is its color index, size and number of triangles
+        // followed by its vertices and triangle indices
+        colors = (filecontent + 7*sizeof(int) + 2*sizeof(double));
+        stream = colors + 4*nrofColors;
+        polygonData = malloc(nrofPolygons * sizeof(PolygonDataFormat));
+        polygonTriangles = malloc(nrofPolygons * sizeof(int));
+        vertices = malloc(nrofPolygonVertices * sizeof(Vec));
+        indices = malloc(3 * nrofTriangles * sizeof(int));
+        for (i = 0, vertex = 0, index = 0; i < nrofPolygons; i++) {
+            stream = decodeVarints(stream, 3, header);
+            for (k = 0; k < 4; k++) polygonData[i].rgba[k] = colors[4*header[0] + k];
+            polygonData[i].size = header[1];
+            polygonTriangles[i] = header[2];
+            stream = decodeQuantizedVertices(stream, header[1], originX, originY, 
+                    resolution, &vertices[vertex]);
+            stream = decodeVarints(stream, 3*header[2], &indices[index]);
+            vertex += header[1];
+            index += 3*header[2];
+        }
+        LOGI("Finished reading.\n");
+
+        LOGI("Parsing map polygon data.\n");
+        unpackPolygonTriangles(tile, nrofPolygons, polygonData, vertices,
+                polygonTriangles, indices);
+        tile->polygonsTriangulated = 1;
+        free(polygonData);
+        free(polygonTriangles);
+        free(vertices);
+        free(indices);
+    } else {
+        nrofPolygons = *(int *)(filecontent);
+        nrofPolygonVertices = *(int *)(filecontent + sizeof(int));
+        LOGI("Found: %d polygons, %d vertices.\n", nrofPolygons, nrofPolygonVertices);
+
+        PolygonDataFormat *polygonData;
+        GLfloat *vertices;
+        int trianglesOffset;
+        polygonData = (filecontent + 2*sizeof(int));
+        vertices = (filecontent + 2*sizeof(int) + nrofPolygons*sizeof(PolygonDataFormat));
+        trianglesOffset = 2*sizeof(int) + nrofPolygons*sizeof(PolygonDataFormat) 
+            + nrofPolygonVertices*sizeof(Vec);
+        LOGI("Finished reading.\n");
+
+        LOGI("Parsing map polygon data.\n");
+        if (filesize > trianglesOffset) {
+            // Polygons are triangulated, the triangle section follows the vertices
+            int *nrofTriangles;
+            int *indices;
+            nrofTriangles = (filecontent + trianglesOffset + sizeof(int));
+            indices = (filecontent + trianglesOffset + sizeof(int) + nrofPolygons*sizeof(int));
+            LOGI("Found: %d triangles.\n", *(int *)(filecontent + trianglesOffset));
+
+            unpackPolygonTriangles(tile, nrofPolygons, polygonData, (Vec *)vertices,
+                    nrofTriangles, indices);
+            tile->polygonsTriangulated = 1;
+        } else {
+            unpackPolygons(tile, nrofPolygons, polygonData, (Vec *)vertices);
+            tile->polygonsTriangulated = 0;
+        }
+    }
+    LOGI("Finished parsing.\n");
+
+    return 0;
+}
+
 int loadMapTile(char *tilename, Tile *tile) {
     // Load map data from files
-    FILE *fp;
     int fd;
     int filesize;
-    int bytes_read;
+    int result;
     void *filecontent;
     char filename[4096];
-    char tiledir[] = "/sdcard/GLMap/tiles";
-    int nrofLines = 0;
-    int nrofPolygons = 0;
-    int nrofPolygonVertices = 0;
-    int i, k;
+    char tiledir[] = TILE_DIR;
     struct stat st;
 
     // Read in line data
@@ -372,29 +726,12 @@ int loadMapTile(char *tilename, Tile *tile) {
         // TODO Error handle
     }
 
-    int nrofLinePoints;
-    LineDataFormat *lineData;
-    GLfloat *linePoints;
-    nrofLines = *(int *)(filecontent);
-    nrofLinePoints = *(int *)(filecontent + sizeof(int));
-    LOGI("Found: %d lines, %d vertices.\n", nrofLines, nrofLinePoints);
-
-    lineData = (filecontent + 2*sizeof(int));
-    linePoints = (filecontent + 2*sizeof(int) + nrofLines * sizeof(LineDataFormat));
-
-    LOGI("Finished reading.\n");
-
-    // For each line, we get at most twice the number of points, plus one extra node in the beginning and end
-    tile->nrofLineVertices = 2*nrofLinePoints + 6*nrofLines;
-    if (tile->lineVertices)
-        free(tile->lineVertices);
-    tile->lineVertices = malloc(tile->nrofLineVertices * sizeof(LineVertex));
-    LOGI("Parsing map line data.\n");
-    unpackLinesToPolygons(nrofLines, lineData, (Vec *)linePoints, tile->lineVertices, &tile->nrofLineVertices);
-    LOGI("Finished parsing.\n");
+    result = parseMapLines(tile, filecontent, filesize, filename);
 
     munmap(filecontent, filesize);
     close(fd);
+    if (result)
+        return result;
 
     // Read in polygon data
     snprintf(filename, sizeof(filename)-1, "%s/%s.poly", tiledir, tilename);
@@ -419,26 +756,178 @@ int loadMapTile(char *tilename, Tile *tile) {
         close(fd);
         // TODO Error handle
     }
-    nrofPolygons = *(int *)(filecontent);
-    nrofPolygonVertices = *(int *)(filecontent + sizeof(int));
-    LOGI("Found: %d polygons, %d vertices.\n", nrofPolygons, nrofPolygonVertices);
 
-    PolygonDataFormat *polygonData;
-    GLfloat *vertices;
-    polygonData = (filecontent + 2*sizeof(int));
-    vertices = (filecontent + 2*sizeof(int) + nrofPolygons*sizeof(PolygonDataFormat));
-    LOGI("Finished reading.\n");
+    result = parseMapPolygons(tile, filecontent, filesize, filename);
 
-    LOGI("Parsing map polygon data.\n");
-    if (tile->polygonVertices) 
-        free(tile->polygonVertices);
+    munmap(filecontent, filesize);
+    close(fd);
 
-    unpackPolygons(tile, nrofPolygons, polygonData, (Vec *)vertices);
-    LOGI("Finished parsing.\n");
+    return result;
+}
 
-    munmap(filecontent, filesize);
+// Interleave the bits of the tile position, so that tiles close to each
+// other get codes close to each other
+unsigned long long mortonCode(int x, int y) {
+    unsigned long long code = 0;
+    unsigned int ux = (unsigned int)x ^ 0x80000000;
+    unsigned int uy = (unsigned int)y ^ 0x80000000;
+    int i;
+
+    for (i = 0; i < 32; i++) {
+        code |= (unsigned long long)((ux >> i) & 1) << (2*i);
+        code |= (unsigned long long)((uy >> i) & 1) << (2*i + 1);
+    }
+    return code;
+}
+
+// Map a tile archive, tiles are then loaded from it instead of from files
+int openTileArchive(char *filename) {
+    int fd;
+    int *footer;
+    unsigned int indexOffset, indexEnd;
+    struct stat st;
+    TileArchive *archive;
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        LOGI("No tile archive '%s', loading tiles from files.\n", filename);
+        return 1;
+    }
+    if (fstat(fd, &st) < 0 || st.st_size < 5*sizeof(int)) {
+        close(fd);
+        LOGE("Can't read tile archive '%s'.\n", filename);
+        return 1;
+    }
+
+    archive = malloc(sizeof(TileArchive));
+    archive->size = st.st_size;
+    archive->content = mmap(NULL, archive->size, PROT_READ, MAP_SHARED, fd, 0);
     close(fd);
+    if ((archive->content == MAP_FAILED) || (archive->content == NULL)) {
+        free(archive);
+        LOGE("Can't map tile archive '%s'.\n", filename);
+        return 1;
+    }
 
+    // The header is the magic and version, the footer locates the index
+    footer = (int *)(archive->content + archive->size - 3*sizeof(int));
+    if (*(int *)(archive->content) != TILE_ARCHIVE_MAGIC || footer[2] != TILE_ARCHIVE_MAGIC
+            || *(int *)(archive->content + sizeof(int)) != TILE_ARCHIVE_VERSION) {
+        munmap(archive->content, archive->size);
+        free(archive);
+        LOGE("'%s' is not a tile archive of a known version.\n", filename);
+        return 1;
+    }
+
+    // The index must fill the space between its aligned offset and the footer
+    indexOffset = (unsigned int)footer[1];
+    indexEnd = archive->size - 3*sizeof(int);
+    if (footer[0] < 0 || indexOffset < 2*sizeof(int) || indexOffset % 8 != 0
+            || indexOffset > indexEnd
+            || (indexEnd - indexOffset) % sizeof(TileArchiveEntry) != 0
+            || (indexEnd - indexOffset) / sizeof(TileArchiveEntry) != (unsigned int)footer[0]) {
+        munmap(archive->content, archive->size);
+        free(archive);
+        LOGE("The index of tile archive '%s' is corrupt.\n", filename);
+        return 1;
+    }
+    archive->nrofTiles = footer[0];
+    archive->index = (TileArchiveEntry *)(archive->content + indexOffset);
+    LOGI("Opened tile archive '%s' with %d tiles.\n", filename, archive->nrofTiles);
+
+    closeTileArchive();
+    tileArchive = archive;
     return 0;
 }
 
+void closeTileArchive() {
+    if (!tileArchive)
+        return;
+    munmap(tileArchive->content, tileArchive->size);
+    free(tileArchive);
+    tileArchive = NULL;
+}
+
+// Number of levels in the tile pyramid, read from the index of the open
+// archive or from the names of the z<level>_<x>_<y> tile files
+int countTileLevels() {
+    DIR *dir;
+    struct dirent *entry;
+    int level, levels = 1;
+
+    if (tileArchive) {
+        if (tileArchive->nrofTiles > 0)
+            levels = tileArchive->index[tileArchive->nrofTiles - 1].level + 1;
+        return levels;
+    }
+
+    dir = opendir(TILE_DIR);
+    if (!dir) {
+        LOGE("Can't read tile directory '%s'.\n", TILE_DIR);
+        return levels;
+    }
+    while ((entry = readdir(dir)) != NULL) {
+        if (sscanf(entry->d_name, "z%d_", &level) == 1 && level + 1 > levels)
+            levels = level + 1;
+    }
+    closedir(dir);
+
+    return levels;
+}
+
+// Load a tile from the open archive, tiles missing from it are empty
+int loadArchiveTile(int level, int x, int y, Tile *tile) {
+    unsigned long long code = mortonCode(x, y);
+    int low = 0;
+    int high = tileArchive->nrofTiles - 1;
+    TileArchiveEntry *entry = NULL;
+    unsigned int indexOffset;
+    int result;
+
+    while (low <= high) {
+        int mid = (low + high)/2;
+        TileArchiveEntry *e = &tileArchive->index[mid];
+        if (e->level < level || (e->level == level && mortonCode(e->x, e->y) < code)) {
+            low = mid + 1;
+        } else if (e->level == level && e->x == x && e->y == y) {
+            entry = e;
+            break;
+        } else {
+            high = mid - 1;
+        }
+    }
+
+    if (!entry) {
+        LOGI("Tile %d_%d_%d is empty.\n", level, x, y);
+        if (tile->lineVertices)
+            free(tile->lineVertices);
+        if (tile->polygonVertices)
+            free(tile->polygonVertices);
+        if (tile->polygonLayers)
+            free(tile->polygonLayers);
+        tile->lineVertices = NULL;
+        tile->polygonVertices = NULL;
+        tile->polygonLayers = NULL;
+        tile->nrofLineVertices = 0;
+        tile->nrofPolygonVertices = 0;
+        tile->nrofPolygonLayers = 0;
+        return 0;
+    }
+
+    // The layers must lie before the index
+    indexOffset = (void *)tileArchive->index - tileArchive->content;
+    if (entry->lineOffset > indexOffset || entry->lineSize > indexOffset - entry->lineOffset
+            || entry->polygonOffset > indexOffset
+            || entry->polygonSize > indexOffset - entry->polygonOffset) {
+        LOGE("Tile %d_%d_%d is outside of the archive.\n", level, x, y);
+        return 1;
+    }
+
+    result = parseMapLines(tile, tileArchive->content + entry->lineOffset, 
+            entry->lineSize, "archive");
+    if (result)
+        return result;
+    return parseMapPolygons(tile, tileArchive->content + entry->polygonOffset, 
+            entry->polygonSize, "archive");
+}
+
@@ -3,6 +3,16 @@
  *
  */
 
+#define LINE_FILE_MAGIC 0x4c4d4c47 // Line files with a layout header start with this
+#define LINE_LAYOUT_EXTRUDED 1     // Vertices already extruded to LineVertex
+#define LINE_LAYOUT_QUANTIZED 2    // Vertices as zig-zag delta varints from the tile origin
+#define POLY_FILE_MAGIC 0x4c4d5047 // Polygon files with a layout header start with this
+#define POLY_LAYOUT_QUANTIZED 1    // Vertices and triangle indices as varints
+#define TILE_ARCHIVE_MAGIC 0x4c4d4147 // Starts and ends tile archives
+#define TILE_ARCHIVE_VERSION 2
+#define TILE_COMPRESSED_MAGIC 0x4c4d435a // Starts zlib compressed tile data
+#define TILE_DIR "/sdcard/GLMap/tiles" // Tile files when there is no archive
+
 typedef struct _Tile Tile;
 typedef struct _Vec Vec;
 typedef struct _LineVertex LineVertex;
@@ -10,16 +20,20 @@ typedef struct _LineDataFormat LineDataFormat;
 typedef struct _PolygonLayer PolygonLayer;
 typedef struct _PolygonVertex PolygonVertex;
 typedef struct _PolygonDataFormat PolygonDataFormat;
+typedef struct _TileArchiveEntry TileArchiveEntry;
+typedef struct _TileArchive TileArchive;
 
 struct _Tile {
     int x;
     int y;
+    int level;
     GLuint lineVBO;
     GLuint polygonVBO;
     GLuint nrofLineVertices;
     GLuint nrofPolygonLayers;
     GLuint nrofPolygonVertices;
     GLubyte newData;
+    GLubyte polygonsTriangulated;
     PolygonLayer *polygonLayers;
     LineVertex *lineVertices;
     PolygonVertex *polygonVertices;
@@ -66,11 +80,54 @@ struct _PolygonDataFormat {
     GLubyte rgba[4];
 };
 
+// Index entry of a tile in an archive, entries are sorted by level and then
+// by the Morton code of the tile position
+struct _TileArchiveEntry {
+    int level;
+    int x;
+    int y;
+    unsigned int lineOffset;
+    unsigned int lineSize;
+    unsigned int polygonOffset;
+    unsigned int polygonSize;
+};
+
+struct _TileArchive {
+    void *content;
+    int size;
+    int nrofTiles;
+    TileArchiveEntry *index;
+};
+
 
 int loadMapTile(char *tilename, Tile *tile);
 
+int openTileArchive(char *filename);
+
+void closeTileArchive();
+
+int loadArchiveTile(int level, int x, int y, Tile *tile);
+
+int countTileLevels();
+
+unsigned long long mortonCode(int x, int y);
+
+void * inflateTileData(void *content, int *size);
+
+int parseMapLines(Tile *tile, void *filecontent, int filesize, const char *filename);
+
+int parseMapPolygons(Tile *tile, void *filecontent, int filesize, const char *filename);
+
+const unsigned char * decodeVarints(const unsigned char *p, int n, int *values);
+
+const unsigned char * decodeQuantizedVertices(const unsigned char *p, int n,
+        double originX, double originY, GLfloat resolution, Vec *points);
+
 void unpackPolygons(Tile *tile, int nrofPolygons, PolygonDataFormat *polygonData, Vec *points);
 
+void unpackPolygonTriangles(Tile *tile, int nrofPolygons, PolygonDataFormat *polygonData,
+        Vec *points, int *nrofTriangles, int *indices);
+
 void unpackLinesToPolygons(int nrofLines, LineDataFormat *lineData, Vec *points,
         LineVertex *lineVertices, int *nrofLineVertices);
 
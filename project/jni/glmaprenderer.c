@@ -20,6 +20,7 @@
 #define NROF_TILES_X 2
 #define NROF_TILES_Y 2
 #define NROF_TILES NROF_TILES_X*NROF_TILES_Y
+#define PYRAMID_TILE_PIXELS 512
 
 GLuint gLineProgram;
 GLuint gLinevPositionHandle;
@@ -35,6 +36,12 @@ GLuint gPolygonvPositionHandle;
 GLuint gPolygoncPositionHandle;
 GLuint gPolygonScaleXHandle;
 GLuint gPolygonScaleYHandle;
+GLuint gPolygonMeshProgram;
+GLuint gPolygonMeshvPositionHandle;
+GLuint gPolygonMeshcPositionHandle;
+GLuint gPolygonMeshScaleXHandle;
+GLuint gPolygonMeshScaleYHandle;
+GLuint gPolygonMeshColorHandle;
 GLuint gPolygonFillProgram;
 GLuint gPolygonFillvPositionHandle;
 GLuint gPolygonFillColorHandle;
@@ -43,6 +50,8 @@ double yPos = 17.87;
 double zPos = 10.0;
 double tile_size = 5000.0;
 int width, height;
+int useTileArchive;
+int nrofLevels = 1; // Levels in the tile pyramid, found when the tiles are opened
 Tile **tiles;
 static const GLfloat fullscreenCoords[] = {
     -1.0, 1.0, 
@@ -87,6 +96,19 @@ int mapInit() {
     gPolygonvPositionHandle = glGetAttribLocation(gPolygonProgram, "a_position");
     checkGlError("glGetUniformLocation");
 
+    // Set up the program for drawing triangulated polygons
+    gPolygonMeshProgram = createProgram(gPolygonVertexShader, gPolygonMeshFragmentShader);
+    if (!gPolygonMeshProgram) {
+        LOGE("Could not create program.");
+        return 1;
+    }
+    gPolygonMeshcPositionHandle = glGetUniformLocation(gPolygonMeshProgram, "u_center");
+    gPolygonMeshScaleXHandle = glGetUniformLocation(gPolygonMeshProgram, "scaleX");
+    gPolygonMeshScaleYHandle = glGetUniformLocation(gPolygonMeshProgram, "scaleY");
+    gPolygonMeshColorHandle = glGetUniformLocation(gPolygonMeshProgram, "u_color");
+    gPolygonMeshvPositionHandle = glGetAttribLocation(gPolygonMeshProgram, "a_position");
+    checkGlError("glGetUniformLocation");
+
     // Set up the program for filling polygons
     gPolygonFillProgram = createProgram(gPolygonFillVertexShader, gPolygonFillFragmentShader);
     if (!gPolygonFillProgram) {
@@ -114,13 +136,20 @@ int mapInit() {
             tiles[i][j].nrofPolygonLayers = 0;
             tiles[i][j].x = -1;
             tiles[i][j].y = -1;
+            tiles[i][j].level = 0;
             tiles[i][j].newData = 0;
+            tiles[i][j].polygonsTriangulated = 0;
             tiles[i][j].polygonLayers = NULL;
             tiles[i][j].lineVertices = NULL;
             tiles[i][j].polygonVertices = NULL;
         }
     }
 
+    // Load tiles from the archive when there is one
+    useTileArchive = !openTileArchive("/sdcard/GLMap/tiles.map");
+    nrofLevels = countTileLevels();
+    LOGI("Tile pyramid has %d levels.\n", nrofLevels);
+
     // Set general settings
     glEnable(GL_BLEND);
     glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
@@ -148,30 +177,58 @@ int mapSetWindowSize(int w, int h) {
     return 0;
 }
 
+// Pick the coarsest pyramid level that still has detail for the screen resolution
+int mapLevel(double z) {
+    double pixelSize;
+    int level = 0;
+
+    if (height <= 0)
+        return 0;
+
+    pixelSize = 2.0/(z*height);
+    while (level < nrofLevels-1 && 
+            tile_size*(1 << (level+1))/PYRAMID_TILE_PIXELS <= pixelSize)
+        level++;
+
+    return level;
+}
+
 int mapMove(double x, double y, double z) {
-    int i, j;
+    int i, j, level;
+    double levelTileSize;
     char tilename[256];
 
     xPos = x;
     yPos = y;
     zPos = z;
 
+    level = mapLevel(z);
+    levelTileSize = tile_size*(1 << level);
+
     // Check if any new tiles need to be loaded
     for (i = 0; i < NROF_TILES_X; i++) {
         for (j = 0; j < NROF_TILES_Y; j++) {
             int tx, ty, s, t;
 
-            tx = (x - 0.5*tile_size) / tile_size + i;
-            ty = (y - 0.5*tile_size) / tile_size + j;
+            tx = (x - 0.5*levelTileSize) / levelTileSize + i;
+            ty = (y - 0.5*levelTileSize) / levelTileSize + j;
 
             s = tx % NROF_TILES_X;
             t = ty % NROF_TILES_Y;
-            if (tiles[s][t].x != tx || tiles[s][t].y != ty) {
+            if (tiles[s][t].x != tx || tiles[s][t].y != ty || tiles[s][t].level != level) {
                 // Load a tile from disk
-                snprintf(tilename, sizeof(tilename)-1, "%d_%d", tx, ty);
-                loadMapTile(tilename, &tiles[s][t]);
+                if (useTileArchive)
+                    loadArchiveTile(level, tx, ty, &tiles[s][t]);
+                else {
+                    if (level == 0)
+                        snprintf(tilename, sizeof(tilename)-1, "%d_%d", tx, ty);
+                    else
+                        snprintf(tilename, sizeof(tilename)-1, "z%d_%d_%d", level, tx, ty);
+                    loadMapTile(tilename, &tiles[s][t]);
+                }
                 tiles[s][t].x = tx;
                 tiles[s][t].y = ty;
+                tiles[s][t].level = level;
                 tiles[s][t].newData = 1;
             }
         }
@@ -215,6 +272,32 @@ void mapRenderFrame() {
     // Draw polygons
     for (i = 0; i < NROF_TILES_X; i++) {
         for (j = 0; j < NROF_TILES_Y; j++) {
+            if (tiles[i][j].polygonsTriangulated) {
+                // Triangulated polygons are drawn directly, one call per layer
+                glUseProgram(gPolygonMeshProgram);
+                glUniform4f(gPolygonMeshcPositionHandle, x, y, 0.0, 0.0);
+                glUniform1f(gPolygonMeshScaleXHandle, z*(float)(height)/(float)(width));
+                glUniform1f(gPolygonMeshScaleYHandle, z);
+
+                glBindBuffer(GL_ARRAY_BUFFER, tiles[i][j].polygonVBO);
+                glVertexAttribPointer(gPolygonMeshvPositionHandle, 2, GL_FLOAT, GL_FALSE,
+                        0, BUFFER_OFFSET(0));
+                glEnableVertexAttribArray(gPolygonMeshvPositionHandle);
+
+                for (l = 0; l < tiles[i][j].nrofPolygonLayers; l++) {
+                    PolygonLayer *layer = &tiles[i][j].polygonLayers[l];
+
+                    glUniform4f(gPolygonMeshColorHandle,
+                            (GLfloat)(layer->rgba[0])/255.0,
+                            (GLfloat)(layer->rgba[1])/255.0,
+                            (GLfloat)(layer->rgba[2])/255.0,
+                            (GLfloat)(layer->rgba[3])/255.0);
+                    glDrawArrays(GL_TRIANGLES, layer->startVertex, layer->nrofVertices);
+                }
+                checkGlError("glDrawArrays polygons");
+                continue;
+            }
+
             for (l = 0; l < tiles[i][j].nrofPolygonLayers; l++) {
                 PolygonLayer *layer = &tiles[i][j].polygonLayers[l];
 
@@ -60,6 +60,13 @@ static const char gPolygonFragmentShader[] =
     "  gl_FragColor = vec4(0.0, 0.0, 0.0, 1.0);\n"
     "}\n";
 
+static const char gPolygonMeshFragmentShader[] = 
+    "precision mediump float;\n"
+    "uniform vec4 u_color;\n"
+    "void main() {\n"
+    "  gl_FragColor = u_color;\n"
+    "}\n";
+
 static const char gPolygonFillVertexShader[] = 
     "uniform vec4 u_color;\n"
     "attribute vec4 a_position;\n"